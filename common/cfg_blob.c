@@ -0,0 +1,192 @@
+#include "cfg_blob.h"
+#include "crc16.h"
+#include <string.h>
+
+/* The manifest refers to the bank containing the current blob */
+struct cfg_blob_manifest {
+	uint32_t	size;
+	uint16_t	chksum;
+	uint8_t		bank;
+	uint8_t		reserved;
+};
+
+static inline struct cfg_blob_manifest const* cfg_blob_manifest(struct cfg_blob const* b)
+{
+	return cfg_stor_get(&b->manifest);
+}
+
+/* Return the pointer to the i-th chunk of the given bank */
+static inline uint8_t const* cfg_blob_chunk_ptr(struct cfg_blob const* b, unsigned bank, unsigned i)
+{
+	return (uint8_t const*)(b->bank[bank][i / b->per_sec].base + (i % b->per_sec) * b->rec_sz);
+}
+
+int cfg_blob_init(struct cfg_blob* b, unsigned chunk_sz, struct flash_sec const manifest[2],
+		struct flash_sec const* bank0, struct flash_sec const* bank1, unsigned nsec)
+{
+	b->bank[0] = bank0;
+	b->bank[1] = bank1;
+	b->nsec = nsec;
+	b->chunk_sz = chunk_sz;
+	b->rec_sz = cfg_pool_rec_size(chunk_sz, &bank0[0]);
+	b->per_sec = bank0[0].size / b->rec_sz;
+	b->wr.p = 0;
+	b->wr_error = 1;
+	return cfg_stor_init(&b->manifest, sizeof(struct cfg_blob_manifest), manifest);
+}
+
+int cfg_blob_valid(struct cfg_blob const* b)
+{
+	return cfg_blob_manifest(b) != 0;
+}
+
+unsigned cfg_blob_size(struct cfg_blob const* b)
+{
+	struct cfg_blob_manifest const* m = cfg_blob_manifest(b);
+	return m ? m->size : 0;
+}
+
+void const* cfg_blob_chunk(struct cfg_blob const* b, unsigned i, unsigned* sz)
+{
+	struct cfg_blob_manifest const* m = cfg_blob_manifest(b);
+	if (!m || i >= (m->size + b->chunk_sz - 1) / b->chunk_sz) {
+		return 0;
+	}
+	*sz = m->size - i * b->chunk_sz;
+	if (*sz > b->chunk_sz) {
+		*sz = b->chunk_sz;
+	}
+	return cfg_blob_chunk_ptr(b, m->bank, i);
+}
+
+unsigned cfg_blob_read(struct cfg_blob const* b, unsigned off, void* buff, unsigned sz)
+{
+	unsigned i, chunk_sz, copied = 0;
+	for (i = off / b->chunk_sz, off %= b->chunk_sz; copied < sz; ++i, off = 0) {
+		uint8_t const* chunk = cfg_blob_chunk(b, i, &chunk_sz);
+		unsigned n;
+		if (!chunk || off >= chunk_sz) {
+			break;
+		}
+		n = chunk_sz - off;
+		if (n > sz - copied) {
+			n = sz - copied;
+		}
+		memcpy((uint8_t*)buff + copied, chunk + off, n);
+		copied += n;
+	}
+	return copied;
+}
+
+int cfg_blob_verify(struct cfg_blob const* b)
+{
+	struct cfg_blob_manifest const* m = cfg_blob_manifest(b);
+	crc16_t chksum = CRC16_INIT;
+	unsigned i, sz;
+	void const* chunk;
+	if (!m) {
+		return -1;
+	}
+	for (i = 0; (chunk = cfg_blob_chunk(b, i, &sz)); ++i) {
+		chksum = crc16_up_buff(chksum, chunk, sz);
+	}
+	return chksum == m->chksum ? 0 : -1;
+}
+
+int cfg_blob_write_begin(struct cfg_blob* b, unsigned size)
+{
+	struct cfg_blob_manifest const* m = cfg_blob_manifest(b);
+	if (size > cfg_blob_capacity(b)) {
+		return -1;
+	}
+	b->wr_bank = m ? !m->bank : 0;
+	b->wr_size = size;
+	b->wr_pos = 0;
+	b->wr_chksum = CRC16_INIT;
+	b->wr.p = 0;
+	b->wr_error = 0;
+	return 0;
+}
+
+/* Abort writing the blob so the following writes fail till the next cfg_blob_write_begin. Return -1. */
+static int cfg_blob_abort(struct cfg_blob* b)
+{
+	b->wr.p = 0;
+	b->wr_error = 1;
+	return -1;
+}
+
+/* Start writing the next chunk record. Return 0 on success, -1 on flash writing error. */
+static int cfg_blob_chunk_begin(struct cfg_blob* b)
+{
+	unsigned i = b->wr_pos / b->chunk_sz;
+	if (!(i % b->per_sec)) {
+		/* Erase the next data sector */
+		if (
+			cfg_pool_init(&b->pool, b->chunk_sz, &b->bank[b->wr_bank][i / b->per_sec]) ||
+			cfg_pool_erase(&b->pool)
+		) {
+			return -1;
+		}
+	}
+	return cfg_pool_write_begin(&b->pool, &b->wr);
+}
+
+/* Complete the chunk record. Return 0 on success, -1 on flash writing error. */
+static int cfg_blob_chunk_end(struct cfg_blob* b)
+{
+	/* Pad the last chunk */
+	if (cfg_pool_write(&b->wr, 0, b->chunk_sz - b->wr.pos) || cfg_pool_write_end(&b->wr)) {
+		return -1;
+	}
+	b->wr.p = 0;
+	return 0;
+}
+
+int cfg_blob_write(struct cfg_blob* b, void const* data, unsigned sz)
+{
+	if (b->wr_error || sz > b->wr_size - b->wr_pos) {
+		return cfg_blob_abort(b);
+	}
+	while (sz) {
+		unsigned n;
+		if (!b->wr.p && cfg_blob_chunk_begin(b)) {
+			return cfg_blob_abort(b);
+		}
+		n = b->chunk_sz - b->wr.pos;
+		if (n > sz) {
+			n = sz;
+		}
+		if (cfg_pool_write(&b->wr, data, n)) {
+			return cfg_blob_abort(b);
+		}
+		b->wr_chksum = crc16_up_buff(b->wr_chksum, data, n);
+		data = (uint8_t const*)data + n;
+		sz -= n;
+		b->wr_pos += n;
+		if (b->wr.pos == b->chunk_sz && cfg_blob_chunk_end(b)) {
+			return cfg_blob_abort(b);
+		}
+	}
+	return 0;
+}
+
+int cfg_blob_write_end(struct cfg_blob* b)
+{
+	struct cfg_blob_manifest m = {
+		.size = b->wr_size,
+		.chksum = b->wr_chksum,
+		.bank = b->wr_bank
+	};
+	if (b->wr_error || b->wr_pos != b->wr_size || (b->wr.p && cfg_blob_chunk_end(b))) {
+		return cfg_blob_abort(b);
+	}
+	/* The blob is committed once */
+	b->wr_error = 1;
+	return cfg_stor_commit(&b->manifest, &m);
+}
+
+int cfg_blob_delete(struct cfg_blob* b)
+{
+	return cfg_stor_commit(&b->manifest, 0);
+}
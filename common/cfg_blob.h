@@ -0,0 +1,73 @@
+#pragma once
+
+#include "cfg_storage.h"
+
+/*
+ * Large binary object storage. The blob is split onto the chunks stored as the records of the pools
+ * placed on the set of equally sized data sectors. There are 2 banks of data sectors. The new blob is
+ * written to the bank not occupied by the current one and then the manifest referring to it is committed
+ * to the configuration storage. So the blob update is atomic. Readers get direct pointers to chunks in flash.
+ */
+
+struct cfg_blob {
+	struct cfg_storage	manifest;
+	struct flash_sec const*	bank[2]; /* data sectors of the banks */
+	unsigned		nsec;    /* the number of data sectors in the bank */
+	unsigned		chunk_sz;
+	unsigned		rec_sz;  /* chunk record size */
+	unsigned		per_sec; /* the number of chunks per sector */
+	/* Writer state */
+	struct cfg_pool		pool;
+	struct cfg_pool_writer	wr;
+	uint32_t		wr_size;
+	uint32_t		wr_pos;
+	uint16_t		wr_chksum;
+	uint8_t			wr_bank;
+	uint8_t			wr_error; /* the write failed or was not started */
+};
+
+/* Initialize blob storage on boot. The manifest is stored in the configuration storage on the given pair of sectors.
+ * Each bank has nsec data sectors. Return 0 on success, -1 on flash writing error.
+ */
+int cfg_blob_init(struct cfg_blob* b, unsigned chunk_sz, struct flash_sec const manifest[2],
+		struct flash_sec const* bank0, struct flash_sec const* bank1, unsigned nsec);
+
+/* Return the maximum blob size */
+static inline unsigned cfg_blob_capacity(struct cfg_blob const* b)
+{
+	return b->nsec * b->per_sec * b->chunk_sz;
+}
+
+/* Return 1 if the blob was committed, 0 otherwise */
+int cfg_blob_valid(struct cfg_blob const* b);
+
+/* Return the current blob size */
+unsigned cfg_blob_size(struct cfg_blob const* b);
+
+/* Return the pointer to the i-th chunk of the current blob in flash and its size in sz or 0 if there is no such chunk */
+void const* cfg_blob_chunk(struct cfg_blob const* b, unsigned i, unsigned* sz);
+
+/* Copy up to sz bytes of the current blob starting from the given offset. Return the number of bytes copied. */
+unsigned cfg_blob_read(struct cfg_blob const* b, unsigned off, void* buff, unsigned sz);
+
+/* Verify the current blob checksum. Return 0 on success, -1 on checksum mismatch or if there is no blob. */
+int cfg_blob_verify(struct cfg_blob const* b);
+
+/* Start writing the new blob of the given size. The current blob remains accessible till the write completes.
+ * Any failure of the following cfg_blob_write or cfg_blob_write_end aborts the new blob so they fail till
+ * the next cfg_blob_write_begin. Return 0 on success, -1 if the size exceeds capacity.
+ */
+int cfg_blob_write_begin(struct cfg_blob* b, unsigned size);
+
+/* Write the next part of the blob. Return 0 on success, -1 on flash writing error, if the data exceed the blob size
+ * or the write was aborted.
+ */
+int cfg_blob_write(struct cfg_blob* b, void const* data, unsigned sz);
+
+/* Complete writing and make the new blob current. Return 0 on success, -1 on flash writing error,
+ * if not all the blob data were written or the write was aborted.
+ */
+int cfg_blob_write_end(struct cfg_blob* b);
+
+/* Delete the current blob. Return 0 on success, -1 on flash writing error. */
+int cfg_blob_delete(struct cfg_blob* b);
@@ -0,0 +1,277 @@
+#include "cfg_mux.h"
+
+#define TOMBSTONE  0x80
+#define EPOCH_MASK ((uint8_t)~TOMBSTONE)
+
+/*
+ * The records have the following structure:
+ *
+ * data | id | epoch
+ *
+ * The data is padded to the size of the largest item. The padding bytes are not written.
+ * All records of the pool have the same epoch. The epoch of the pool 0 is even, the epoch of the pool 1 is odd.
+ */
+
+#define TAIL_SZ 2
+
+static inline uint8_t rec_id(struct cfg_mux const* m, void const* rec)
+{
+	return *((uint8_t const*)rec + m->pool[0].item_sz - TAIL_SZ);
+}
+
+static inline uint8_t rec_raw_epoch(struct cfg_mux const* m, void const* rec)
+{
+	return *((uint8_t const*)rec + m->pool[0].item_sz - 1);
+}
+
+static inline uint8_t rec_epoch(struct cfg_mux const* m, void const* rec)
+{
+	return rec_raw_epoch(m, rec) & EPOCH_MASK;
+}
+
+static inline int rec_deleted(struct cfg_mux const* m, void const* rec)
+{
+	return (rec_raw_epoch(m, rec) & TOMBSTONE) != 0;
+}
+
+/* Get the latest record of the stream or 0 */
+static inline void const* stream_rec(struct cfg_mux const* m, struct cfg_mux_stream const* s)
+{
+	return s->off < 0 ? 0 : (void const*)(m->pool[s->pool].flash->base + s->off);
+}
+
+/* Set the latest record of the stream to the one at the given offset of the pool */
+static inline void stream_set(struct cfg_mux const* m, struct cfg_mux_stream* s, struct cfg_pool const* pool, int off)
+{
+	s->off = off;
+	s->pool = pool - m->pool;
+}
+
+static inline uint8_t epoch_next(uint8_t e)
+{
+	return (e + 1) & EPOCH_MASK;
+}
+
+static inline uint8_t epoch_prev(uint8_t e)
+{
+	return (e - 1) & EPOCH_MASK;
+}
+
+static inline int8_t epoch_diff(uint8_t a, uint8_t b)
+{
+	return (int8_t)((a - b) << 1) >> 1;
+}
+
+/* Find out storage epoch. Return 0 on success, -1 if pools content is inconsistent. */
+static int cfg_mux_find_epoch(struct cfg_mux* m)
+{
+	void const* rec[2] = {
+		cfg_pool_get(&m->pool[0]),
+		cfg_pool_get(&m->pool[1])
+	};
+	uint8_t epoch[2] = {
+		rec[0] ? rec_epoch(m, rec[0]) : 0,
+		rec[1] ? rec_epoch(m, rec[1]) : 0
+	};
+	if (!rec[0] && !rec[1]) {
+		m->epoch = 0;
+		return 0;
+	}
+	if (
+		(rec[0] && (epoch[0] & 1) != 0) ||
+		(rec[1] && (epoch[1] & 1) != 1)
+	) {
+		return -1;
+	}
+	if (!rec[0]) {
+		m->epoch = epoch[1];
+		return 0;
+	}
+	if (!rec[1]) {
+		m->epoch = epoch[0];
+		return 0;
+	}
+	switch (epoch_diff(epoch[1], epoch[0])) {
+	case -1:
+		m->epoch = epoch[0];
+		return 0;
+	case 1:
+		m->epoch = epoch[1];
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Look for the latest records of the streams not found yet going back from the end of the pool.
+ * Return the number of streams found so far.
+ */
+static unsigned cfg_mux_scan(struct cfg_mux* m, struct cfg_pool const* pool, uint8_t epoch, unsigned nfound)
+{
+	int off;
+	for (off = pool->valid_off; off >= 0 && nfound < m->nstreams; off = cfg_pool_prev_valid(pool, off)) {
+		void const* rec = (void const*)(pool->flash->base + off);
+		uint8_t id = rec_id(m, rec);
+		if (id < m->nstreams && m->streams[id].off < 0 && rec_epoch(m, rec) == epoch) {
+			stream_set(m, &m->streams[id], pool, off);
+			++nfound;
+		}
+	}
+	return nfound;
+}
+
+/* Put the record of the given stream to the given pool. Return 0 on success, -1 on flash writing error. */
+static int cfg_mux_put(struct cfg_mux* m, struct cfg_pool* pool, unsigned id, void const* data)
+{
+	struct cfg_mux_stream* s = &m->streams[id];
+	uint8_t tail[TAIL_SZ] = {id, m->epoch};
+	struct cfg_chunk chunks[3] = {
+		{data, s->item_sz},
+		{0, pool->item_sz - TAIL_SZ - s->item_sz},
+		{tail, TAIL_SZ}
+	};
+	if (!data) {
+		tail[1] |= TOMBSTONE;
+	}
+	if (cfg_pool_put_chunks(pool, chunks, 3)) {
+		return -1;
+	}
+	stream_set(m, s, pool, pool->valid_off);
+	return 0;
+}
+
+/* Copy forward the latest items of the streams still residing in the standby pool to the current one.
+ * Return 0 on success, -1 on flash writing error.
+ */
+static int cfg_mux_forward(struct cfg_mux* m)
+{
+	struct cfg_pool* pool = &m->pool[m->epoch & 1];
+	unsigned i;
+	for (i = 0; i < m->nstreams; ++i) {
+		struct cfg_mux_stream* s = &m->streams[i];
+		void const* rec = stream_rec(m, s);
+		if (!rec || s->pool == (m->epoch & 1)) {
+			continue;
+		}
+		if (rec_deleted(m, rec)) {
+			/* The tombstone is dropped together with the standby pool */
+			s->off = -1;
+			continue;
+		}
+		if (!cfg_pool_has_room(pool) || cfg_mux_put(m, pool, i, rec)) {
+			return -1;
+		}
+	}
+	m->forward = 0;
+	return 0;
+}
+
+/* Get the pool for the next record switching pools if necessary. Return 0 on flash writing error. */
+static struct cfg_pool* cfg_mux_next_pool(struct cfg_mux* m)
+{
+	struct cfg_pool* pool = &m->pool[m->epoch & 1];
+	if (!cfg_pool_valid(pool) && cfg_pool_erase(pool)) {
+		return 0;
+	}
+	if (m->forward && cfg_mux_forward(m)) {
+		/* Switching pools would lose the items not copied yet */
+		return 0;
+	}
+	if (!cfg_pool_has_room(pool)) {
+		/* Switch to other pool */
+		m->epoch = epoch_next(m->epoch);
+		pool = &m->pool[m->epoch & 1];
+		m->forward = 1;
+		if (cfg_pool_erase(pool) || cfg_mux_forward(m)) {
+			return 0;
+		}
+	}
+	return pool;
+}
+
+/* Initialize storage on boot */
+int cfg_mux_init(struct cfg_mux* m, struct cfg_mux_stream* streams, unsigned nstreams, struct flash_sec const flash[2])
+{
+	struct cfg_pool* pool;
+	void const* rec;
+	unsigned i, item_sz = 0, nfound;
+	if (nstreams > CFG_MUX_MAX_STREAMS) {
+		return -1;
+	}
+	for (i = 0; i < nstreams; ++i) {
+		streams[i].off = -1;
+		if (item_sz < streams[i].item_sz) {
+			item_sz = streams[i].item_sz;
+		}
+	}
+	m->streams = streams;
+	m->nstreams = nstreams;
+	m->forward = 0;
+	if (
+		cfg_pool_init(&m->pool[0], item_sz + TAIL_SZ, &flash[0]) ||
+		cfg_pool_init(&m->pool[1], item_sz + TAIL_SZ, &flash[1])
+	) {
+		return -1;
+	}
+	if (
+		flash[0].size / m->pool[0].rec_sz < nstreams + 1 ||
+		flash[1].size / m->pool[1].rec_sz < nstreams + 1
+	) {
+		/* There should be room for copying forward all streams and the new item */
+		return -1;
+	}
+	if (cfg_mux_find_epoch(m)) {
+		return cfg_mux_erase(m);
+	}
+	nfound = cfg_mux_scan(m, &m->pool[m->epoch & 1], m->epoch, 0);
+	cfg_mux_scan(m, &m->pool[~m->epoch & 1], epoch_prev(m->epoch), nfound);
+	/* Complete copy forward interrupted by power failure */
+	if (cfg_mux_forward(m)) {
+		return -1;
+	}
+	/* Seal the current pool so the next boot finds the same records */
+	pool = &m->pool[m->epoch & 1];
+	rec = cfg_pool_get(pool);
+	if (!rec || cfg_pool_sealed(pool) || rec_id(m, rec) >= nstreams) {
+		return 0;
+	}
+	if (!(pool = cfg_mux_next_pool(m))) {
+		return -1;
+	}
+	return cfg_mux_put(m, pool, rec_id(m, rec), rec_deleted(m, rec) ? 0 : rec);
+}
+
+void const* cfg_mux_get(struct cfg_mux const* m, unsigned id)
+{
+	void const* rec;
+	if (id >= m->nstreams || !(rec = stream_rec(m, &m->streams[id])) || rec_deleted(m, rec)) {
+		return 0;
+	}
+	return rec;
+}
+
+int cfg_mux_commit(struct cfg_mux* m, unsigned id, void const* data)
+{
+	struct cfg_pool* pool;
+	if (id >= m->nstreams) {
+		return -1;
+	}
+	if (!(pool = cfg_mux_next_pool(m))) {
+		return -1;
+	}
+	return cfg_mux_put(m, pool, id, data);
+}
+
+int cfg_mux_erase(struct cfg_mux* m)
+{
+	unsigned i;
+	for (i = 0; i < m->nstreams; ++i) {
+		m->streams[i].off = -1;
+	}
+	m->epoch = 0;
+	m->forward = 0;
+	if (cfg_pool_erase(&m->pool[0]) || cfg_pool_erase(&m->pool[1])) {
+		return -1;
+	}
+	return 0;
+}
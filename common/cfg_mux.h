@@ -0,0 +1,52 @@
+#pragma once
+
+#include "cfg_pool.h"
+
+/*
+ * Multiplexed storage keeping several independent item streams in the single pair of sectors.
+ * Every record carries the stream id so the streams share the pool records of the size of the
+ * largest item. The commit writes the single record to the current pool. On pool switch the latest
+ * item of every stream is copied forward to the new pool before the new item is written.
+ * The mount scan looks for the latest record of every stream in the current pool then in the standby one.
+ */
+
+/* The stream descriptor. The item_sz is provided by the caller, the rest is maintained by the storage.
+ * The record is located by its offset since the base address of the virtual sector may change.
+ */
+struct cfg_mux_stream {
+	unsigned	item_sz;
+	int		off;  /* the offset of the latest record or -1 */
+	uint8_t		pool; /* the pool holding the latest record */
+};
+
+struct cfg_mux {
+	struct cfg_pool		pool[2];
+	struct cfg_mux_stream*	streams;
+	unsigned		nstreams;
+	uint8_t			epoch;
+	uint8_t			forward; /* copy forward to the current pool is not completed */
+};
+
+/* The maximum number of streams */
+#define CFG_MUX_MAX_STREAMS 255
+
+/* Initialize storage on boot. The stream id is its index in the streams array. The records
+ * of the stream ids not found in the array are dropped on the next pool switch. Changing the
+ * size of the largest item makes the existing records invalid. Each sector must have room for
+ * at least nstreams + 1 records. Return 0 on success, -1 on flash writing error or if there is
+ * not enough room.
+ */
+int cfg_mux_init(struct cfg_mux* m, struct cfg_mux_stream* streams, unsigned nstreams, struct flash_sec const flash[2]);
+
+/* Get the last committed item of the given stream or 0 if there is no one. The pointer becomes stale
+ * on the next commit or on the maintenance of the virtual sectors the storage resides in.
+ */
+void const* cfg_mux_get(struct cfg_mux const* m, unsigned id);
+
+/* Commit the item of the given stream. The data = 0 deletes the stream item.
+ * Return 0 on success, -1 on flash writing error or if there is no such stream.
+ */
+int cfg_mux_commit(struct cfg_mux* m, unsigned id, void const* data);
+
+/* Erase all streams. Return 0 on success, -1 on flash writing error. */
+int cfg_mux_erase(struct cfg_mux* m);
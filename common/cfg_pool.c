@@ -4,7 +4,6 @@
 #include <string.h>
 
 #define ALIGN_SZ   sizeof(int)
-#define ALIGN_MASK (ALIGN_SZ-1)
 #define MARKER_SZ  sizeof(struct cfg_rec_marker)
 
 /* Validator values */
@@ -38,12 +37,63 @@
  * that writing of the crc16 bytes were not interrupted. In case the complete flag is set we can be sure that
  * validator is itself valid. If the chained flag is not set we have no more data and the next byte was never
  * written.
+ *
+ * The flash with ECC (STM32L4/G4/H7 for example) may only program the whole units of 8 or 32 bytes once between erases.
+ * So the status byte can't be updated and the bytes of the unit can't be written one by one. On such flash the records
+ * have the following structure:
+ *
+ * data | alignment to the unit | crc16 | validator | status | 0xff padding to the unit | next data
+ *
+ * The data units are written first, the marker unit is written last. The marker unit is either erased (so the data
+ * writing was interrupted) or has the validator and complete flag set and matching checksum. Any other content of the
+ * marker means its writing was interrupted. Such record is treated as invalid the same way as the interrupted record
+ * on the flash programmed by bytes. The storage seals the pool by committing the valid record past it. The padding is
+ * never written so the written padding means the sector has unexpected content and should be erased. There is no
+ * chained flag so the scan stops at the first record followed by the erased area. The fixup of the marker is impossible
+ * as well.
+ *
+ * The sector consisting of several segments may be erased lazily. The pool erase clears only the segments holding
+ * the first record, the next segments are erased just before the record crossing the segment boundary is written.
+ * So the segments past the last record may have stale content. It is never seen while scanning the records since
+ * the scan stops at the record without chained flag and only the area up to the end of its segment is checked
+ * to be erased. Such pool is not supported on the flash programmed by units since it has no chained flag.
  */
 
-/* Check if the area past the given offset is erased */
-static int cfg_pool_erased(struct cfg_pool* p, unsigned off)
+/* Check if the flash is programmed by units */
+static inline int cfg_pool_units(struct cfg_pool const* p)
+{
+	return CFG_POOL_UNIT_MAX > 1 && p->flash->prog_unit > 1;
+}
+
+/* Check if the segments of the flash sector are erased lazily */
+static inline int cfg_pool_lazy(struct cfg_pool const* p)
+{
+	return p->flash->seg_sz && p->flash->erase_seg && !cfg_pool_units(p);
+}
+
+/* Return the end of the segment containing the byte preceding the given offset. It is the end of the area
+ * that is expected to be erased past the given offset. Without lazy erase it is the end of the sector.
+ */
+static unsigned cfg_pool_seg_end(struct cfg_pool const* p, unsigned off)
+{
+	unsigned seg_sz = p->flash->seg_sz, end;
+	if (!cfg_pool_lazy(p)) {
+		return p->flash->size;
+	}
+	end = (off + seg_sz - 1) / seg_sz * seg_sz;
+	return end < p->flash->size ? end : p->flash->size;
+}
+
+/* Align size to the power of 2 */
+static inline unsigned cfg_pool_align(unsigned sz, unsigned align)
+{
+	return (sz + align - 1) & ~(align - 1);
+}
+
+/* Check if the area between the given offsets is erased */
+static int cfg_pool_erased(struct cfg_pool* p, unsigned off, unsigned end_off)
 {
-	unsigned const *ptr = (unsigned const*)(p->flash->base + off), *end = (unsigned const*)(p->flash->base + p->flash->size);
+	unsigned const *ptr = (unsigned const*)(p->flash->base + off), *end = (unsigned const*)(p->flash->base + end_off);
 	for (; ptr < end; ++ptr) {
 		if (~*ptr)
 			return 0;
@@ -51,23 +101,96 @@ static int cfg_pool_erased(struct cfg_pool* p, unsigned off)
 	return 1;
 }
 
+/* Check if the record at the given offset is valid */
+static int cfg_pool_rec_valid(struct cfg_pool const* p, unsigned off)
+{
+	unsigned addr = p->flash->base + off;
+	struct cfg_rec_marker const* m = (struct cfg_rec_marker const*)(addr + p->item_sz_aligned);
+	return m->validator == INVALID ? 0 : crc16((void const*)addr, p->item_sz) == m->chksum;
+}
+
+/* Return the offset of the last valid item preceding the given offset or -1 if there is no one */
+int cfg_pool_prev_valid(struct cfg_pool const* p, int off)
+{
+	for (off -= p->rec_sz; off >= 0; off -= p->rec_sz) {
+		if (cfg_pool_rec_valid(p, off)) {
+			return off;
+		}
+	}
+	return -1;
+}
+
+/* Check the marker unit of the record at the given offset. Return 1 if the record is valid, 0 if the marker unit was
+ * never written, 2 if the marker writing was interrupted, -1 if the padding has unexpected content.
+ */
+static int cfg_pool_unit_marker(struct cfg_pool const* p, unsigned off)
+{
+	uint8_t const* ptr = (uint8_t const*)(p->flash->base + off + p->item_sz_aligned);
+	struct cfg_rec_marker const* m = (struct cfg_rec_marker const*)ptr;
+	unsigned i, marker_sz = p->rec_sz - p->item_sz_aligned;
+	int erased = 1;
+	for (i = 0; i < marker_sz; ++i) {
+		if (ptr[i] != 0xff) {
+			erased = 0;
+			if (i >= MARKER_SZ) {
+				return -1;
+			}
+		}
+	}
+	if (erased) {
+		return 0;
+	}
+	return m->validator == VALID && m->status == STA_COMPLETE && cfg_pool_rec_valid(p, off) ? 1 : 2;
+}
+
+/* Initialize pool programmed by units on boot */
+static int cfg_pool_validate_units(struct cfg_pool* p)
+{
+	unsigned off, max_off = p->flash->size - p->rec_sz;
+	for (off = 0; off <= max_off; off += p->rec_sz) {
+		int sta = cfg_pool_unit_marker(p, off);
+		if (sta < 0) {
+			/* The sector has either invalid or partially erased content */
+			cfg_pool_reset(p);
+			return 0;
+		}
+		if (!sta && cfg_pool_erased(p, off, p->flash->size)) {
+			break;
+		}
+		/* The record with data or marker writing interrupted is skipped */
+		p->last_off = off;
+		if (sta == 1) {
+			p->valid_off = off;
+		}
+	}
+	return 0;
+}
+
 /* Initialize pool on boot */
 int cfg_pool_validate(struct cfg_pool* p)
 {
 	uint8_t last_status = STA_CHAINED;
 	unsigned off, base = p->flash->base;
-	unsigned rec_size = p->item_sz_aligned + MARKER_SZ;
+	unsigned rec_size = p->rec_sz;
 	unsigned max_off = p->flash->size - rec_size;
 	int erased, valid = 0;
 
+	if (cfg_pool_units(p)) {
+		return cfg_pool_validate_units(p);
+	}
+
 	/* Scan data items */
 	for (off = 0; off <= max_off; off += rec_size)
 	{
-		unsigned addr = base + off;
-		crc16_t chksum = crc16((void const*)addr, p->item_sz);
-		struct cfg_rec_marker const* m = (struct cfg_rec_marker const*)(addr + p->item_sz_aligned);
-		valid = m->validator == INVALID ? 0 : chksum == m->chksum;
-		erased = !valid && cfg_pool_erased(p, off);
+		struct cfg_rec_marker const* m = (struct cfg_rec_marker const*)(base + off + p->item_sz_aligned);
+		if (last_status & STA_CHAINED_BIT) {
+			/* The next segment may have stale content */
+			valid = 0;
+			erased = cfg_pool_erased(p, off, cfg_pool_seg_end(p, off));
+		} else {
+			valid = cfg_pool_rec_valid(p, off);
+			erased = !valid && cfg_pool_erased(p, off, cfg_pool_seg_end(p, off + rec_size));
+		}
 		if (erased && (last_status & STA_CHAINED_BIT)) {
 			/* If chained flag is not set we never write to the next byte */
 			break;
@@ -93,6 +216,7 @@ int cfg_pool_validate(struct cfg_pool* p)
 			break;
 		}
 	}
+	p->erased_end = cfg_pool_seg_end(p, cfg_pool_next_offset(p));
 	if (valid && (last_status & STA_COMPLETE_BIT)) {
 		/* 
 		 * Fixup marker to avoid unrepeatable reads. Note that we still have the repeatability problem with
@@ -115,76 +239,189 @@ int cfg_pool_validate(struct cfg_pool* p)
 	}
 }
 
+/* Return the size of the record holding the item of the given size */
+unsigned cfg_pool_rec_size(unsigned item_sz, struct flash_sec const* flash)
+{
+	unsigned align = flash->prog_unit > ALIGN_SZ ? flash->prog_unit : ALIGN_SZ;
+	return cfg_pool_align(item_sz, align) + cfg_pool_align(MARKER_SZ, align);
+}
+
 /* Initialize pool on boot */
 int cfg_pool_init(struct cfg_pool* p, unsigned item_sz, struct flash_sec const*	flash)
 {
+	unsigned align = flash->prog_unit > ALIGN_SZ ? flash->prog_unit : ALIGN_SZ;
 	p->item_sz = item_sz;
-	p->item_sz_aligned = (item_sz + ALIGN_MASK) & ~ALIGN_MASK;
+	p->item_sz_aligned = cfg_pool_align(item_sz, align);
+	p->rec_sz = cfg_pool_rec_size(item_sz, flash);
 	p->flash = flash;
 	p->put_cnt = p->erase_cnt = 0;
+	p->verify = CFG_VERIFY_CRC;
 	cfg_pool_reset(p);
+	if (flash->prog_unit > 1 && (flash->prog_unit < MARKER_SZ || flash->prog_unit > CFG_POOL_UNIT_MAX)) {
+		/* The marker should fit the single unit */
+		return -1;
+	}
 	return cfg_pool_validate(p);
 }
 
-/* Physically erase pool */
+/* Erase segments up to the given offset. Return 0 on success, -1 on flash erase error. */
+static int cfg_pool_erase_segs(struct cfg_pool* p, unsigned end)
+{
+	for (; p->erased_end < end; p->erased_end += p->flash->seg_sz) {
+		if (p->flash->erase_seg(p->flash, p->erased_end)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Physically erase pool. With lazy erase only the segments holding the first record are erased. */
 int cfg_pool_erase(struct cfg_pool* p)
 {
 	cfg_pool_reset(p);
-	if (p->flash->erase(p->flash)) {
+	if (cfg_pool_lazy(p) ? cfg_pool_erase_segs(p, p->rec_sz) : p->flash->erase(p->flash)) {
 		return -1;
 	}
 	++p->erase_cnt;
 	return 0;
 }
 
-/* Compute CRC of the sequence of 0xff bytes */
-static crc16_t crc_ff(unsigned sz)
+/* Update CRC with the sequence of 0xff bytes */
+static crc16_t crc_ff_up(crc16_t crc, unsigned sz)
 {
-	crc16_t crc = CRC16_INIT;
 	for (; sz; --sz) {
 		crc = crc16_up(crc, 0xff);
 	}
 	return crc;
 }
 
-/* Put next item. Caller may provide data in 2 parts. In case the hdr = 0 the corresponding storage
- * bytes will not be written, so they will keep 0xff values. Return 0 on success, -1 on flash writing error.
- */
-int cfg_pool_put(struct cfg_pool* p, void const* hdr, unsigned hdr_sz, void const* tail)
+/* Start writing the next item. Return 0 on success, -1 on flash writing error. */
+int cfg_pool_write_begin(struct cfg_pool* p, struct cfg_pool_writer* w)
 {
-	unsigned off = cfg_pool_next_offset(p);
-	struct cfg_rec_marker m = {
-		.chksum = hdr ? crc16(hdr, hdr_sz) : crc_ff(hdr_sz),
-		.validator = VALID,
-		.status = STA_COMPLETE
-	};
-	if (off) {
+	w->p = p;
+	w->off = cfg_pool_next_offset(p);
+	w->pos = 0;
+	w->chksum = CRC16_INIT;
+	if (cfg_pool_lazy(p) && cfg_pool_erase_segs(p, w->off + p->rec_sz)) {
+		cfg_pool_reset(p);
+		return -1;
+	}
+	if (w->off && !cfg_pool_units(p)) {
 		/* Update status byte on the previous item */
 		uint8_t sta = STA_CHAINED;
-		if (p->flash->write_bytes(p->flash, off - 1, &sta, 1)) {
-			goto err;
+		if (p->flash->write_bytes(p->flash, w->off - 1, &sta, 1)) {
+			cfg_pool_reset(p);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Program the unit buffer at the given offset unless it is erased */
+static int cfg_pool_write_unit(struct cfg_pool_writer* w, unsigned off)
+{
+	struct flash_sec const* f = w->p->flash;
+	unsigned i;
+	for (i = 0; i < f->prog_unit; ++i) {
+		if (w->unit[i] != 0xff) {
+			if (f->write(f, off, w->unit, f->prog_unit)) {
+				return -1;
+			}
+			return w->p->verify == CFG_VERIFY_COMPARE && memcmp((void const*)(f->base + off), w->unit, f->prog_unit) ? -1 : 0;
+		}
+	}
+	return 0;
+}
+
+/* Put data to the unit buffer programming every unit filled. The data = 0 leaves the bytes erased. */
+static int cfg_pool_write_units(struct cfg_pool_writer* w, uint8_t const* data, unsigned sz)
+{
+	unsigned unit = w->p->flash->prog_unit, pos = w->pos;
+	while (sz) {
+		unsigned i = pos % unit, n = unit - i;
+		if (!i) {
+			memset(w->unit, 0xff, unit);
+		}
+		if (n > sz) {
+			n = sz;
+		}
+		if (data) {
+			memcpy(w->unit + i, data, n);
+			data += n;
+		}
+		pos += n;
+		sz -= n;
+		if (!(pos % unit) && cfg_pool_write_unit(w, w->off + pos - unit)) {
+			return -1;
 		}
 	}
-	if (hdr && p->flash->write(p->flash, off, hdr, hdr_sz)) {
+	return 0;
+}
+
+/* Write the next part of the item. Return 0 on success, -1 on flash writing error. */
+int cfg_pool_write(struct cfg_pool_writer* w, void const* data, unsigned sz)
+{
+	struct cfg_pool* p = w->p;
+	if (sz > p->item_sz - w->pos) {
 		goto err;
 	}
-	if (hdr_sz < p->item_sz) {
-		unsigned tail_sz = p->item_sz - hdr_sz;
-		m.chksum = crc16_up_buff(m.chksum, tail, tail_sz);
-		if (p->flash->write(p->flash, off + hdr_sz, tail, tail_sz)) {
+	if (!data) {
+		w->chksum = crc_ff_up(w->chksum, sz);
+	} else {
+		w->chksum = crc16_up_buff(w->chksum, data, sz);
+	}
+	if (cfg_pool_units(p)) {
+		if (cfg_pool_write_units(w, data, sz)) {
+			goto err;
+		}
+	} else if (data && sz) {
+		if (p->flash->write(p->flash, w->off + w->pos, data, sz)) {
+			goto err;
+		}
+		if (p->verify == CFG_VERIFY_COMPARE && memcmp((void const*)(p->flash->base + w->off + w->pos), data, sz)) {
 			goto err;
 		}
 	}
-	if (p->flash->write_bytes(p->flash, off + p->item_sz_aligned, &m, MARKER_SZ)) {
+	w->pos += sz;
+	return 0;
+err:
+	cfg_pool_reset(p);
+	return -1;
+}
+
+/* Complete writing the item. Return 0 on success, -1 on flash writing error. */
+int cfg_pool_write_end(struct cfg_pool_writer* w)
+{
+	struct cfg_pool* p = w->p;
+	struct cfg_rec_marker m = {
+		.chksum = w->chksum,
+		.validator = VALID,
+		.status = STA_COMPLETE
+	};
+	if (w->pos != p->item_sz) {
+		goto err;
+	}
+	if (cfg_pool_units(p)) {
+		unsigned unit = p->flash->prog_unit;
+		/* Program the last data unit followed by the marker unit */
+		if (w->pos % unit && cfg_pool_write_unit(w, w->off + w->pos - w->pos % unit)) {
+			goto err;
+		}
+		memset(w->unit, 0xff, unit);
+		memcpy(w->unit, &m, MARKER_SZ);
+		if (cfg_pool_write_unit(w, w->off + p->item_sz_aligned)) {
+			goto err;
+		}
+	} else if (p->flash->write_bytes(p->flash, w->off + p->item_sz_aligned, &m, MARKER_SZ)) {
 		goto err;
 	}
 	if (
-		crc16((const void*)(p->flash->base + off), p->item_sz) != m.chksum ||
-		memcmp(&m, (const void*)(p->flash->base + off + p->item_sz_aligned), sizeof(m))
+		(p->verify == CFG_VERIFY_CRC && crc16((const void*)(p->flash->base + w->off), p->item_sz) != m.chksum) ||
+		(p->verify != CFG_VERIFY_NONE && memcmp(&m, (const void*)(p->flash->base + w->off + p->item_sz_aligned), sizeof(m)))
 	) {
 		goto err;
 	}
-	p->last_off = p->valid_off = off;
+	p->last_off = p->valid_off = w->off;
 	++p->put_cnt;
 	return 0;
 err:
@@ -192,6 +429,40 @@ err:
 	return -1;
 }
 
+/* Put next item composed of the sequence of chunks. Return 0 on success, -1 on flash writing error. */
+int cfg_pool_put_chunks(struct cfg_pool* p, struct cfg_chunk const* chunks, unsigned n)
+{
+	struct cfg_pool_writer w;
+	unsigned i, sz;
+	for (i = 0, sz = 0; i < n; ++i) {
+		sz += chunks[i].sz;
+	}
+	if (sz != p->item_sz) {
+		return -1;
+	}
+	if (cfg_pool_write_begin(p, &w)) {
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		if (cfg_pool_write(&w, chunks[i].data, chunks[i].sz)) {
+			return -1;
+		}
+	}
+	return cfg_pool_write_end(&w);
+}
+
+/* Put next item. Caller may provide data in 2 parts. In case the hdr = 0 the corresponding storage
+ * bytes will not be written, so they will keep 0xff values. Return 0 on success, -1 on flash writing error.
+ */
+int cfg_pool_put(struct cfg_pool* p, void const* hdr, unsigned hdr_sz, void const* tail)
+{
+	struct cfg_chunk const chunks[2] = {
+		{hdr, hdr_sz},
+		{tail, p->item_sz - hdr_sz}
+	};
+	return cfg_pool_put_chunks(p, chunks, 2);
+}
+
 /* Put data item to the pool erasing it if necessary. Return 0 on success, -1 on flash writing error. */
 int cfg_pool_commit(struct cfg_pool* p, void const* data)
 {
@@ -3,14 +3,30 @@
 #include "flash_sec.h"
 #include <stdint.h>
 
+/* The maximum program unit size supported. The item writer keeps the buffer of this size
+ * so the platforms having byte programmed flash may define it as 1 to save memory.
+ */
+#ifndef CFG_POOL_UNIT_MAX
+#define CFG_POOL_UNIT_MAX 32
+#endif
+
+/* The read back verification policy of the records written */
+#define CFG_VERIFY_CRC     0 /* recompute the checksum of the item in flash and compare marker (default) */
+#define CFG_VERIFY_COMPARE 1 /* compare the data in flash to the source buffers as they are written and compare marker */
+#define CFG_VERIFY_MARKER  2 /* compare marker only */
+#define CFG_VERIFY_NONE    3 /* trust the flash driver */
+
 /* The config pool contains the array of equally sized configuration items */
 struct cfg_pool {
 	unsigned		item_sz;
 	unsigned		item_sz_aligned;
+	unsigned		rec_sz;
 	int			last_off;
 	int			valid_off;
+	unsigned		erased_end; /* the end of the segments erased since the pool erase (lazy erase only) */
 	unsigned		put_cnt;
 	unsigned		erase_cnt;
+	uint8_t			verify;  /* verification policy */
 	struct flash_sec const*	flash;
 };
 
@@ -21,6 +37,21 @@ struct cfg_rec_marker {
 	uint8_t  status;	
 };
 
+/* The part of the data item. The bytes of the chunk with data = 0 are not written so they keep 0xff values. */
+struct cfg_chunk {
+	void const*	data;
+	unsigned	sz;
+};
+
+/* The item writer state */
+struct cfg_pool_writer {
+	struct cfg_pool*	p;
+	unsigned		off; /* the item offset */
+	unsigned		pos; /* the number of bytes written */
+	uint16_t		chksum;
+	uint8_t			unit[CFG_POOL_UNIT_MAX]; /* the program unit being filled */
+};
+
 /* Return 1 if the pool is empty, 0 otherwise */
 static inline int cfg_pool_empty(struct cfg_pool const* p)
 {
@@ -48,31 +79,64 @@ static inline void const* cfg_pool_get(struct cfg_pool const* p)
 /* Return offset of the next item */
 static inline unsigned cfg_pool_next_offset(struct cfg_pool* p)
 {
-	return cfg_pool_empty(p) ? 0 : p->last_off + p->item_sz_aligned + sizeof(struct cfg_rec_marker);
+	return cfg_pool_empty(p) ? 0 : p->last_off + p->rec_sz;
 }
 
 /* Check if we have space for the next item */
 static inline int cfg_pool_has_room(struct cfg_pool* p)
 {
-	return cfg_pool_next_offset(p) + p->item_sz_aligned + sizeof(struct cfg_rec_marker) <= p->flash->size;
+	return cfg_pool_next_offset(p) + p->rec_sz <= p->flash->size;
+}
+
+/* Set the read back verification policy. The pool is initialized with CFG_VERIFY_CRC. */
+static inline void cfg_pool_set_verify(struct cfg_pool* p, uint8_t verify)
+{
+	p->verify = verify;
 }
 
 /* Reset pool state to empty */
 static inline void cfg_pool_reset(struct cfg_pool* p)
 {
 	p->last_off = p->valid_off = -1;
+	p->erased_end = 0;
 }
 
 /* Physically erase pool. Return 0 on success, -1 on flash erase error. */
 int cfg_pool_erase(struct cfg_pool* p);
 
-/* Initialize pool on boot. Return 0 on success, -1 on flash writing error. */
+/* Initialize pool on boot. Return 0 on success, -1 on flash writing error or if the flash program unit
+ * exceeds CFG_POOL_UNIT_MAX.
+ */
 int cfg_pool_init(struct cfg_pool* p, unsigned item_sz, struct flash_sec const*	flash);
 
+/* Return the size of the record holding the item of the given size on the given flash */
+unsigned cfg_pool_rec_size(unsigned item_sz, struct flash_sec const* flash);
+
 /* Put next item. Caller may provide data in 2 parts. In case the hdr = 0 the corresponding storage
  * bytes will not be written, so they will keep 0xff values. Return 0 on success, -1 on flash writing error.
  */
 int cfg_pool_put(struct cfg_pool* p, void const* hdr, unsigned hdr_sz, void const* tail);
 
+/* Put next item composed of the sequence of chunks. The total chunks size must be equal to the item size.
+ * Return 0 on success, -1 on flash writing error.
+ */
+int cfg_pool_put_chunks(struct cfg_pool* p, struct cfg_chunk const* chunks, unsigned n);
+
+/* Start writing the next item by parts. The item is not valid until cfg_pool_write_end succeeds.
+ * Return 0 on success, -1 on flash writing error.
+ */
+int cfg_pool_write_begin(struct cfg_pool* p, struct cfg_pool_writer* w);
+
+/* Write the next part of the item. In case the data = 0 the corresponding bytes will not be written,
+ * so they will keep 0xff values. Return 0 on success, -1 on flash writing error.
+ */
+int cfg_pool_write(struct cfg_pool_writer* w, void const* data, unsigned sz);
+
+/* Complete writing the item. All item bytes should be written. Return 0 on success, -1 on flash writing error. */
+int cfg_pool_write_end(struct cfg_pool_writer* w);
+
 /* Put data item to the pool erasing it if necessary. Return 0 on success, -1 on flash writing error. */
 int cfg_pool_commit(struct cfg_pool* p, void const* data);
+
+/* Return the offset of the last valid item preceding the given offset or -1 if there is no one */
+int cfg_pool_prev_valid(struct cfg_pool const* p, int off);
@@ -0,0 +1,209 @@
+#include "cfg_queue.h"
+#include <string.h>
+
+#if !defined(__GNUC__)
+#include <intrinsics.h>
+#endif
+
+/* Compare and swap. Return 1 if the value was replaced, 0 otherwise. */
+static inline int cfg_cas(unsigned volatile* p, unsigned old, unsigned val)
+{
+#if defined(__GNUC__)
+	return __atomic_compare_exchange_n(p, &old, val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#elif defined(__ICCARM__)
+	do {
+		if (__LDREX((unsigned long*)p) != old) {
+			__CLREX();
+			return 0;
+		}
+	} while (__STREX(val, (unsigned long*)p));
+	return 1;
+#else
+	/* There are no exclusive access instructions (MSP430) so the interrupts are masked for a few cycles */
+	__istate_t istate = __get_interrupt_state();
+	int res = 0;
+	__disable_interrupt();
+	if (*p == old) {
+		*p = val;
+		res = 1;
+	}
+	__set_interrupt_state(istate);
+	return res;
+#endif
+}
+
+/* Store the tag after the request content is written */
+static inline void cfg_tag_release(unsigned volatile* p, unsigned val)
+{
+#if defined(__GNUC__)
+	__atomic_store_n(p, val, __ATOMIC_RELEASE);
+#else
+#if defined(__ICCARM__)
+	__DMB();
+#endif
+	/* The single core MSP430 needs no barrier */
+	*p = val;
+#endif
+}
+
+/* Load the tag before the request content is read */
+static inline unsigned cfg_tag_acquire(unsigned volatile const* p)
+{
+#if defined(__GNUC__)
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+	unsigned val = *p;
+#if defined(__ICCARM__)
+	__DMB();
+#endif
+	return val;
+#endif
+}
+
+/* Take the next ticket */
+static unsigned cfg_queue_ticket(struct cfg_queue* q)
+{
+	unsigned t;
+	do {
+		t = q->ticket;
+	} while (!cfg_cas(&q->ticket, t, t + CFG_REQ_STATE + 1));
+	return t;
+}
+
+/* Check if the ticket a was taken before b */
+static inline int ticket_before(unsigned a, unsigned b)
+{
+	return (int)(a - b) < 0;
+}
+
+void cfg_queue_init(struct cfg_queue* q, struct cfg_storage* stor, struct cfg_req* reqs, unsigned nreqs, void* buff)
+{
+	unsigned i;
+	q->stor = stor;
+	q->reqs = reqs;
+	q->nreqs = nreqs;
+	q->ticket = 0;
+	q->buff = buff;
+	q->dirty = 0;
+	q->applied = 0;
+	q->commits = 0;
+	for (i = 0; i < nreqs; ++i) {
+		reqs[i].tag = CFG_REQ_FREE;
+	}
+}
+
+/* Claim the free slot. Return 0 if there is no one. */
+static struct cfg_req* cfg_queue_claim(struct cfg_queue* q)
+{
+	unsigned i;
+	for (i = 0; i < q->nreqs; ++i) {
+		struct cfg_req* r = &q->reqs[i];
+		unsigned tag = r->tag;
+		if ((tag & CFG_REQ_STATE) == CFG_REQ_FREE && cfg_cas(&r->tag, tag, (tag & CFG_REQ_TICKET) | CFG_REQ_CLAIMED)) {
+			return r;
+		}
+	}
+	return 0;
+}
+
+/* Retire the ready requests for the same range posted before the given one */
+static void cfg_queue_retire(struct cfg_queue* q, struct cfg_req const* req, unsigned ticket)
+{
+	unsigned i;
+	for (i = 0; i < q->nreqs; ++i) {
+		struct cfg_req* r = &q->reqs[i];
+		unsigned tag = cfg_tag_acquire(&r->tag);
+		/* The slot may be reused while its range is being compared but then the tag does not match */
+		if (
+			(tag & CFG_REQ_STATE) == CFG_REQ_READY && ticket_before(tag & CFG_REQ_TICKET, ticket) &&
+			r->off == req->off && r->len == req->len
+		) {
+			cfg_cas(&r->tag, tag, (tag & CFG_REQ_TICKET) | CFG_REQ_FREE);
+		}
+	}
+}
+
+int cfg_queue_post(struct cfg_queue* q, unsigned off, unsigned len, void const* data)
+{
+	struct cfg_req* r;
+	unsigned ticket;
+	if (len > CFG_QUEUE_DATA_MAX || off > cfg_stor_item_size(q->stor) || len > cfg_stor_item_size(q->stor) - off) {
+		return -1;
+	}
+	if (!(r = cfg_queue_claim(q))) {
+		return -1;
+	}
+	/* The ticket is taken after the slot is claimed so the consumer knows the request is in progress */
+	ticket = cfg_queue_ticket(q);
+	r->tag = ticket | CFG_REQ_WRITING;
+	r->off = off;
+	r->len = len;
+	memcpy(r->data, data, len);
+	cfg_tag_release(&r->tag, ticket | CFG_REQ_READY);
+	cfg_queue_retire(q, r, ticket);
+	return 0;
+}
+
+/* Find the ready request having the oldest ticket preceding the given limit. Return 0 if there is no one. */
+static struct cfg_req* cfg_queue_oldest(struct cfg_queue* q, unsigned limit, unsigned* tag)
+{
+	struct cfg_req* oldest = 0;
+	unsigned i;
+	for (i = 0; i < q->nreqs; ++i) {
+		struct cfg_req* r = &q->reqs[i];
+		unsigned t = cfg_tag_acquire(&r->tag);
+		if (
+			(t & CFG_REQ_STATE) == CFG_REQ_READY && ticket_before(t & CFG_REQ_TICKET, limit) &&
+			(!oldest || ticket_before(t & CFG_REQ_TICKET, *tag & CFG_REQ_TICKET))
+		) {
+			oldest = r;
+			*tag = t;
+		}
+	}
+	return oldest;
+}
+
+int cfg_queue_run(struct cfg_queue* q)
+{
+	struct cfg_req* r;
+	unsigned i, tag, limit = q->ticket;
+	/* The requests claimed after the ticket was read have the later tickets. The requests being written
+	 * limit the tickets that may be applied. The ticket of the claimed request is unknown so nothing is applied.
+	 */
+	for (i = 0; i < q->nreqs; ++i) {
+		tag = cfg_tag_acquire(&q->reqs[i].tag);
+		if ((tag & CFG_REQ_STATE) == CFG_REQ_CLAIMED) {
+			break;
+		}
+		if ((tag & CFG_REQ_STATE) == CFG_REQ_WRITING && ticket_before(tag & CFG_REQ_TICKET, limit)) {
+			limit = tag & CFG_REQ_TICKET;
+		}
+	}
+	while (i == q->nreqs && (r = cfg_queue_oldest(q, limit, &tag))) {
+		/* Take the request so it is not retired while being copied. It may be retired meanwhile though. */
+		if (!cfg_cas(&r->tag, tag, (tag & CFG_REQ_TICKET) | CFG_REQ_WRITING)) {
+			continue;
+		}
+		if (!q->dirty) {
+			void const* item = cfg_stor_get(q->stor);
+			if (item) {
+				memcpy(q->buff, item, cfg_stor_item_size(q->stor));
+			} else {
+				memset(q->buff, 0, cfg_stor_item_size(q->stor));
+			}
+			q->dirty = 1;
+		}
+		memcpy(q->buff + r->off, r->data, r->len);
+		cfg_tag_release(&r->tag, (tag & CFG_REQ_TICKET) | CFG_REQ_FREE);
+		++q->applied;
+	}
+	if (!q->dirty) {
+		return 0;
+	}
+	if (cfg_stor_commit(q->stor, q->buff)) {
+		return -1;
+	}
+	q->dirty = 0;
+	++q->commits;
+	return 0;
+}
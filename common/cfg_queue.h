@@ -0,0 +1,68 @@
+#pragma once
+
+#include "cfg_storage.h"
+
+/*
+ * Commit request queue decoupling the producers (interrupt handlers, tasks) from the flash writes.
+ * The producer posts the update of the item range. It never blocks and fails only if there is no free
+ * request slot. The single consumer merges all requests posted so far onto the last committed item and
+ * commits the result by the single write. The request for the same range as the pending one retires it
+ * so the storm of updates occupies the single slot and the latest value wins.
+ *
+ * The slot is claimed by the compare and swap of its tag. The tag holds the slot state and the ticket
+ * taken from the queue counter once the slot is claimed. The consumer applies the requests in the ticket
+ * order and only those preceding the ticket of any request still being written so the older value is never
+ * applied after the newer one.
+ */
+
+/* The request slot states kept in the low bits of the tag */
+#define CFG_REQ_FREE    0
+#define CFG_REQ_CLAIMED 1 /* the ticket is not taken yet */
+#define CFG_REQ_WRITING 2
+#define CFG_REQ_READY   3
+#define CFG_REQ_STATE   3
+#define CFG_REQ_TICKET  ((unsigned)~CFG_REQ_STATE)
+
+/* The maximum size of the range updated by the single request */
+#ifndef CFG_QUEUE_DATA_MAX
+#define CFG_QUEUE_DATA_MAX 16
+#endif
+
+struct cfg_req {
+	unsigned volatile	tag; /* ticket | state */
+	uint16_t		off;
+	uint16_t		len;
+	uint8_t			data[CFG_QUEUE_DATA_MAX];
+};
+
+struct cfg_queue {
+	struct cfg_storage*	stor;
+	struct cfg_req*		reqs;
+	unsigned		nreqs;
+	unsigned volatile	ticket;  /* the next ticket */
+	uint8_t*		buff;    /* the item being merged */
+	uint8_t			dirty;   /* the buffer has the changes not committed yet */
+	unsigned		applied; /* the number of requests applied */
+	unsigned		commits; /* the number of items committed */
+};
+
+/* Initialize the queue of the given storage. The buff is the buffer of cfg_stor_item_size bytes. */
+void cfg_queue_init(struct cfg_queue* q, struct cfg_storage* stor, struct cfg_req* reqs, unsigned nreqs, void* buff);
+
+/* Post the update of len bytes at the given offset. May be called from the interrupt handlers.
+ * Return 0 on success, -1 if the range is invalid or there is no free slot.
+ */
+int cfg_queue_post(struct cfg_queue* q, unsigned off, unsigned len, void const* data);
+
+/* Commit the requests posted so far. The requests are applied to the last committed item or to the zero
+ * filled item if there is no one. Should be called by the single consumer which is the only one modifying
+ * the storage. The merged item is kept on flash writing error so the next call retries the commit.
+ * Return 0 on success, -1 on flash writing error.
+ */
+int cfg_queue_run(struct cfg_queue* q);
+
+/* Check if the merged item was not committed due to flash writing error */
+static inline int cfg_queue_dirty(struct cfg_queue const* q)
+{
+	return q->dirty;
+}
@@ -1,8 +1,20 @@
 #include "cfg_storage.h"
+#include <string.h>
 
 #define TOMBSTONE  0x80
 #define EPOCH_MASK ((uint8_t)~TOMBSTONE)
 
+/*
+ * The storage records have the following structure:
+ *
+ * data | epoch              unversioned records
+ * data | id | ~id | epoch   versioned records having the schema id tag
+ *
+ * The epoch is always the last byte of the pool item.
+ */
+
+#define TAG_SZ 2
+
 static inline uint8_t get_raw_epoch(void const* item, unsigned item_sz)
 {
 	return *((uint8_t const*)item + item_sz);
@@ -18,32 +30,110 @@ static inline uint8_t epoch_next(uint8_t e)
 	return (e + 1) & EPOCH_MASK;
 }
 
+static inline uint8_t epoch_prev(uint8_t e)
+{
+	return (e - 1) & EPOCH_MASK;
+}
+
 static inline int8_t epoch_diff(uint8_t a, uint8_t b)
 {
 	return (int8_t)((a - b) << 1) >> 1;
 }
 
+/* The size of the bytes following user data */
+static inline unsigned tail_size(uint8_t schema)
+{
+	return schema == CFG_SCHEMA_NONE ? 1 : TAG_SZ + 1;
+}
+
+/* Check if the pool item has the storage schema tag */
+static inline int tag_valid(struct cfg_storage const* stor, struct cfg_pool const* pool, void const* item)
+{
+	uint8_t const* tag = (uint8_t const*)item + pool->item_sz - TAG_SZ - 1;
+	return stor->schema == CFG_SCHEMA_NONE || (tag[0] == stor->schema && (tag[0] ^ tag[1]) == 0xff);
+}
+
+/* Get the last item of the pool having the storage schema tag */
+static void const* cfg_stor_pool_get(struct cfg_storage const* stor, struct cfg_pool const* pool)
+{
+	void const* item = cfg_pool_get(pool);
+	return item && tag_valid(stor, pool, item) ? item : 0;
+}
+
 /* Get last committed item */
 void const* cfg_stor_get(struct cfg_storage const* stor)
 {
 	struct cfg_pool const* pool = &stor->pool[stor->epoch & 1];
-	void const* item = cfg_pool_get(pool);
+	void const* item = cfg_stor_pool_get(stor, pool);
 	if (!item || (get_raw_epoch(item, pool->item_sz - 1) & TOMBSTONE)) {
 		return 0;
 	}
 	return item;
 }
 
-/* Initialize storage epoch. Return 0 on success, -1 on flash writing error. */
-int cfg_stor_init_epoch(struct cfg_storage* stor, unsigned item_sz)
+/* Publish the item for the lock-free readers */
+static void cfg_stor_publish(struct cfg_storage* stor, void const* item)
+{
+	struct flash_sec const* flash = stor->pool[stor->epoch & 1].flash;
+	unsigned gen = stor->gen + 1;
+	stor->pub[gen & 1].flash = item ? flash : 0;
+	stor->pub[gen & 1].off = item ? (unsigned)(uintptr_t)item - flash->base : 0;
+	stor->pub[gen & 1].gen = gen;
+	stor->gen = gen;
+}
+
+void cfg_stor_unpublish(struct cfg_storage* stor)
+{
+	cfg_stor_publish(stor, 0);
+}
+
+/* Get the descriptor of the last committed item */
+void const* cfg_stor_snap(struct cfg_storage const* stor, struct cfg_snap* snap)
+{
+	unsigned gen, off;
+	do {
+		gen = stor->gen;
+		snap->flash = stor->pub[gen & 1].flash;
+		snap->gen = stor->pub[gen & 1].gen;
+		off = stor->pub[gen & 1].off;
+	} while (gen != stor->gen);
+	if (!snap->flash) {
+		snap->base = 0;
+		return snap->item = 0;
+	}
+	snap->base = *(unsigned volatile const*)&snap->flash->base;
+	return snap->item = (void const*)(snap->base + off);
+}
+
+/* Copy the last committed item to the buffer */
+int cfg_stor_read(struct cfg_storage const* stor, void* buff)
+{
+	struct cfg_snap snap;
+	do {
+		if (!cfg_stor_snap(stor, &snap)) {
+			return -1;
+		}
+		memcpy(buff, snap.item, cfg_stor_item_size(stor));
+	} while (cfg_stor_changed(stor, &snap));
+	return 0;
+}
+
+/* Get the size of the user item */
+unsigned cfg_stor_item_size(struct cfg_storage const* stor)
+{
+	return stor->pool[0].item_sz - tail_size(stor->schema);
+}
+
+/* Find out storage epoch. Return 0 on success, -1 if pools content is inconsistent. */
+static int cfg_stor_find_epoch(struct cfg_storage* stor)
 {
 	void const* item[2] = {
-		cfg_pool_get(&stor->pool[0]),
-		cfg_pool_get(&stor->pool[1])
+		cfg_stor_pool_get(stor, &stor->pool[0]),
+		cfg_stor_pool_get(stor, &stor->pool[1])
 	};
 	uint8_t epoch[2] = {
-		item[0] ? get_epoch(item[0], item_sz) : TOMBSTONE,
-		item[1] ? get_epoch(item[1], item_sz) : TOMBSTONE,
+		item[0] ? get_epoch(item[0], stor->pool[0].item_sz - 1) : TOMBSTONE,
+		item[1] ? get_epoch(item[1], stor->pool[1].item_sz - 1) : TOMBSTONE,
 	};
 	/* Handle empty storage case */
 	if (!item[0] && !item[1]) {
@@ -55,7 +145,7 @@ int cfg_stor_init_epoch(struct cfg_storage* stor, unsigned item_sz)
 		(item[0] && (epoch[0] & 1) != 0) ||
 		(item[1] && (epoch[1] & 1) != 1)
 	) {
-		return cfg_stor_erase(stor);
+		return -1;
 	}
 	/* First pool is empty ? */
 	if (!item[0]) {
@@ -76,10 +166,19 @@ int cfg_stor_init_epoch(struct cfg_storage* stor, unsigned item_sz)
 		stor->epoch = epoch[1];
 		return 0;
 	default:
-		return cfg_stor_erase(stor);
+		return -1;
 	}	
 }
 
+/* Initialize storage epoch. Return 0 on success, -1 on flash writing error. */
+int cfg_stor_init_epoch(struct cfg_storage* stor)
+{
+	if (cfg_stor_find_epoch(stor)) {
+		return cfg_stor_erase(stor);
+	}
+	return 0;
+}
+
 int cfg_stor_seal(struct cfg_storage* stor)
 {
 	struct cfg_pool* pool = &stor->pool[stor->epoch & 1];
@@ -89,55 +188,235 @@ int cfg_stor_seal(struct cfg_storage* stor)
 	return cfg_stor_commit(stor, cfg_pool_get(pool));
 }
 
-/* Initialize pool on boot. Return 0 on success, -1 on flash writing error. */
-int cfg_stor_init(struct cfg_storage* stor, unsigned item_sz, struct flash_sec const flash[2])
+/* Put user data chunks followed by the tail to the given pool. The chunks array should have one spare
+ * element for the tail. Return 0 on success, -1 on flash writing error.
+ */
+static int cfg_stor_put_chunks(struct cfg_storage* stor, struct cfg_pool* pool, struct cfg_chunk* chunks, unsigned n, int tombstone)
+{
+	uint8_t tail[TAG_SZ + 1] = {stor->schema, ~stor->schema, stor->epoch};
+	unsigned tail_sz = tail_size(stor->schema);
+	if (tombstone) {
+		tail[TAG_SZ] |= TOMBSTONE;
+	}
+	chunks[n].data = tail + sizeof(tail) - tail_sz;
+	chunks[n].sz = tail_sz;
+	return cfg_pool_put_chunks(pool, chunks, n + 1);
+}
+
+/* Put user data followed by the tail to the given pool */
+static int cfg_stor_put(struct cfg_storage* stor, struct cfg_pool* pool, void const* data)
+{
+	struct cfg_chunk chunks[2] = {{data, pool->item_sz - tail_size(stor->schema)}};
+	return cfg_stor_put_chunks(stor, pool, chunks, 1, !data);
+}
+
+/* Initialize pools for the given schema. Return 0 on success, -1 on flash writing error. */
+static int cfg_stor_init_pools(struct cfg_storage* stor, struct cfg_schema const* schema, struct flash_sec const flash[2])
 {
-	/* Initialize pools */
+	unsigned item_sz = schema->item_sz + tail_size(schema->id);
+	stor->schema = schema->id;
 	if (
-		cfg_pool_init(&stor->pool[0], item_sz + 1, &flash[0]) ||
-		cfg_pool_init(&stor->pool[1], item_sz + 1, &flash[1])
+		cfg_pool_init(&stor->pool[0], item_sz, &flash[0]) ||
+		cfg_pool_init(&stor->pool[1], item_sz, &flash[1])
 	) {
 		return -1;
 	}
-	if (cfg_stor_init_epoch(stor, item_sz)) {
+	return 0;
+}
+
+/* Look for the item of the previous schema and migrate it to the standby pool.
+ * Return 0 on success, 1 if there is nothing to migrate, -1 on flash writing error.
+ */
+static int cfg_stor_migrate(struct cfg_storage* stor, struct flash_sec const flash[2], struct cfg_migration const* mig)
+{
+	unsigned i;
+	for (i = 0; i < mig->nschemas; ++i) {
+		struct cfg_schema const* s = &mig->schemas[i];
+		struct cfg_storage old;
+		struct cfg_pool* pool;
+		void const* item;
+		if (s->id == stor->schema) {
+			continue;
+		}
+		if (cfg_stor_init_pools(&old, s, flash)) {
+			return -1;
+		}
+		if (cfg_stor_find_epoch(&old) || !(item = cfg_stor_get(&old))) {
+			continue;
+		}
+		if (mig->migrate(s, item, mig->buff)) {
+			continue;
+		}
+		/* Copy forward upgraded item. The old one remains intact till the next pool switch. */
+		stor->epoch = epoch_next(old.epoch);
+		pool = &stor->pool[stor->epoch & 1];
+		if (cfg_pool_erase(pool)) {
+			return -1;
+		}
+		cfg_pool_reset(&stor->pool[old.epoch & 1]);
+		return cfg_stor_put(stor, pool, mig->buff);
+	}
+	return 1;
+}
+
+/* Initialize storage of the versioned records on boot. Return 0 on success, -1 on flash writing error. */
+int cfg_stor_init_schema(struct cfg_storage* stor, struct cfg_schema const* schema, struct flash_sec const flash[2], struct cfg_migration const* mig)
+{
+	int res;
+	/* The generation keeps counting if the storage is initialized again */
+	cfg_stor_publish(stor, 0);
+	if (cfg_stor_init_pools(stor, schema, flash)) {
+		return -1;
+	}
+	if (cfg_stor_init_epoch(stor)) {
 		return -1;
 	}
+	if (!cfg_stor_pool_get(stor, &stor->pool[stor->epoch & 1])) {
+		/* There is no item of the current schema */
+		res = mig ? cfg_stor_migrate(stor, flash, mig) : 1;
+		if (res < 0) {
+			return -1;
+		}
+		if (res && (cfg_pool_valid(&stor->pool[0]) || cfg_pool_valid(&stor->pool[1])) && cfg_stor_erase(stor)) {
+			/* Failed to erase items we are unable to migrate */
+			return -1;
+		}
+	}
 	if (cfg_stor_seal(stor)) {
 		return -1;
 	}
+	cfg_stor_publish(stor, cfg_stor_get(stor));
 	return 0;
 }
 
-/* Commit data item */
-int cfg_stor_commit(struct cfg_storage* stor, void const* data)
+/* Initialize pool on boot. Return 0 on success, -1 on flash writing error. */
+int cfg_stor_init(struct cfg_storage* stor, unsigned item_sz, struct flash_sec const flash[2])
+{
+	struct cfg_schema const schema = {CFG_SCHEMA_NONE, item_sz};
+	return cfg_stor_init_schema(stor, &schema, flash, 0);
+}
+
+/* Get the pool for the next item switching pools if necessary. Return 0 on flash erase error. */
+static struct cfg_pool* cfg_stor_next_pool(struct cfg_storage* stor)
 {
-	uint8_t epoch;
 	struct cfg_pool* pool = &stor->pool[stor->epoch & 1];
 	if (!cfg_pool_valid(pool) && cfg_pool_erase(pool)) {
-		return -1;
+		return 0;
 	}
 	if (!cfg_pool_has_room(pool)) {
-		/* Switch to other pool */
-		stor->epoch = epoch_next(stor->epoch);
-		pool = &stor->pool[stor->epoch & 1];
+		/* Switch to other pool. The current one is kept if the erase fails (the virtual sector erase
+		 * is refused till the maintenance) so the next commit retries the switch.
+		 */
+		pool = &stor->pool[~stor->epoch & 1];
 		if (cfg_pool_erase(pool)) {
-			return -1;
+			return 0;
 		}
+		stor->epoch = epoch_next(stor->epoch);
 	}
-	/* Put user data followed by epoch */
-	epoch = stor->epoch;
-	if (!data) {
-		epoch |= TOMBSTONE;
+	return pool;
+}
+
+/* Commit data item */
+int cfg_stor_commit(struct cfg_storage* stor, void const* data)
+{
+	struct cfg_pool* pool = cfg_stor_next_pool(stor);
+	int res;
+	if (!pool) {
+		return -1;
+	}
+	res = cfg_stor_put(stor, pool, data);
+	cfg_stor_publish(stor, cfg_stor_get(stor));
+	return res;
+}
+
+/* Commit the last item with the given range of bytes updated */
+int cfg_stor_update(struct cfg_storage* stor, unsigned off, unsigned len, void const* data)
+{
+	struct cfg_pool* pool = &stor->pool[stor->epoch & 1];
+	uint8_t const* item = cfg_stor_get(stor);
+	unsigned sz = pool->item_sz - tail_size(stor->schema);
+	struct cfg_chunk chunks[4];
+	int res;
+	if (!item || off > sz || len > sz - off) {
+		return -1;
+	}
+	/* The current item is kept intact on pool switch since only the other pool is erased */
+	if (!(pool = cfg_stor_next_pool(stor))) {
+		return -1;
 	}
-	return cfg_pool_put(pool, data, pool->item_sz - 1, &epoch);
+	chunks[0].data = item;
+	chunks[0].sz = off;
+	chunks[1].data = data;
+	chunks[1].sz = len;
+	chunks[2].data = item + off + len;
+	chunks[2].sz = sz - off - len;
+	res = cfg_stor_put_chunks(stor, pool, chunks, 3, 0);
+	cfg_stor_publish(stor, cfg_stor_get(stor));
+	return res;
 }
 
 /* Erase storage content. Return 0 on success, -1 on flash writing error. */
 int cfg_stor_erase(struct cfg_storage* stor)
 {
+	/* The readers should not see the item being erased */
+	cfg_stor_publish(stor, 0);
 	if (cfg_pool_erase(&stor->pool[0]) || cfg_pool_erase(&stor->pool[1])) {
 		return -1;
 	}
 	stor->epoch = 0;
 	return 0;
 }
+
+/* Initialize history iterator */
+void cfg_stor_iter_init(struct cfg_stor_iter* it, struct cfg_storage const* stor)
+{
+	it->stor = stor;
+	it->epoch = stor->epoch;
+	it->pools = 2;
+	it->off = stor->pool[stor->epoch & 1].valid_off;
+}
+
+/* Get the next committed item going back in time */
+void const* cfg_stor_iter_next(struct cfg_stor_iter* it)
+{
+	while (it->pools) {
+		struct cfg_pool const* pool = &it->stor->pool[it->epoch & 1];
+		while (it->off >= 0) {
+			void const* item = (void const*)(pool->flash->base + it->off);
+			it->off = cfg_pool_prev_valid(pool, it->off);
+			if (
+				tag_valid(it->stor, pool, item) &&
+				get_raw_epoch(item, pool->item_sz - 1) == it->epoch /* not erased and belongs to this pool */
+			) {
+				return item;
+			}
+		}
+		if (--it->pools) {
+			/* Continue with the standby pool */
+			it->epoch = epoch_prev(it->epoch);
+			it->off = it->stor->pool[it->epoch & 1].valid_off;
+		}
+	}
+	return 0;
+}
+
+/* Commit the item committed n versions ago */
+int cfg_stor_rollback(struct cfg_storage* stor, unsigned n)
+{
+	struct cfg_stor_iter it;
+	void const* item;
+	cfg_stor_iter_init(&it, stor);
+	do {
+		if (!(item = cfg_stor_iter_next(&it))) {
+			return -1;
+		}
+	} while (n--);
+	if (item == cfg_stor_get(stor)) {
+		return 0;
+	}
+	if (it.epoch != stor->epoch && !cfg_pool_has_room(&stor->pool[stor->epoch & 1])) {
+		/* The item would be erased on pool switch */
+		return -1;
+	}
+	return cfg_stor_commit(stor, item);
+}
@@ -6,19 +6,136 @@
  * Configuration storage with atomic updates
  */
 
+/*
+ * The last committed item is published to the lock-free readers (interrupt handlers or tasks preempting
+ * the writer) via the pair of descriptors. The writer fills the descriptor not referenced by the current
+ * generation and then increments the generation so the reader never observes the half updated one.
+ * The reader retries only if the writer has published while it was reading so the interrupt handler
+ * preempting the writer always succeeds on the first try. The published item stays intact in flash till
+ * the second pool switch since only the standby pool is erased. The item is located by its offset in the
+ * sector since the virtual sector is moved by the maintenance which updates the sector base before erasing
+ * the old copy. The single core is assumed.
+ */
+struct cfg_pub {
+	struct flash_sec const*	flash; /* the sector holding the item or 0 if there is no one */
+	unsigned		off;   /* the item offset in the sector */
+	unsigned		gen;   /* the generation it was published at */
+};
+
+struct cfg_snap {
+	void const*		item;  /* the last committed item or 0 */
+	unsigned		gen;   /* the generation it was published at */
+	struct flash_sec const*	flash; /* the sector holding the item */
+	unsigned		base;  /* the sector base the item address was obtained from */
+};
+
 struct cfg_storage {
 	struct cfg_pool	pool[2];
 	uint8_t		epoch;
+	uint8_t		schema;
+	struct cfg_pub	volatile pub[2];
+	unsigned	volatile gen;
+};
+
+/* The schema id of the unversioned records */
+#define CFG_SCHEMA_NONE 0xff
+
+/*
+ * The versioned records carry the schema id tag so the storage written with another item layout is
+ * recognized on boot and may be migrated instead of being erased.
+ */
+struct cfg_schema {
+	uint8_t		id;      /* schema id or CFG_SCHEMA_NONE for unversioned records */
+	unsigned	item_sz;
+};
+
+/* Migration callback upgrades the old item to the new item buffer. Return 0 on success, -1 if the item can't be migrated. */
+typedef int (*cfg_migrate_t)(struct cfg_schema const* old_schema, void const* old_item, void* new_item);
+
+struct cfg_migration {
+	struct cfg_schema const* schemas; /* previous schemas tried in order */
+	unsigned		nschemas;
+	cfg_migrate_t		migrate;
+	void*			buff; /* the new item buffer */
 };
 
 /* Initialize pool on boot. Return 0 on success, -1 on flash writing error. */
 int cfg_stor_init(struct cfg_storage* stor, unsigned item_sz, struct flash_sec const flash[2]);
 
+/* Initialize storage of the versioned records on boot. If there is no item of the given schema but there is one
+ * of the previous schema listed in migration descriptor (it may be 0) the item is upgraded by migration callback
+ * and committed to the standby pool. Return 0 on success, -1 on flash writing error.
+ */
+int cfg_stor_init_schema(struct cfg_storage* stor, struct cfg_schema const* schema, struct flash_sec const flash[2], struct cfg_migration const* mig);
+
+/* History iterator over the previously committed items */
+struct cfg_stor_iter {
+	struct cfg_storage const* stor;
+	uint8_t	epoch; /* the epoch of the pool being iterated */
+	uint8_t	pools; /* the number of pools left to iterate */
+	int	off;   /* the offset of the next item */
+};
+
 /* Get last committed item */
 void const* cfg_stor_get(struct cfg_storage const* stor);
 
+/* Get the descriptor of the last committed item. Unlike cfg_stor_get it may be called while the storage
+ * is being modified. The item pointer stays valid till cfg_stor_changed reports the change.
+ * Return the item pointer or 0 if there is no committed item.
+ */
+void const* cfg_stor_snap(struct cfg_storage const* stor, struct cfg_snap* snap);
+
+/* Copy the last committed item to the buffer of cfg_stor_item_size bytes. It may be called while the storage
+ * is being modified. Return 0 on success, -1 if there is no committed item.
+ */
+int cfg_stor_read(struct cfg_storage const* stor, void* buff);
+
+/* Check if the item was committed or moved after the snapshot was taken */
+static inline int cfg_stor_changed(struct cfg_storage const* stor, struct cfg_snap const* snap)
+{
+	return stor->gen != snap->gen || (snap->flash && *(unsigned volatile const*)&snap->flash->base != snap->base);
+}
+
+/* Withdraw the published item before the storage sectors are modified bypassing the storage API.
+ * The item is published again by the subsequent storage initialization.
+ */
+void cfg_stor_unpublish(struct cfg_storage* stor);
+
+/* Get the size of the user item excluding the storage tail */
+unsigned cfg_stor_item_size(struct cfg_storage const* stor);
+
 /* Commit data item. Return 0 on success, -1 on flash writing error. */
 int cfg_stor_commit(struct cfg_storage* stor, void const* data);
 
+/* Commit the last committed item with len bytes at the given offset replaced by data. The rest of the item is copied
+ * from flash so the caller does not need the item sized buffer. Return 0 on success, -1 if there is no committed item,
+ * the range is out of the item bounds or on flash writing error.
+ */
+int cfg_stor_update(struct cfg_storage* stor, unsigned off, unsigned len, void const* data);
+
 /* Erase storage content. Return 0 on success, -1 on flash writing error. */
 int cfg_stor_erase(struct cfg_storage* stor);
+
+/* Set the read back verification policy of both pools (see CFG_VERIFY_XXX). Should be called after the storage
+ * initialization since it resets the policy to CFG_VERIFY_CRC. The records written on boot by the migration
+ * are always verified by checksum.
+ */
+static inline void cfg_stor_set_verify(struct cfg_storage* stor, uint8_t verify)
+{
+	cfg_pool_set_verify(&stor->pool[0], verify);
+	cfg_pool_set_verify(&stor->pool[1], verify);
+}
+
+/* Initialize history iterator. The storage should not be modified while the iterator is in use. */
+void cfg_stor_iter_init(struct cfg_stor_iter* it, struct cfg_storage const* stor);
+
+/* Get the next committed item starting from the last one and going back in time. The erased items are skipped.
+ * Return the pointer to the item in flash or 0 if there are no more items.
+ */
+void const* cfg_stor_iter_next(struct cfg_stor_iter* it);
+
+/* Commit the item committed n versions ago (n = 0 refers to the last committed item). The items from the standby pool
+ * may be rolled back only while the current pool has room for the new item since the standby pool is erased on switch.
+ * Return 0 on success, -1 if there is no such item or on flash writing error.
+ */
+int cfg_stor_rollback(struct cfg_storage* stor, unsigned n);
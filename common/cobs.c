@@ -0,0 +1,84 @@
+#include "cobs.h"
+
+void cobs_enc_begin(struct cobs_enc* e, uint8_t* buff)
+{
+	e->buff = buff;
+	e->sz = 1;
+	e->code_pos = 0;
+	e->code = 1;
+}
+
+/* Close the current block and start the next one */
+static inline void cobs_enc_block(struct cobs_enc* e)
+{
+	e->buff[e->code_pos] = e->code;
+	e->code_pos = e->sz++;
+	e->code = 1;
+}
+
+void cobs_enc_put(struct cobs_enc* e, void const* data, unsigned sz)
+{
+	uint8_t const* ptr = data;
+	for (; sz; --sz, ++ptr) {
+		if (!*ptr) {
+			cobs_enc_block(e);
+			continue;
+		}
+		e->buff[e->sz++] = *ptr;
+		if (++e->code == 0xff) {
+			cobs_enc_block(e);
+		}
+	}
+}
+
+unsigned cobs_enc_end(struct cobs_enc* e)
+{
+	e->buff[e->code_pos] = e->code;
+	return e->sz;
+}
+
+void cobs_dec_begin(struct cobs_dec* d, uint8_t* buff, unsigned max_sz)
+{
+	d->buff = buff;
+	d->max_sz = max_sz;
+	d->sz = 0;
+	d->left = 0;
+	d->zero = 0;
+	d->err = 0;
+}
+
+static inline void cobs_dec_out(struct cobs_dec* d, uint8_t b)
+{
+	if (d->sz < d->max_sz) {
+		d->buff[d->sz++] = b;
+	} else {
+		d->err = 1;
+	}
+}
+
+void cobs_dec_put(struct cobs_dec* d, uint8_t b)
+{
+	if (d->left) {
+		cobs_dec_out(d, b);
+		--d->left;
+		return;
+	}
+	/* The code byte starts the next block */
+	if (!b) {
+		d->err = 1;
+		return;
+	}
+	if (d->zero) {
+		cobs_dec_out(d, 0);
+	}
+	d->left = b - 1;
+	d->zero = b != 0xff;
+}
+
+int cobs_dec_end(struct cobs_dec* d)
+{
+	if (d->err || d->left) {
+		return -1;
+	}
+	return d->sz;
+}
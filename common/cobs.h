@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Consistent Overhead Byte Stuffing. The encoded frame has no zero bytes so zero is used as the frame delimiter.
+ * Both encoder and decoder are streaming so the frame may be assembled from several chunks without copying
+ * them into the intermediate buffer.
+ */
+
+/* The maximum encoded size of n bytes (without delimiters) */
+#define COBS_ENC_MAX(n) ((n) + (n) / 254 + 1)
+
+struct cobs_enc {
+	uint8_t*	buff;
+	unsigned	sz;
+	unsigned	code_pos; /* the position of the code byte of the current block */
+	uint8_t		code;
+};
+
+struct cobs_dec {
+	uint8_t*	buff;
+	unsigned	max_sz;
+	unsigned	sz;
+	uint8_t		left;     /* the number of data bytes left in the current block */
+	uint8_t		zero;     /* the current block is followed by zero */
+	uint8_t		err;      /* the frame is malformed or does not fit the buffer */
+};
+
+/* Start encoding to the given buffer. The caller is responsible for providing enough room (see COBS_ENC_MAX). */
+void cobs_enc_begin(struct cobs_enc* e, uint8_t* buff);
+
+/* Encode the next chunk of data */
+void cobs_enc_put(struct cobs_enc* e, void const* data, unsigned sz);
+
+/* Complete encoding. Return the encoded size. */
+unsigned cobs_enc_end(struct cobs_enc* e);
+
+/* Start decoding to the given buffer */
+void cobs_dec_begin(struct cobs_dec* d, uint8_t* buff, unsigned max_sz);
+
+/* Decode the next encoded byte. The zero delimiter should not be passed. */
+void cobs_dec_put(struct cobs_dec* d, uint8_t b);
+
+/* Complete decoding. Return the decoded size or -1 if the frame is malformed or too long. */
+int cobs_dec_end(struct cobs_dec* d);
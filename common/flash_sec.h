@@ -4,28 +4,85 @@
  * Flash sector manipulation API
  */
 
+#include <stdint.h>
+
 struct flash_sec {
 	unsigned no;   /* sector number */
 	unsigned base; /* base address */
 	unsigned size; /* sector size in bytes */
+	unsigned prog_unit; /* program unit size, 1 if any byte may be programmed separately */
 	/* The following functions are expected to return 0 on success, -1 on failure */
 	int (*erase)(struct flash_sec const*);
 	int (*write)(struct flash_sec const*, unsigned off, void const* data, unsigned sz);
 	int (*write_bytes)(struct flash_sec const*, unsigned off, void const* data, unsigned sz);
+	void* priv; /* implementation private context */
+	/* The sector consisting of several independently erasable segments may be erased lazily segment by segment.
+	 * The seg_sz is 0 and erase_seg is 0 if it is not supported.
+	 */
+	unsigned seg_sz;
+	int (*erase_seg)(struct flash_sec const*, unsigned off); /* erase the segment at the given offset */
 };
 
+/* The hook called by the platform flash driver while waiting for the long operation and between the steps
+ * of the large writes and multi-segment erases. Typically it refreshes the watchdog so its window may be kept
+ * tight. It is 0 by default. Every platform flash driver defines it.
+ */
+extern void (*flash_progress_hook)(void);
+
+static inline void flash_progress(void)
+{
+	if (flash_progress_hook) {
+		flash_progress_hook();
+	}
+}
+
 int flash_sec_erase(struct flash_sec const* sec);
 int flash_sec_write(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz);
 int flash_sec_write_bytes(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz);
+int flash_sec_erase_seg(struct flash_sec const* sec, unsigned off);
+
+/* Check if the given range is blank */
+static inline int flash_blank(uint8_t const* ptr, unsigned sz)
+{
+	for (; sz; --sz, ++ptr) {
+		if (*ptr != 0xff)
+			return 0;
+	}
+	return 1;
+}
+
+/* Write the data at the given offset skipping the blank program units so they may be programmed later.
+ * The size is expected to be aligned to the program unit. Return 0 on success, -1 on failure.
+ */
+static inline int flash_sec_write_sparse(struct flash_sec const* sec, unsigned off, uint8_t const* data, unsigned sz)
+{
+	unsigned u = sec->prog_unit, pos = 0, start;
+	while (pos < sz) {
+		for (; pos < sz && flash_blank(data + pos, u); pos += u);
+		for (start = pos; pos < sz && !flash_blank(data + pos, u); pos += u);
+		if (pos > start && sec->write(sec, off + start, data + start, pos - start)) {
+			return -1;
+		}
+	}
+	return 0;
+}
 
 static inline void flash_sec_init(struct flash_sec* sec, unsigned no, unsigned base, unsigned size)
 {
 	sec->no = no;
 	sec->base = base;
 	sec->size = size;
+	sec->prog_unit = 1;
 	sec->erase = flash_sec_erase;
 	sec->write = flash_sec_write;
 	sec->write_bytes = flash_sec_write_bytes;
+	sec->priv = 0;
+	sec->seg_sz = 0;
+	sec->erase_seg = 0;
 }
 
-#define FLASH_SEC_INITIALIZER(no, base, size) {no, base, size, flash_sec_erase, flash_sec_write, flash_sec_write_bytes}
+#define FLASH_SEC_INITIALIZER(no, base, size) {no, base, size, 1, flash_sec_erase, flash_sec_write, flash_sec_write_bytes, 0, 0, 0}
+
+/* The sector of several segments erased lazily. The platform should implement flash_sec_erase_seg. */
+#define FLASH_SEC_SEG_INITIALIZER(no, base, size, seg_sz) \
+	{no, base, size, 1, flash_sec_erase, flash_sec_write, flash_sec_write_bytes, 0, seg_sz, flash_sec_erase_seg}
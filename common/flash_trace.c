@@ -0,0 +1,182 @@
+#include "flash_trace.h"
+#include "crc16.h"
+
+static inline void put_u16(uint8_t* p, uint16_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void put_u32(uint8_t* p, uint32_t v)
+{
+	put_u16(p, (uint16_t)v);
+	put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static inline uint16_t get_u16(uint8_t const* p)
+{
+	return p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t get_u32(uint8_t const* p)
+{
+	return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+/* Return the encoded size of the record with the given header */
+static inline unsigned rec_size(uint8_t const* hdr)
+{
+	return FLASH_TRACE_HDR_SZ + ((hdr[0] & FLASH_TRACE_DATA) ? get_u32(hdr + 8) : 0);
+}
+
+void flash_trace_init(struct flash_trace* t, void* buff, unsigned size, uint32_t (*clock)(void))
+{
+	t->buff = buff;
+	t->size = size;
+	t->with_data = 0;
+	t->clock = clock;
+	t->sink = 0;
+	t->sink_ctx = 0;
+	flash_trace_reset(t);
+}
+
+unsigned flash_trace_read(struct flash_trace const* t, unsigned off, void* buff, unsigned sz)
+{
+	unsigned i;
+	if (off >= t->len) {
+		return 0;
+	}
+	if (sz > t->len - off) {
+		sz = t->len - off;
+	}
+	for (i = 0, off = (t->head + off) % t->size; i < sz; ++i) {
+		((uint8_t*)buff)[i] = t->buff[off];
+		if (++off >= t->size) {
+			off = 0;
+		}
+	}
+	return sz;
+}
+
+/* Append bytes to the ring buffer tail. The caller should ensure there is enough room. */
+static void flash_trace_append(struct flash_trace* t, void const* data, unsigned sz)
+{
+	unsigned off = (t->head + t->len) % t->size;
+	uint8_t const* ptr = data;
+	t->len += sz;
+	for (; sz; --sz, ++ptr) {
+		t->buff[off] = *ptr;
+		if (++off >= t->size) {
+			off = 0;
+		}
+	}
+}
+
+/* Store the encoded record */
+static void flash_trace_store(struct flash_trace* t, uint8_t const* hdr, void const* data)
+{
+	unsigned data_sz = (hdr[0] & FLASH_TRACE_DATA) ? get_u32(hdr + 8) : 0;
+	if (t->sink) {
+		t->sink(t, hdr, FLASH_TRACE_HDR_SZ);
+		if (data_sz) {
+			t->sink(t, data, data_sz);
+		}
+		return;
+	}
+	if (!t->buff || FLASH_TRACE_HDR_SZ + data_sz > t->size) {
+		++t->lost;
+		return;
+	}
+	/* Drop the oldest records to make room for the new one */
+	while (t->len + FLASH_TRACE_HDR_SZ + data_sz > t->size) {
+		uint8_t old[FLASH_TRACE_HDR_SZ];
+		unsigned sz;
+		flash_trace_read(t, 0, old, sizeof(old));
+		sz = rec_size(old);
+		t->head = (t->head + sz) % t->size;
+		t->len -= sz;
+		++t->lost;
+	}
+	flash_trace_append(t, hdr, FLASH_TRACE_HDR_SZ);
+	flash_trace_append(t, data, data_sz);
+}
+
+/* Encode and store the operation record */
+static void flash_trace_record(struct flash_trace* t, uint8_t op, unsigned no, unsigned off, void const* data, unsigned sz, int res)
+{
+	uint8_t hdr[FLASH_TRACE_HDR_SZ];
+	if (data && t->with_data) {
+		op |= FLASH_TRACE_DATA;
+	}
+	if (res) {
+		op |= FLASH_TRACE_FAILED;
+	}
+	hdr[0] = op;
+	hdr[1] = (uint8_t)no;
+	put_u16(hdr + 2, data ? crc16(data, sz) : 0);
+	put_u32(hdr + 4, off);
+	put_u32(hdr + 8, sz);
+	put_u32(hdr + 12, t->clock ? t->clock() : 0);
+	flash_trace_store(t, hdr, data);
+}
+
+unsigned flash_trace_decode(void const* buff, unsigned sz, struct flash_trace_rec* r)
+{
+	uint8_t const* hdr = buff;
+	unsigned rsz;
+	if (sz < FLASH_TRACE_HDR_SZ || sz < (rsz = rec_size(hdr))) {
+		return 0;
+	}
+	r->op   = hdr[0];
+	r->no   = hdr[1];
+	r->hash = get_u16(hdr + 2);
+	r->off  = get_u32(hdr + 4);
+	r->sz   = get_u32(hdr + 8);
+	r->ts   = get_u32(hdr + 12);
+	r->data = (hdr[0] & FLASH_TRACE_DATA) ? hdr + FLASH_TRACE_HDR_SZ : 0;
+	return rsz;
+}
+
+static int flash_trace_erase(struct flash_sec const* sec)
+{
+	struct flash_trace_sec const* ts = sec->priv;
+	int res = ts->target->erase(ts->target);
+	flash_trace_record(ts->trace, FLASH_TRACE_ERASE, sec->no, 0, 0, sec->size, res);
+	return res;
+}
+
+static int flash_trace_write(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	struct flash_trace_sec const* ts = sec->priv;
+	int res = ts->target->write(ts->target, off, data, sz);
+	flash_trace_record(ts->trace, FLASH_TRACE_WRITE, sec->no, off, data, sz, res);
+	return res;
+}
+
+static int flash_trace_write_bytes(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	struct flash_trace_sec const* ts = sec->priv;
+	int res = ts->target->write_bytes(ts->target, off, data, sz);
+	flash_trace_record(ts->trace, FLASH_TRACE_WRITE_BYTES, sec->no, off, data, sz, res);
+	return res;
+}
+
+static int flash_trace_erase_seg(struct flash_sec const* sec, unsigned off)
+{
+	struct flash_trace_sec const* ts = sec->priv;
+	int res = ts->target->erase_seg(ts->target, off);
+	flash_trace_record(ts->trace, FLASH_TRACE_ERASE_SEG, sec->no, off, 0, sec->seg_sz, res);
+	return res;
+}
+
+void flash_trace_sec_init(struct flash_trace_sec* ts, struct flash_sec const* target, struct flash_trace* t)
+{
+	ts->sec = *target;
+	ts->sec.erase = flash_trace_erase;
+	ts->sec.write = flash_trace_write;
+	ts->sec.write_bytes = flash_trace_write_bytes;
+	ts->sec.priv = ts;
+	ts->sec.erase_seg = target->erase_seg ? flash_trace_erase_seg : 0;
+	ts->target = target;
+	ts->trace = t;
+}
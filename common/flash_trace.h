@@ -0,0 +1,81 @@
+#pragma once
+
+#include "flash_sec.h"
+#include <stdint.h>
+
+/*
+ * Flash operation trace recorder. The traced sector is a decorator over the real one: it forwards every
+ * erase / write / write_bytes call to the target sector and records the operation into the trace.
+ * The trace is kept in the compact binary ring buffer (the oldest records are dropped on overflow)
+ * or passed to the sink callback (typically writing it to the file on the host).
+ */
+
+/* Operation codes */
+#define FLASH_TRACE_ERASE       1
+#define FLASH_TRACE_WRITE       2
+#define FLASH_TRACE_WRITE_BYTES 3
+#define FLASH_TRACE_ERASE_SEG   4
+#define FLASH_TRACE_OP_MASK     0xf
+
+/* Operation flags */
+#define FLASH_TRACE_DATA   0x40 /* the record is followed by the data written */
+#define FLASH_TRACE_FAILED 0x80 /* the operation returned error */
+
+/* Encoded record header size. The header has the following layout (little endian):
+ * op:8 | sec_no:8 | hash:16 | off:32 | sz:32 | ts:32
+ */
+#define FLASH_TRACE_HDR_SZ 16
+
+/* Decoded trace record */
+struct flash_trace_rec {
+	uint8_t		op;
+	uint8_t		no;   /* sector number */
+	uint16_t	hash; /* crc16 of the data written */
+	uint32_t	off;
+	uint32_t	sz;   /* data size or sector size for erase */
+	uint32_t	ts;   /* timestamp */
+	void const*	data; /* data written if FLASH_TRACE_DATA flag is set, 0 otherwise */
+};
+
+struct flash_trace {
+	uint8_t*	buff;   /* ring buffer, may be 0 if sink is provided */
+	unsigned	size;   /* ring buffer size */
+	unsigned	head;   /* the offset of the first record */
+	unsigned	len;    /* the total length of the records in buffer */
+	unsigned	lost;   /* the number of records dropped on overflow */
+	uint8_t		with_data; /* record data written */
+	uint32_t	(*clock)(void); /* timestamp source, may be 0 */
+	void		(*sink)(struct flash_trace*, void const* rec, unsigned sz);
+	void*		sink_ctx;
+};
+
+/* The decorator over the target sector. The sec member may be copied (to the array passed to
+ * cfg_stor_init for example) since it refers to the decorator context by the priv pointer.
+ */
+struct flash_trace_sec {
+	struct flash_sec	sec;
+	struct flash_sec const*	target;
+	struct flash_trace*	trace;
+};
+
+/* Initialize trace with the ring buffer. The clock may be 0. */
+void flash_trace_init(struct flash_trace* t, void* buff, unsigned size, uint32_t (*clock)(void));
+
+/* Initialize traced sector. It has the same number, base and size as the target one. */
+void flash_trace_sec_init(struct flash_trace_sec* ts, struct flash_sec const* target, struct flash_trace* t);
+
+/* Reset ring buffer content */
+static inline void flash_trace_reset(struct flash_trace* t)
+{
+	t->head = t->len = t->lost = 0;
+}
+
+/* Copy up to sz bytes of the ring buffer content starting from the given offset to buff.
+ * Return the number of bytes copied.
+ */
+unsigned flash_trace_read(struct flash_trace const* t, unsigned off, void* buff, unsigned sz);
+
+/* Decode the record from the buffer. Return the encoded record size or 0 if the buffer
+ * does not contain the complete record.
+ */
+unsigned flash_trace_decode(void const* buff, unsigned sz, struct flash_trace_rec* r);
@@ -0,0 +1,265 @@
+#include "flash_vsec.h"
+#include <string.h>
+
+#define ID_SZ      4 /* id | ~id | seq:16 */
+#define STATE_DONE 0
+
+static inline struct flash_varea* vsec_area(struct flash_sec const* sec)
+{
+	return sec->priv;
+}
+
+static inline unsigned vsec_id(struct flash_varea const* a, struct flash_sec const* sec)
+{
+	return sec - a->vsecs;
+}
+
+/* Return the physical sector containing the given address */
+static inline unsigned vsec_phys(struct flash_varea const* a, unsigned addr)
+{
+	return addr - a->phys[1]->base < a->phys[1]->size ? 1 : 0;
+}
+
+static inline unsigned slot_base(struct flash_varea const* a, unsigned phys, unsigned i)
+{
+	return a->phys[phys]->base + i * a->slot_sz;
+}
+
+static inline int seq_newer(uint16_t a, uint16_t b)
+{
+	return (int16_t)(a - b) > 0;
+}
+
+/* Write the header unit of the given slot. The rest of the unit is padded by 0xff. */
+static int vsec_write_hdr(struct flash_varea* a, unsigned phys, unsigned i, unsigned off, void const* data, unsigned sz)
+{
+	struct flash_sec const* f = a->phys[phys];
+	uint8_t unit[FLASH_VSEC_UNIT_MAX];
+	if (f->prog_unit <= 1) {
+		return f->write(f, i * a->slot_sz + off, data, sz);
+	}
+	memset(unit, 0xff, f->prog_unit);
+	memcpy(unit, data, sz);
+	return f->write(f, i * a->slot_sz + off, unit, f->prog_unit);
+}
+
+/* Allocate the next blank slot of the active sector writing the slot id. Return the slot index or -1 on error. */
+static int vsec_alloc(struct flash_varea* a, unsigned id)
+{
+	unsigned i = a->next;
+	uint16_t seq = a->seq + 1;
+	uint8_t const hdr[ID_SZ] = {id, ~id, (uint8_t)seq, (uint8_t)(seq >> 8)};
+	if (i >= a->nslots) {
+		return -1;
+	}
+	/* The slot is consumed even if writing fails */
+	++a->next;
+	a->seq = seq;
+	if (vsec_write_hdr(a, a->active, i, 0, hdr, sizeof(hdr))) {
+		return -1;
+	}
+	return i;
+}
+
+/* Mark the slot content complete and make it current for the given virtual sector */
+static int vsec_commit(struct flash_varea* a, struct flash_sec* sec, unsigned i)
+{
+	uint8_t const state = STATE_DONE;
+	if (vsec_write_hdr(a, a->active, i, a->hdr_sz / 2, &state, 1)) {
+		return -1;
+	}
+	sec->base = slot_base(a, a->active, i) + a->hdr_sz;
+	return 0;
+}
+
+/* Copy the content of the virtual sector to the new slot skipping blank program units */
+static int vsec_copy(struct flash_varea* a, struct flash_sec const* sec, unsigned i)
+{
+	struct flash_sec const* f = a->phys[a->active];
+	return flash_sec_write_sparse(f, i * a->slot_sz + a->hdr_sz, (uint8_t const*)sec->base, sec->size);
+}
+
+/* Return the number of the virtual sectors residing in the other sector except the given one.
+ * The virtual sectors having no slot yet have zero base.
+ */
+static unsigned vsec_in_other(struct flash_varea const* a, struct flash_sec const* skip)
+{
+	unsigned i, cnt = 0;
+	for (i = 0; i < a->nvsecs; ++i) {
+		if (&a->vsecs[i] != skip && a->vsecs[i].base && vsec_phys(a, a->vsecs[i].base) != a->active) {
+			++cnt;
+		}
+	}
+	return cnt;
+}
+
+int flash_varea_maintain(struct flash_varea* a)
+{
+	struct flash_sec const* other = a->phys[!a->active];
+	unsigned i;
+	if (!a->dirty) {
+		return 0;
+	}
+	if (a->nslots - a->next < vsec_in_other(a, 0)) {
+		/* The slots were wasted by failed writes so there is no way to free the other sector */
+		return -1;
+	}
+	for (i = 0; i < a->nvsecs; ++i) {
+		struct flash_sec* sec = &a->vsecs[i];
+		int slot;
+		if (!sec->base || vsec_phys(a, sec->base) == a->active) {
+			continue;
+		}
+		if (
+			(slot = vsec_alloc(a, i)) < 0 ||
+			vsec_copy(a, sec, slot) ||
+			vsec_commit(a, sec, slot)
+		) {
+			return -1;
+		}
+		++a->moves;
+	}
+	++a->erase_cnt;
+	if (other->erase(other)) {
+		return -1;
+	}
+	a->dirty = 0;
+	return 0;
+}
+
+/* Move the virtual sector to the new blank slot */
+static int vsec_renew(struct flash_varea* a, struct flash_sec* sec)
+{
+	int slot;
+	if (a->dirty && a->nslots - a->next <= vsec_in_other(a, sec) + a->nvsecs) {
+		/* The rest of the active sector is left for the maintenance copying the other virtual sectors.
+		 * The extra room for the slots wasted by failed writes is reserved as well.
+		 */
+		return -1;
+	}
+	if (a->next >= a->nslots) {
+		/* Switch to the other sector cleaned by the maintenance */
+		a->active = !a->active;
+		a->next = 0;
+		a->dirty = 1;
+	}
+	if ((slot = vsec_alloc(a, vsec_id(a, sec))) < 0) {
+		return -1;
+	}
+	return vsec_commit(a, sec, slot);
+}
+
+static int vsec_erase(struct flash_sec const* sec)
+{
+	struct flash_varea* a = vsec_area(sec);
+	return vsec_renew(a, &a->vsecs[vsec_id(a, sec)]);
+}
+
+static int vsec_write(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	struct flash_sec const* f = vsec_area(sec)->phys[vsec_phys(vsec_area(sec), sec->base)];
+	if (off > sec->size || sz > sec->size - off) {
+		return -1;
+	}
+	return f->write(f, sec->base - f->base + off, data, sz);
+}
+
+static int vsec_write_bytes(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	struct flash_sec const* f = vsec_area(sec)->phys[vsec_phys(vsec_area(sec), sec->base)];
+	if (off > sec->size || sz > sec->size - off) {
+		return -1;
+	}
+	return f->write_bytes(f, sec->base - f->base + off, data, sz);
+}
+
+/* Scan slot headers of the given physical sector assigning current slots to the virtual sectors.
+ * Return the number of used slots.
+ */
+static unsigned vsec_scan(struct flash_varea* a, unsigned phys, uint16_t* seq, uint8_t* found)
+{
+	unsigned i, used = 0;
+	for (i = 0; i < a->nslots; ++i) {
+		uint8_t const* hdr = (uint8_t const*)slot_base(a, phys, i);
+		uint16_t s = hdr[2] | ((uint16_t)hdr[3] << 8);
+		if (flash_blank(hdr, a->hdr_sz)) {
+			continue;
+		}
+		used = i + 1;
+		if ((hdr[0] ^ hdr[1]) != 0xff || hdr[0] >= a->nvsecs || hdr[a->hdr_sz / 2] != STATE_DONE) {
+			continue;
+		}
+		if (!found[hdr[0]] || seq_newer(s, seq[hdr[0]])) {
+			found[hdr[0]] = 1;
+			seq[hdr[0]] = s;
+			a->vsecs[hdr[0]].base = slot_base(a, phys, i) + a->hdr_sz;
+		}
+	}
+	return used;
+}
+
+int flash_varea_init(struct flash_varea* a, struct flash_sec const* phys0, struct flash_sec const* phys1,
+			unsigned slot_sz, struct flash_sec* vsecs, unsigned nvsecs)
+{
+	unsigned i, u = phys0->prog_unit, used[2];
+	uint16_t seq[255];
+	uint8_t found[255];
+	int last = -1;
+	a->phys[0] = phys0;
+	a->phys[1] = phys1;
+	a->vsecs = vsecs;
+	a->nvsecs = nvsecs;
+	a->slot_sz = slot_sz;
+	a->nslots = slot_sz ? phys0->size / slot_sz : 0;
+	a->hdr_sz = 2 * (u > ID_SZ ? u : ID_SZ);
+	a->erase_cnt = 0;
+	a->moves = 0;
+	a->seq = 0;
+	if (
+		phys0->size != phys1->size || u > FLASH_VSEC_UNIT_MAX || nvsecs > 255 ||
+		a->nslots <= 2 * nvsecs || a->nslots * slot_sz != phys0->size || slot_sz % u || slot_sz <= a->hdr_sz
+	) {
+		return -1;
+	}
+	for (i = 0; i < nvsecs; ++i) {
+		flash_sec_init(&vsecs[i], i, 0, slot_sz - a->hdr_sz);
+		vsecs[i].prog_unit = u;
+		vsecs[i].erase = vsec_erase;
+		vsecs[i].write = vsec_write;
+		vsecs[i].write_bytes = vsec_write_bytes;
+		vsecs[i].priv = a;
+		found[i] = 0;
+	}
+	used[0] = vsec_scan(a, 0, seq, found);
+	used[1] = vsec_scan(a, 1, seq, found);
+	/* The active sector has the newest slot */
+	for (i = 0; i < nvsecs; ++i) {
+		if (found[i] && (last < 0 || seq_newer(seq[i], a->seq))) {
+			a->seq = seq[i];
+			last = i;
+		}
+	}
+	if (last >= 0) {
+		a->active = vsec_phys(a, vsecs[last].base);
+		a->next = used[a->active];
+	} else {
+		/* Nothing was found, start from scratch */
+		a->active = 0;
+		a->next = 0;
+		if (!flash_blank((uint8_t const*)phys0->base, phys0->size)) {
+			++a->erase_cnt;
+			if (phys0->erase(phys0)) {
+				return -1;
+			}
+		}
+	}
+	/* The erase of the other sector may be interrupted by power failure so check it is blank */
+	a->dirty = !flash_blank((uint8_t const*)a->phys[!a->active]->base, phys0->size);
+	/* Allocate slots for the new virtual sectors */
+	for (i = 0; i < nvsecs; ++i) {
+		if (!found[i] && vsec_renew(a, &vsecs[i])) {
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "flash_sec.h"
+#include <stdint.h>
+
+/*
+ * Virtual sectors carved from the pair of large physical sectors (like 128k STM32F4 sectors taking
+ * over a second to erase). The physical sectors are split onto equally sized slots. The virtual sector
+ * occupies one slot at a time. Its erase just allocates the next blank slot of the active physical sector
+ * so it takes the single slot header write. Once the active sector is full the other one becomes active.
+ *
+ * The other sector is cleaned by flash_varea_maintain which is expected to be called in idle time.
+ * It copies the virtual sectors still residing there to the active sector and erases it physically.
+ * So the single physical erase is shared by all virtual sectors. The virtual sector erase never moves
+ * other virtual sectors. It fails while the other sector needs maintenance and the free room of the active
+ * sector has dropped to the number of slots needed for copying plus the number of virtual sectors reserved
+ * for the slots wasted by failed writes.
+ *
+ * The slot starts with the header of two program units (at least 4 bytes each):
+ *
+ * id | ~id | seq:16    written on slot allocation
+ * state                the slot content is complete (cleared after copying the content)
+ *
+ * The slot having the highest sequence number is the current one for the given virtual sector id.
+ * The base address of the virtual sector changes on its erase and on the maintenance. The pointers to
+ * the content of the virtual sectors obtained before the maintenance become stale. The users keeping such
+ * pointers may check the moves counter or the base address of the sector.
+ */
+
+/* The maximum program unit size supported */
+#define FLASH_VSEC_UNIT_MAX 32
+
+struct flash_varea {
+	struct flash_sec const*	phys[2]; /* the pair of equally sized physical sectors */
+	struct flash_sec*	vsecs;   /* virtual sectors, the id is the index in array */
+	unsigned		nvsecs;
+	unsigned		slot_sz;
+	unsigned		nslots;  /* the number of slots per physical sector */
+	unsigned		hdr_sz;
+	unsigned		next;    /* the next blank slot of the active sector */
+	unsigned		erase_cnt; /* the number of physical erases */
+	unsigned		moves;   /* the number of virtual sectors moved by the maintenance */
+	uint16_t		seq;     /* the last allocated sequence number */
+	uint8_t			active;  /* the active physical sector */
+	uint8_t			dirty;   /* the other physical sector needs erase */
+};
+
+/* Initialize area on boot. The virtual sectors array is initialized and may be passed to the storages.
+ * The virtual sectors should not be copied since their base address changes. The physical sector size must be
+ * the multiple of slot_sz and the number of slots per physical sector must exceed the doubled number of virtual sectors.
+ * Return 0 on success, -1 on flash writing error or invalid geometry.
+ */
+int flash_varea_init(struct flash_varea* a, struct flash_sec const* phys0, struct flash_sec const* phys1,
+			unsigned slot_sz, struct flash_sec* vsecs, unsigned nvsecs);
+
+/* Return 1 if the other physical sector needs maintenance, 0 otherwise */
+static inline int flash_varea_dirty(struct flash_varea const* a)
+{
+	return a->dirty;
+}
+
+/* Copy the virtual sectors residing in the other physical sector to the active one and erase it.
+ * The base address of the virtual sectors copied is updated before the physical erase.
+ * Return 0 on success, -1 on flash writing error.
+ */
+int flash_varea_maintain(struct flash_varea* a);
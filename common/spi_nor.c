@@ -0,0 +1,215 @@
+#include "spi_nor.h"
+#include <string.h>
+
+/* The maximum number of status polls waiting for operation completion.
+ * The status read takes about 1us so it is well above the max sector erase time.
+ */
+#define BUSY_POLLS 2000000
+/* The progress hook is called every PROGRESS_POLLS status polls (about 1ms) */
+#define PROGRESS_POLLS 1024
+
+static int spi_nor_cmd(struct spi_nor* nor, uint8_t const* cmd, unsigned cmd_sz, void const* tx, void* rx, unsigned sz)
+{
+	return nor->bus->xfer(nor->bus->ctx, cmd, cmd_sz, tx, rx, sz);
+}
+
+/* Build the command followed by the 24 bit address */
+static void spi_nor_addr_cmd(uint8_t* cmd, uint8_t code, unsigned addr)
+{
+	cmd[0] = code;
+	cmd[1] = (uint8_t)(addr >> 16);
+	cmd[2] = (uint8_t)(addr >> 8);
+	cmd[3] = (uint8_t)addr;
+}
+
+/* Wait till the program / erase operation completes */
+static int spi_nor_wait(struct spi_nor* nor)
+{
+	uint8_t const cmd = SPI_NOR_CMD_RDSR;
+	uint8_t sr;
+	unsigned i;
+	for (i = 0; i < BUSY_POLLS; ++i) {
+		if (spi_nor_cmd(nor, &cmd, 1, 0, &sr, 1)) {
+			return -1;
+		}
+		if (!(sr & SPI_NOR_SR_WIP)) {
+			return 0;
+		}
+		if (nor->progress && !((i + 1) % PROGRESS_POLLS)) {
+			nor->progress();
+		}
+	}
+	return -1;
+}
+
+static int spi_nor_write_enable(struct spi_nor* nor)
+{
+	uint8_t const cmd = SPI_NOR_CMD_WREN;
+	return spi_nor_cmd(nor, &cmd, 1, 0, 0, 0);
+}
+
+static int spi_nor_read(struct spi_nor* nor, unsigned addr, void* buff, unsigned sz)
+{
+	uint8_t cmd[5];
+	spi_nor_addr_cmd(cmd, SPI_NOR_CMD_READ, addr);
+	cmd[4] = 0; /* dummy */
+	return spi_nor_cmd(nor, cmd, sizeof(cmd), 0, buff, sz);
+}
+
+int spi_nor_init(struct spi_nor* nor, struct spi_nor_bus const* bus)
+{
+	uint8_t const rdp = SPI_NOR_CMD_RDP, rdid = SPI_NOR_CMD_RDID;
+	uint8_t id[3];
+	nor->bus = bus;
+	nor->progress = 0;
+	nor->id = 0;
+	if (
+		spi_nor_cmd(nor, &rdp, 1, 0, 0, 0) ||
+		spi_nor_cmd(nor, &rdid, 1, 0, id, sizeof(id))
+	) {
+		return -1;
+	}
+	nor->id = ((uint32_t)id[0] << 16) | ((uint32_t)id[1] << 8) | id[2];
+	return nor->id && nor->id != 0xffffff ? 0 : -1;
+}
+
+/* Program the range of the shadow within the single page and read it back if the verify is set */
+static int spi_nor_program(struct spi_nor_sec* s, unsigned off, unsigned sz, int verify)
+{
+	struct spi_nor* nor = s->nor;
+	uint8_t const* data = (uint8_t const*)(s->sec.base + off);
+	uint8_t cmd[4];
+	spi_nor_addr_cmd(cmd, SPI_NOR_CMD_PP, s->addr + off);
+	if (
+		spi_nor_write_enable(nor) ||
+		spi_nor_cmd(nor, cmd, sizeof(cmd), data, 0, sz) ||
+		spi_nor_wait(nor)
+	) {
+		return -1;
+	}
+	if (!verify) {
+		return 0;
+	}
+	if (spi_nor_read(nor, s->addr + off, nor->buff, sz)) {
+		return -1;
+	}
+	return memcmp(nor->buff, data, sz) ? -1 : 0;
+}
+
+int spi_nor_sec_flush(struct spi_nor_sec* s)
+{
+	unsigned off = s->pend_off, end = s->pend_end;
+	int verify = s->verify == CFG_VERIFY_CRC || s->verify == CFG_VERIFY_COMPARE;
+	s->pend_off = s->pend_end = 0;
+	while (off < end) {
+		/* The page program wraps around the page boundary so split the range by pages */
+		unsigned n = SPI_NOR_PAGE_SZ - (s->addr + off) % SPI_NOR_PAGE_SZ;
+		if (n > end - off) {
+			n = end - off;
+		}
+		if (spi_nor_program(s, off, n, verify)) {
+			return -1;
+		}
+		off += n;
+	}
+	return 0;
+}
+
+/* Update the shadow. Programming may only clear bits. */
+static void spi_nor_shadow_write(struct spi_nor_sec* s, unsigned off, void const* data, unsigned sz)
+{
+	uint8_t* ptr = (uint8_t*)(s->sec.base + off);
+	uint8_t const* src = data;
+	for (; sz; --sz) {
+		*ptr++ &= *src++;
+	}
+}
+
+static int spi_nor_sec_erase(struct flash_sec const* sec)
+{
+	struct spi_nor_sec* s = sec->priv;
+	uint8_t cmd[4];
+	unsigned off;
+	/* The pending data are lost anyway */
+	s->pend_off = s->pend_end = 0;
+	for (off = 0; off < sec->size; off += SPI_NOR_SEC_SZ) {
+		spi_nor_addr_cmd(cmd, SPI_NOR_CMD_SE, s->addr + off);
+		if (
+			spi_nor_write_enable(s->nor) ||
+			spi_nor_cmd(s->nor, cmd, sizeof(cmd), 0, 0, 0) ||
+			spi_nor_wait(s->nor)
+		) {
+			return -1;
+		}
+	}
+	memset((void*)sec->base, 0xff, sec->size);
+	return 0;
+}
+
+static int spi_nor_sec_write(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	struct spi_nor_sec* s = sec->priv;
+	if (off > sec->size || sz > sec->size - off) {
+		return -1;
+	}
+	if (!sz) {
+		return 0;
+	}
+	if (s->pend_off < s->pend_end && (off > s->pend_end || off + sz < s->pend_off)) {
+		/* Not adjacent to the pending range */
+		if (spi_nor_sec_flush(s)) {
+			return -1;
+		}
+	}
+	spi_nor_shadow_write(s, off, data, sz);
+	if (s->pend_off == s->pend_end) {
+		s->pend_off = off;
+		s->pend_end = off + sz;
+	} else {
+		if (off < s->pend_off) {
+			s->pend_off = off;
+		}
+		if (off + sz > s->pend_end) {
+			s->pend_end = off + sz;
+		}
+	}
+	return 0;
+}
+
+static int spi_nor_sec_write_bytes(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	struct spi_nor_sec* s = sec->priv;
+	uint8_t const* src = data;
+	if (off > sec->size || sz > sec->size - off) {
+		return -1;
+	}
+	if (spi_nor_sec_flush(s)) {
+		return -1;
+	}
+	for (; sz; --sz, ++off, ++src) {
+		spi_nor_shadow_write(s, off, src, 1);
+		if (spi_nor_program(s, off, 1, s->verify != CFG_VERIFY_NONE)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int spi_nor_sec_init(struct spi_nor_sec* s, struct spi_nor* nor, unsigned no, unsigned addr, void* shadow, unsigned size)
+{
+	s->sec.no = no;
+	s->sec.base = (unsigned)(uintptr_t)shadow;
+	s->sec.size = size;
+	s->sec.prog_unit = 1;
+	s->sec.erase = spi_nor_sec_erase;
+	s->sec.write = spi_nor_sec_write;
+	s->sec.write_bytes = spi_nor_sec_write_bytes;
+	s->sec.priv = s;
+	s->sec.seg_sz = 0;
+	s->sec.erase_seg = 0;
+	s->nor = nor;
+	s->addr = addr;
+	s->pend_off = s->pend_end = 0;
+	s->verify = CFG_VERIFY_CRC;
+	return spi_nor_read(nor, addr, shadow, size);
+}
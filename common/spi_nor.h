@@ -0,0 +1,85 @@
+#pragma once
+
+#include "flash_sec.h"
+#include "cfg_pool.h"
+#include <stdint.h>
+
+/*
+ * External SPI NOR flash backend (25-series command set, 256 byte pages, 4KB erase sectors).
+ * The flash sector is mirrored by the RAM shadow so the sector base address refers to the shadow
+ * and the pool reads it directly without slow SPI transfers. The shadow is loaded once on init.
+ *
+ * The write calls are batched. They update the shadow and extend the pending range which is
+ * programmed by page program commands later - on the next write_bytes call, on the write not
+ * adjacent to the pending range or on explicit flush. The write_bytes flushes pending data and
+ * then programs bytes one by one so the order of programming is preserved the same way as
+ * with the embedded flash. The pool relies on that order to survive power failures: the chained
+ * flag is set before writing data, the checksum is written before the validator and the validator
+ * before the complete flag. Since the order of programming bytes by the single page program command
+ * is undefined they can't be merged. The programmed ranges are read back and compared to the shadow according
+ * to the verification policy. The pool verifies the shadow only so the policy should match the one of the pool.
+ */
+
+#define SPI_NOR_PAGE_SZ 256
+#define SPI_NOR_SEC_SZ  0x1000
+
+/* Commands */
+#define SPI_NOR_CMD_WREN  0x06
+#define SPI_NOR_CMD_RDSR  0x05
+#define SPI_NOR_CMD_READ  0x0b /* fast read with one dummy byte */
+#define SPI_NOR_CMD_PP    0x02
+#define SPI_NOR_CMD_SE    0x20
+#define SPI_NOR_CMD_RDID  0x9f
+#define SPI_NOR_CMD_RDP   0xab /* release from deep power down */
+
+/* Status register bits */
+#define SPI_NOR_SR_WIP 1
+#define SPI_NOR_SR_WEL 2
+
+/* The bus transfer selects the chip, sends cmd_sz command bytes then either transmits sz bytes
+ * from tx or receives sz bytes to rx (one of them is 0) and releases the chip. The implementation
+ * is expected to use DMA for the payload. Returns 0 on success, -1 on failure.
+ */
+struct spi_nor_bus {
+	int	(*xfer)(void* ctx, uint8_t const* cmd, unsigned cmd_sz, void const* tx, void* rx, unsigned sz);
+	void*	ctx;
+};
+
+struct spi_nor {
+	struct spi_nor_bus const* bus;
+	void		(*progress)(void); /* called while waiting for program / erase completion, may be 0 */
+	uint32_t	id;   /* JEDEC ID */
+	uint8_t		buff[SPI_NOR_PAGE_SZ]; /* read back buffer */
+};
+
+/* The sector backend. The size is the multiple of SPI_NOR_SEC_SZ. The sec member may be copied
+ * since it refers to the backend context by the priv pointer.
+ */
+struct spi_nor_sec {
+	struct flash_sec sec;
+	struct spi_nor*	nor;
+	unsigned	addr;     /* the chip address of the sector */
+	unsigned	pend_off; /* pending range to be programmed */
+	unsigned	pend_end;
+	uint8_t		verify;   /* read back policy, one of CFG_VERIFY_XXX */
+};
+
+/* Initialize chip. The progress hook is set to 0. Return 0 on success, -1 if there is no chip responding. */
+int spi_nor_init(struct spi_nor* nor, struct spi_nor_bus const* bus);
+
+/* Initialize sector at the given chip address mirrored by the shadow buffer of the sector size
+ * and load its content. Return 0 on success, -1 on bus error.
+ */
+int spi_nor_sec_init(struct spi_nor_sec* s, struct spi_nor* nor, unsigned no, unsigned addr, void* shadow, unsigned size);
+
+/* Set the read back policy. The sector is initialized with CFG_VERIFY_CRC the same way as the pool. With CFG_VERIFY_CRC
+ * or CFG_VERIFY_COMPARE every programmed range is read back, with CFG_VERIFY_MARKER only the ranges written by write_bytes
+ * (the record marker and status), with CFG_VERIFY_NONE nothing is read back.
+ */
+static inline void spi_nor_sec_set_verify(struct spi_nor_sec* s, uint8_t verify)
+{
+	s->verify = verify;
+}
+
+/* Program pending data. Return 0 on success, -1 on programming error. */
+int spi_nor_sec_flush(struct spi_nor_sec* s);
@@ -0,0 +1,318 @@
+/*
+ * Host benchmark for configuration pool and storage operations. It runs on the flash emulator
+ * sweeping item size, sector size and pool fill level and prints CSV with the following columns:
+ *
+ * op,model,item_sz,sec_sz,fill,iterations,wall_ns,model_ns
+ *
+ * The wall_ns is the average host time per operation and the model_ns is the average device time
+ * spent in flash erase and programming according to the emulator cost model. The commit cost is
+ * averaged over the full pool cycle starting at the given fill level so it includes the erase.
+ * The cfg_pool_commit_compare / _marker / _none rows repeat the commit cycle with the corresponding
+ * read back verification policy (the default cfg_pool_commit row uses CFG_VERIFY_CRC).
+ *
+ * The embedded flash is memory mapped so the read back costs CPU time only and the model_ns does not
+ * depend on the verification policy. The spi_nor model runs the same benchmarks on the SPI NOR backend
+ * and the chip model. Its model_ns includes the bus transfers so it shows the read back cost of every
+ * policy. It supports the sector sizes multiple of 4KB only.
+ *
+ * Usage: cfg_bench [stm32f4|msp430|stm32l4|spi_nor]
+ */
+
+#include "cfg_storage.h"
+#include "flash.h"
+#include "spi_nor_model.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define MIN_WALL_NS 20000000ULL
+#define MAX_ITER 100000
+
+static unsigned const item_sizes[] = {4, 16, 32, 64, 256, 1024, 4096};
+static unsigned const sec_sizes[] = {512, 2048, 0x4000, 0x10000, 0x20000};
+static unsigned const fill_levels[] = {0, 50, 90};
+
+static struct flash_emu_cost const* const costs[] = {
+	&flash_emu_cost_stm32f4,
+	&flash_emu_cost_msp430,
+	&flash_emu_cost_stm32l4
+};
+
+static struct flash_emu_cost const* cost = &flash_emu_cost_stm32f4;
+static char const* model_name;
+
+/* SPI NOR model used instead of the emulator if nor_shadow is not 0 */
+#define NOR_MODEL   "spi_nor"
+#define NOR_CHIP_SZ 0x100000
+#define NOR_SEC_MAX 0x20000
+
+static struct spi_nor_model nor_model;
+static struct spi_nor nor;
+static struct spi_nor_sec nor_sec[2];
+static uint8_t* nor_shadow;
+
+static uint8_t item[4096];
+
+static struct {
+	char const*	op;
+	uint8_t		verify;
+} const verify_policies[] = {
+	{"cfg_pool_commit_compare", CFG_VERIFY_COMPARE},
+	{"cfg_pool_commit_marker", CFG_VERIFY_MARKER},
+	{"cfg_pool_commit_none", CFG_VERIFY_NONE}
+};
+
+struct bench {
+	char const* op;
+	unsigned item_sz;
+	unsigned sec_sz;
+	unsigned fill;
+	unsigned long iter;
+	unsigned long long start_ns;
+	unsigned long long start_model_ns;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Return the modelled device time */
+static unsigned long long model_ns(void)
+{
+	return nor_shadow ? nor_model.now_ns : flash_emu_get_stats()->model_ns;
+}
+
+/* Setup n erased sectors of the given size. Return 0 on success, -1 on failure. */
+static int bench_flash_setup(struct flash_sec* sec, unsigned n, unsigned sec_sz)
+{
+	unsigned i;
+	if (!nor_shadow) {
+		if (flash_emu_init(n, sec_sz)) {
+			return -1;
+		}
+		for (i = 0; i < n; ++i) {
+			flash_sec_init(&sec[i], i, flash_emu_sec_base(i), sec_sz);
+			sec[i].prog_unit = flash_emu_prog_unit();
+		}
+		return 0;
+	}
+	for (i = 0; i < n; ++i) {
+		if (
+			spi_nor_sec_init(&nor_sec[i], &nor, i, i * sec_sz, nor_shadow + i * sec_sz, sec_sz) ||
+			nor_sec[i].sec.erase(&nor_sec[i].sec)
+		) {
+			return -1;
+		}
+		sec[i] = nor_sec[i].sec;
+	}
+	return 0;
+}
+
+/* Set the verification policy of the pool on the sector i. The SPI NOR backend reads back according to the same policy. */
+static void bench_set_verify(struct cfg_pool* pool, unsigned i, uint8_t verify)
+{
+	cfg_pool_set_verify(pool, verify);
+	if (nor_shadow) {
+		spi_nor_sec_set_verify(&nor_sec[i], verify);
+	}
+}
+
+static void bench_start(struct bench* b, char const* op)
+{
+	b->op = op;
+	b->iter = 0;
+	b->start_model_ns = model_ns();
+	b->start_ns = now_ns();
+}
+
+/* Return 1 if the benchmark should continue running */
+static int bench_continue(struct bench* b)
+{
+	return b->iter < MAX_ITER && (b->iter < 3 || now_ns() - b->start_ns < MIN_WALL_NS);
+}
+
+static void bench_report(struct bench* b)
+{
+	unsigned long long wall_ns = now_ns() - b->start_ns;
+	unsigned long long dev_ns = model_ns() - b->start_model_ns;
+	if (!b->iter) {
+		return;
+	}
+	printf("%s,%s,%u,%u,%u,%lu,%llu,%llu\n", b->op, model_name, b->item_sz, b->sec_sz, b->fill,
+		b->iter, wall_ns / b->iter, dev_ns / b->iter);
+}
+
+/* Update test item content */
+static void item_next(unsigned item_sz)
+{
+	unsigned i;
+	for (i = 0; i < item_sz; ++i) {
+		++item[i];
+	}
+}
+
+static int bench_pool(struct bench* b, unsigned nrecs)
+{
+	struct flash_sec sec;
+	struct cfg_pool pool;
+	unsigned i, nfill = nrecs * b->fill / 100;
+
+	if (bench_flash_setup(&sec, 1, b->sec_sz)) {
+		return -1;
+	}
+	if (cfg_pool_init(&pool, b->item_sz, &sec)) {
+		return -1;
+	}
+	for (i = 0; i < nfill; ++i) {
+		item_next(b->item_sz);
+		if (cfg_pool_commit(&pool, item)) {
+			return -1;
+		}
+	}
+
+	for (bench_start(b, "cfg_pool_init"); bench_continue(b); ++b->iter) {
+		if (cfg_pool_init(&pool, b->item_sz, &sec)) {
+			return -1;
+		}
+	}
+	bench_report(b);
+
+	for (bench_start(b, "cfg_pool_commit"); b->iter < nrecs; ++b->iter) {
+		item_next(b->item_sz);
+		if (cfg_pool_commit(&pool, item)) {
+			return -1;
+		}
+	}
+	bench_report(b);
+
+	/* The same commit cycle with other verification policies */
+	for (i = 0; i < sizeof(verify_policies) / sizeof(verify_policies[0]); ++i) {
+		if (cfg_pool_init(&pool, b->item_sz, &sec)) {
+			return -1;
+		}
+		bench_set_verify(&pool, 0, verify_policies[i].verify);
+		for (bench_start(b, verify_policies[i].op); b->iter < nrecs; ++b->iter) {
+			item_next(b->item_sz);
+			if (cfg_pool_commit(&pool, item)) {
+				return -1;
+			}
+		}
+		bench_report(b);
+	}
+	bench_set_verify(&pool, 0, CFG_VERIFY_CRC);
+	return 0;
+}
+
+static int bench_storage(struct bench* b, unsigned nrecs)
+{
+	struct flash_sec sec[2];
+	struct cfg_storage stor;
+	unsigned i, nfill = nrecs * b->fill / 100;
+
+	if (bench_flash_setup(sec, 2, b->sec_sz)) {
+		return -1;
+	}
+	if (cfg_stor_init(&stor, b->item_sz, sec)) {
+		return -1;
+	}
+	for (i = 0; i < nfill; ++i) {
+		item_next(b->item_sz);
+		if (cfg_stor_commit(&stor, item)) {
+			return -1;
+		}
+	}
+
+	for (bench_start(b, "cfg_stor_init"); bench_continue(b); ++b->iter) {
+		if (cfg_stor_init(&stor, b->item_sz, sec)) {
+			return -1;
+		}
+	}
+	bench_report(b);
+
+	for (bench_start(b, "cfg_stor_get"); bench_continue(b); ++b->iter) {
+		if (!cfg_stor_get(&stor) && nfill) {
+			return -1;
+		}
+	}
+	bench_report(b);
+
+	for (bench_start(b, "cfg_stor_commit"); b->iter < nrecs; ++b->iter) {
+		item_next(b->item_sz);
+		if (cfg_stor_commit(&stor, item)) {
+			return -1;
+		}
+	}
+	bench_report(b);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench b;
+	struct flash_sec sec;
+	unsigned i, j, k;
+
+	if (argc > 1 && !strcmp(argv[1], NOR_MODEL)) {
+		/* The shadow address must fit unsigned */
+		nor_shadow = mmap(0, 2 * NOR_SEC_MAX, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_32BIT, -1, 0);
+		if (
+			nor_shadow == MAP_FAILED ||
+			spi_nor_model_init(&nor_model, NOR_CHIP_SZ, &spi_nor_timing_typ) ||
+			spi_nor_init(&nor, &nor_model.bus)
+		) {
+			fprintf(stderr, "SPI NOR model init failed\n");
+			return 1;
+		}
+		model_name = NOR_MODEL;
+		cost = &flash_emu_cost_stm32f4;
+	} else if (argc > 1) {
+		for (i = 0; i < sizeof(costs) / sizeof(costs[0]) && strcmp(argv[1], costs[i]->name); ++i);
+		if (i >= sizeof(costs) / sizeof(costs[0])) {
+			fprintf(stderr, "Usage: %s [%s|%s|%s|%s]\n", argv[0], costs[0]->name, costs[1]->name, costs[2]->name,
+				NOR_MODEL);
+			return 1;
+		}
+		cost = costs[i];
+	}
+	if (!model_name) {
+		model_name = cost->name;
+	}
+	flash_emu_set_cost(cost);
+	flash_sec_init(&sec, 0, 0, 0);
+	sec.prog_unit = flash_emu_prog_unit();
+
+	printf("op,model,item_sz,sec_sz,fill,iterations,wall_ns,model_ns\n");
+	for (i = 0; i < sizeof(sec_sizes) / sizeof(sec_sizes[0]); ++i) {
+		for (j = 0; j < sizeof(item_sizes) / sizeof(item_sizes[0]); ++j) {
+			for (k = 0; k < sizeof(fill_levels) / sizeof(fill_levels[0]); ++k) {
+				/* The storage puts one byte of epoch after the item */
+				unsigned pool_rec_sz = cfg_pool_rec_size(item_sizes[j], &sec);
+				unsigned stor_rec_sz = cfg_pool_rec_size(item_sizes[j] + 1, &sec);
+				b.item_sz = item_sizes[j];
+				b.sec_sz = sec_sizes[i];
+				b.fill = fill_levels[k];
+				if (nor_shadow && (sec_sizes[i] % SPI_NOR_SEC_SZ || sec_sizes[i] > NOR_SEC_MAX)) {
+					continue;
+				}
+				if (sec_sizes[i] / pool_rec_sz >= 2 && bench_pool(&b, sec_sizes[i] / pool_rec_sz)) {
+					fprintf(stderr, "pool benchmark failed: item %u sector %u\n", b.item_sz, b.sec_sz);
+					return 1;
+				}
+				if (sec_sizes[i] / stor_rec_sz >= 2 && bench_storage(&b, sec_sizes[i] / stor_rec_sz)) {
+					fprintf(stderr, "storage benchmark failed: item %u sector %u\n", b.item_sz, b.sec_sz);
+					return 1;
+				}
+			}
+		}
+	}
+	flash_emu_free();
+	if (nor_shadow) {
+		spi_nor_model_free(&nor_model);
+	}
+	return 0;
+}
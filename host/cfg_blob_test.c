@@ -0,0 +1,195 @@
+/*
+ * Tests of the blob storage on the flash emulator. The power failures are emulated by the power
+ * cut scheduled at the given modelled device time.
+ *
+ * Usage: cfg_blob_test [seed]
+ */
+
+#include "test.h"
+#include "cfg_blob.h"
+
+#include <string.h>
+
+#define SEC_SZ   2048
+#define NSEC     3 /* data sectors per bank */
+#define CHUNK_SZ 100
+#define PART_SZ  333 /* the size of the part written at once, not aligned to chunks */
+#define BLOB_MAX (NSEC * SEC_SZ)
+
+/* The manifest pair followed by 2 banks */
+static struct flash_sec sec[2 + 2 * NSEC];
+static uint8_t blob_data[2][BLOB_MAX];
+static uint8_t read_buff[BLOB_MAX];
+
+static void blob_init(struct cfg_blob* b)
+{
+	BUG_ON(cfg_blob_init(b, CHUNK_SZ, sec, &sec[2], &sec[2 + NSEC], NSEC));
+}
+
+static void blob_fill(uint8_t* data, unsigned sz)
+{
+	unsigned i;
+	for (i = 0; i < sz; ++i) {
+		data[i] = (uint8_t)rand();
+	}
+}
+
+/* Write the blob by parts. Return 0 on success, -1 on the first failure. */
+static int blob_write(struct cfg_blob* b, uint8_t const* data, unsigned sz)
+{
+	unsigned off, n;
+	if (cfg_blob_write_begin(b, sz)) {
+		return -1;
+	}
+	for (off = 0; off < sz; off += n) {
+		n = sz - off < PART_SZ ? sz - off : PART_SZ;
+		if (cfg_blob_write(b, data + off, n)) {
+			return -1;
+		}
+	}
+	return cfg_blob_write_end(b);
+}
+
+/* Check the current blob has the given content */
+static void blob_check(struct cfg_blob const* b, uint8_t const* data, unsigned sz)
+{
+	BUG_ON(!cfg_blob_valid(b));
+	BUG_ON(cfg_blob_size(b) != sz);
+	BUG_ON(cfg_blob_verify(b));
+	BUG_ON(cfg_blob_read(b, 0, read_buff, BLOB_MAX) != sz);
+	BUG_ON(memcmp(read_buff, data, sz));
+}
+
+/* Return the bank holding the current blob */
+static unsigned blob_bank(struct cfg_blob const* b)
+{
+	unsigned sz;
+	unsigned addr = (unsigned)(uintptr_t)cfg_blob_chunk(b, 0, &sz);
+	BUG_ON(!addr);
+	return addr >= sec[2 + NSEC].base;
+}
+
+/* The blob spanning all sectors of the bank and the manifest switching the banks */
+static void test_multi_sector(void)
+{
+	struct cfg_blob b;
+	unsigned sz, bank, i;
+	test_flash_setup(sec, 2 + 2 * NSEC, SEC_SZ, &flash_emu_cost_stm32f4);
+	blob_init(&b);
+	BUG_ON(cfg_blob_valid(&b));
+	sz = cfg_blob_capacity(&b);
+	BUG_ON(sz <= (NSEC - 1) * SEC_SZ || sz > BLOB_MAX);
+	/* The size exceeding capacity is refused */
+	BUG_ON(!cfg_blob_write_begin(&b, sz + 1));
+	blob_fill(blob_data[0], sz);
+	BUG_ON(blob_write(&b, blob_data[0], sz));
+	blob_check(&b, blob_data[0], sz);
+	bank = blob_bank(&b);
+	blob_init(&b);
+	blob_check(&b, blob_data[0], sz);
+	/* Every next blob is written to the other bank */
+	for (i = 1; i < 5; ++i) {
+		unsigned const new_sz = sz - i * CHUNK_SZ - i;
+		blob_fill(blob_data[i % 2], new_sz);
+		BUG_ON(blob_write(&b, blob_data[i % 2], new_sz));
+		blob_check(&b, blob_data[i % 2], new_sz);
+		BUG_ON(blob_bank(&b) == bank);
+		bank = blob_bank(&b);
+		blob_init(&b);
+		blob_check(&b, blob_data[i % 2], new_sz);
+		BUG_ON(blob_bank(&b) != bank);
+	}
+	BUG_ON(cfg_blob_delete(&b));
+	BUG_ON(cfg_blob_valid(&b));
+	blob_init(&b);
+	BUG_ON(cfg_blob_valid(&b));
+}
+
+/* The writer errors are sticky till the next cfg_blob_write_begin */
+static void test_write_errors(void)
+{
+	struct cfg_blob b;
+	unsigned const sz = 3 * PART_SZ;
+	test_flash_setup(sec, 2 + 2 * NSEC, SEC_SZ, &flash_emu_cost_stm32f4);
+	blob_init(&b);
+	blob_fill(blob_data[0], sz);
+	/* Nothing is written before cfg_blob_write_begin */
+	BUG_ON(!cfg_blob_write(&b, blob_data[0], 1));
+	BUG_ON(!cfg_blob_write_end(&b));
+	/* Writing past the blob size aborts it */
+	BUG_ON(cfg_blob_write_begin(&b, sz));
+	BUG_ON(cfg_blob_write(&b, blob_data[0], PART_SZ));
+	BUG_ON(!cfg_blob_write(&b, blob_data[0] + PART_SZ, sz));
+	BUG_ON(!cfg_blob_write(&b, blob_data[0] + PART_SZ, PART_SZ));
+	BUG_ON(!cfg_blob_write_end(&b));
+	BUG_ON(cfg_blob_valid(&b));
+	/* Incomplete blob is not committed and aborted */
+	BUG_ON(cfg_blob_write_begin(&b, sz));
+	BUG_ON(cfg_blob_write(&b, blob_data[0], PART_SZ));
+	BUG_ON(!cfg_blob_write_end(&b));
+	BUG_ON(!cfg_blob_write(&b, blob_data[0] + PART_SZ, 2 * PART_SZ));
+	BUG_ON(!cfg_blob_write_end(&b));
+	BUG_ON(cfg_blob_valid(&b));
+	/* The blob is committed once */
+	BUG_ON(blob_write(&b, blob_data[0], sz));
+	BUG_ON(!cfg_blob_write_end(&b));
+	blob_check(&b, blob_data[0], sz);
+}
+
+/* Cut power at every point of the blob write. The write fails and further writes are refused till the
+ * next cfg_blob_write_begin. After the reboot the storage has either the old blob or the new one.
+ */
+static void test_write_interrupted(void)
+{
+	struct cfg_blob b;
+	unsigned long long start, duration, cut;
+	unsigned const old_sz = 2 * SEC_SZ, new_sz = NSEC * SEC_SZ - SEC_SZ / 2;
+	unsigned cuts = 0, updated = 0;
+	test_flash_setup(sec, 2 + 2 * NSEC, SEC_SZ, &flash_emu_cost_stm32f4);
+	blob_fill(blob_data[0], old_sz);
+	blob_fill(blob_data[1], new_sz);
+	blob_init(&b);
+	BUG_ON(blob_write(&b, blob_data[0], old_sz));
+	start = flash_emu_get_stats()->model_ns;
+	BUG_ON(blob_write(&b, blob_data[1], new_sz));
+	duration = flash_emu_get_stats()->model_ns - start;
+	BUG_ON(!duration);
+	for (cut = 0; cut < duration; cut += duration / 200 + 1) {
+		test_flash_setup(sec, 2 + 2 * NSEC, SEC_SZ, &flash_emu_cost_stm32f4);
+		blob_init(&b);
+		BUG_ON(blob_write(&b, blob_data[0], old_sz));
+		flash_emu_cut(cut);
+		if (!blob_write(&b, blob_data[1], new_sz)) {
+			continue;
+		}
+		++cuts;
+		flash_emu_power_up();
+		/* The aborted write stays aborted with the flash working again */
+		BUG_ON(!cfg_blob_write(&b, blob_data[1], 1));
+		BUG_ON(!cfg_blob_write_end(&b));
+		blob_init(&b);
+		if (cfg_blob_size(&b) == new_sz) {
+			/* The manifest commit was cut after the record was complete */
+			blob_check(&b, blob_data[1], new_sz);
+			++updated;
+		} else {
+			blob_check(&b, blob_data[0], old_sz);
+		}
+		/* The interrupted write may be repeated */
+		BUG_ON(blob_write(&b, blob_data[1], new_sz));
+		blob_check(&b, blob_data[1], new_sz);
+		blob_init(&b);
+		blob_check(&b, blob_data[1], new_sz);
+	}
+	BUG_ON(!cuts || updated == cuts);
+}
+
+int main(int argc, char* argv[])
+{
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	TEST_RUN(test_multi_sector);
+	TEST_RUN(test_write_errors);
+	TEST_RUN(test_write_interrupted);
+	printf("passed\n");
+	return 0;
+}
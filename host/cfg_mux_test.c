@@ -0,0 +1,195 @@
+/*
+ * Tests of the multiplexed storage on the flash emulator. The power failures are emulated by the power
+ * cut scheduled at the given modelled device time.
+ *
+ * Usage: cfg_mux_test [seed]
+ */
+
+#include "test.h"
+#include "cfg_mux.h"
+
+#include <string.h>
+
+#define SEC_SZ   2048
+#define NSTREAMS 3
+
+static struct flash_sec sec[2];
+static struct cfg_mux_stream streams[NSTREAMS];
+static unsigned const item_sizes[NSTREAMS] = {4, 12, 8};
+
+static int mux_init(struct cfg_mux* m, unsigned nstreams)
+{
+	unsigned i;
+	for (i = 0; i < nstreams; ++i) {
+		streams[i].item_sz = item_sizes[i];
+	}
+	return cfg_mux_init(m, streams, nstreams, sec);
+}
+
+/* Commit the item of the given stream filled with the given value. Return 0 on success, -1 on flash writing error. */
+static int item_try_commit(struct cfg_mux* m, unsigned id, uint8_t val)
+{
+	uint8_t item[16];
+	memset(item, val, sizeof(item));
+	return cfg_mux_commit(m, id, item);
+}
+
+static void item_commit(struct cfg_mux* m, unsigned id, uint8_t val)
+{
+	BUG_ON(item_try_commit(m, id, val));
+}
+
+/* Return the value the item of the given stream is filled with */
+static uint8_t item_val(struct cfg_mux const* m, unsigned id)
+{
+	uint8_t const* item = cfg_mux_get(m, id);
+	unsigned i;
+	BUG_ON(!item);
+	for (i = 1; i < item_sizes[id]; ++i) {
+		BUG_ON(item[i] != item[0]);
+	}
+	return item[0];
+}
+
+/* Check that the item of the given stream resides in the current pool */
+static int item_in_current_pool(struct cfg_mux const* m, unsigned id)
+{
+	struct flash_sec const* s = &sec[m->epoch & 1];
+	return (unsigned)(uintptr_t)cfg_mux_get(m, id) - s->base < s->size;
+}
+
+/* Commit the items of the given stream till the pool switch. Return the last value committed. */
+static uint8_t commit_till_switch(struct cfg_mux* m, unsigned id, uint8_t val)
+{
+	uint8_t const epoch = m->epoch;
+	while (m->epoch == epoch) {
+		item_commit(m, id, ++val);
+	}
+	return val;
+}
+
+/* The items of all streams are copied forward on the pool switch */
+static void test_switch_forward(void)
+{
+	struct cfg_mux m;
+	uint8_t val = 0;
+	unsigned i;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(mux_init(&m, NSTREAMS));
+	for (i = 0; i < NSTREAMS; ++i) {
+		BUG_ON(cfg_mux_get(&m, i));
+	}
+	BUG_ON(cfg_mux_get(&m, NSTREAMS));
+	BUG_ON(!item_try_commit(&m, NSTREAMS, 0));
+	item_commit(&m, 0, 10);
+	item_commit(&m, 1, 20);
+	for (i = 0; i < 4; ++i) {
+		val = commit_till_switch(&m, 2, val);
+		BUG_ON(m.epoch != i + 1);
+		BUG_ON(item_val(&m, 0) != 10 || item_val(&m, 1) != 20 || item_val(&m, 2) != val);
+		BUG_ON(!item_in_current_pool(&m, 0) || !item_in_current_pool(&m, 1));
+		BUG_ON(mux_init(&m, NSTREAMS));
+		BUG_ON(m.epoch != i + 1);
+		BUG_ON(item_val(&m, 0) != 10 || item_val(&m, 1) != 20 || item_val(&m, 2) != val);
+	}
+	BUG_ON(cfg_mux_erase(&m));
+	BUG_ON(mux_init(&m, NSTREAMS));
+	for (i = 0; i < NSTREAMS; ++i) {
+		BUG_ON(cfg_mux_get(&m, i));
+	}
+}
+
+/* Fill the storage so the next commit of the stream 2 switches the pools */
+static uint8_t fill_before_switch(struct cfg_mux* m)
+{
+	uint8_t val = 0;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(mux_init(m, NSTREAMS));
+	item_commit(m, 0, 10);
+	item_commit(m, 1, 20);
+	while (cfg_pool_has_room(&m->pool[0])) {
+		item_commit(m, 2, ++val);
+	}
+	return val;
+}
+
+/* Cut power at every point of the pool switch. The next boot completes the copy forward. */
+static void test_forward_interrupted(void)
+{
+	struct cfg_mux m;
+	unsigned long long start, duration, cut;
+	unsigned cuts = 0, switched = 0;
+	uint8_t val = fill_before_switch(&m);
+	start = flash_emu_get_stats()->model_ns;
+	item_commit(&m, 2, val + 1);
+	duration = flash_emu_get_stats()->model_ns - start;
+	BUG_ON(m.epoch != 1);
+	for (cut = 0; cut < duration; cut += duration / 400 + 1) {
+		fill_before_switch(&m);
+		flash_emu_cut(cut);
+		if (!item_try_commit(&m, 2, val + 1)) {
+			continue;
+		}
+		++cuts;
+		flash_emu_power_up();
+		BUG_ON(mux_init(&m, NSTREAMS));
+		switched += m.epoch == 1;
+		BUG_ON(item_val(&m, 0) != 10 || item_val(&m, 1) != 20);
+		BUG_ON(item_val(&m, 2) != val && item_val(&m, 2) != val + 1);
+		if (m.epoch == 1) {
+			/* The items left in the standby pool are copied forward */
+			BUG_ON(!item_in_current_pool(&m, 0) || !item_in_current_pool(&m, 1) || !item_in_current_pool(&m, 2));
+		}
+		BUG_ON(mux_init(&m, NSTREAMS));
+		BUG_ON(item_val(&m, 0) != 10 || item_val(&m, 1) != 20);
+		item_commit(&m, 2, val + 2);
+		BUG_ON(mux_init(&m, NSTREAMS));
+		BUG_ON(item_val(&m, 0) != 10 || item_val(&m, 1) != 20 || item_val(&m, 2) != val + 2);
+	}
+	BUG_ON(!cuts || !switched || switched == cuts);
+}
+
+/* The tombstones and the records of unknown streams are dropped on the pool switch */
+static void test_tombstone_dropped(void)
+{
+	struct cfg_mux m;
+	uint8_t val = 0;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(mux_init(&m, NSTREAMS));
+	item_commit(&m, 0, 10);
+	item_commit(&m, 1, 20);
+	BUG_ON(cfg_mux_commit(&m, 0, 0));
+	BUG_ON(cfg_mux_get(&m, 0));
+	BUG_ON(mux_init(&m, NSTREAMS));
+	BUG_ON(cfg_mux_get(&m, 0));
+	BUG_ON(m.streams[0].off < 0);
+	/* The tombstone is not copied forward */
+	val = commit_till_switch(&m, 2, val);
+	BUG_ON(m.streams[0].off >= 0);
+	BUG_ON(mux_init(&m, NSTREAMS));
+	BUG_ON(cfg_mux_get(&m, 0) || item_val(&m, 1) != 20 || item_val(&m, 2) != val);
+	/* The old item is not found after the pool holding the tombstone is erased */
+	val = commit_till_switch(&m, 2, val);
+	BUG_ON(mux_init(&m, NSTREAMS));
+	BUG_ON(m.streams[0].off >= 0);
+	BUG_ON(cfg_mux_get(&m, 0) || item_val(&m, 1) != 20 || item_val(&m, 2) != val);
+	/* The stream 2 is unknown to the storage with 2 streams so it is not copied forward. It is lost once
+	 * both pools are switched.
+	 */
+	BUG_ON(mux_init(&m, 2));
+	val = commit_till_switch(&m, 1, 20);
+	commit_till_switch(&m, 1, val);
+	BUG_ON(mux_init(&m, NSTREAMS));
+	BUG_ON(cfg_mux_get(&m, 2));
+	BUG_ON(!item_in_current_pool(&m, 1));
+}
+
+int main(int argc, char* argv[])
+{
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	TEST_RUN(test_switch_forward);
+	TEST_RUN(test_forward_interrupted);
+	TEST_RUN(test_tombstone_dropped);
+	printf("passed\n");
+	return 0;
+}
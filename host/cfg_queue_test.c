@@ -0,0 +1,186 @@
+/*
+ * Tests of the commit request queue on the flash emulator. The producers preempting the consumer are
+ * emulated by setting the request tags between the steps of the posting.
+ *
+ * Usage: cfg_queue_test [seed]
+ */
+
+#include "test.h"
+#include "cfg_queue.h"
+
+#include <string.h>
+
+#define SEC_SZ  2048
+#define NREQS   4
+#define ITEM_SZ 16
+
+static struct flash_sec sec[2];
+static struct cfg_req reqs[NREQS];
+static uint8_t merge_buff[ITEM_SZ];
+
+static void queue_init(struct cfg_queue* q, struct cfg_storage* stor)
+{
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init(stor, ITEM_SZ, sec));
+	cfg_queue_init(q, stor, reqs, NREQS, merge_buff);
+}
+
+/* Post the range filled with the given value */
+static void post(struct cfg_queue* q, unsigned off, unsigned len, uint8_t val)
+{
+	uint8_t data[CFG_QUEUE_DATA_MAX];
+	memset(data, val, len);
+	BUG_ON(cfg_queue_post(q, off, len, data));
+}
+
+/* Return the number of slots in the given state */
+static unsigned slots(unsigned state)
+{
+	unsigned i, cnt = 0;
+	for (i = 0; i < NREQS; ++i) {
+		cnt += (reqs[i].tag & CFG_REQ_STATE) == state;
+	}
+	return cnt;
+}
+
+/* Check the range of the committed item is filled with the given value */
+static void item_check(struct cfg_storage const* stor, unsigned off, unsigned len, uint8_t val)
+{
+	uint8_t const* item = cfg_stor_get(stor);
+	BUG_ON(!item);
+	for (; len; --len, ++off) {
+		BUG_ON(item[off] != val);
+	}
+}
+
+/* The storm of updates of the same range occupies the single slot and results in the single commit */
+static void test_latest_wins(void)
+{
+	struct cfg_storage stor;
+	struct cfg_queue q;
+	unsigned i;
+	queue_init(&q, &stor);
+	for (i = 1; i <= 100; ++i) {
+		post(&q, 4, 8, (uint8_t)i);
+		BUG_ON(slots(CFG_REQ_READY) != 1);
+	}
+	/* Other ranges take other slots */
+	post(&q, 0, 4, 0xaa);
+	BUG_ON(slots(CFG_REQ_READY) != 2);
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(q.commits != 1 || q.applied != 2);
+	BUG_ON(slots(CFG_REQ_FREE) != NREQS);
+	item_check(&stor, 0, 4, 0xaa);
+	item_check(&stor, 4, 8, 100);
+	item_check(&stor, 12, 4, 0);
+	/* Nothing to commit */
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(q.commits != 1);
+	/* The invalid ranges are rejected and there is no room for more requests than slots */
+	BUG_ON(!cfg_queue_post(&q, ITEM_SZ - 1, 2, merge_buff));
+	BUG_ON(!cfg_queue_post(&q, 0, CFG_QUEUE_DATA_MAX + 1, merge_buff));
+	for (i = 0; i < NREQS; ++i) {
+		post(&q, i, 1, (uint8_t)i);
+	}
+	BUG_ON(!cfg_queue_post(&q, 8, 1, merge_buff));
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(q.commits != 2);
+	for (i = 0; i < NREQS; ++i) {
+		item_check(&stor, i, 1, (uint8_t)i);
+	}
+	item_check(&stor, 4, 8, 100);
+}
+
+/* The overlapping ranges are applied in the ticket order regardless of the slot order */
+static void test_ticket_order(void)
+{
+	struct cfg_storage stor;
+	struct cfg_queue q;
+	queue_init(&q, &stor);
+	post(&q, 0, 8, 1);
+	post(&q, 4, 8, 2);
+	/* The repeated update of the first range takes the slot 2 and frees the slot 0 */
+	post(&q, 0, 8, 3);
+	BUG_ON((reqs[0].tag & CFG_REQ_STATE) != CFG_REQ_FREE || (reqs[2].tag & CFG_REQ_STATE) != CFG_REQ_READY);
+	/* The newest request takes the slot 0 */
+	post(&q, 6, 4, 4);
+	BUG_ON((reqs[0].tag & CFG_REQ_STATE) != CFG_REQ_READY);
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(q.commits != 1 || q.applied != 3);
+	item_check(&stor, 0, 6, 3);
+	item_check(&stor, 6, 4, 4);
+	item_check(&stor, 10, 2, 2);
+	item_check(&stor, 12, 4, 0);
+}
+
+/* The merged item is kept on the flash writing error so the next run commits it with the requests posted meanwhile */
+static void test_commit_retry(void)
+{
+	struct cfg_storage stor;
+	struct cfg_queue q;
+	queue_init(&q, &stor);
+	post(&q, 0, 4, 1);
+	BUG_ON(cfg_queue_run(&q));
+	post(&q, 4, 4, 2);
+	flash_emu_cut(0);
+	BUG_ON(!cfg_queue_run(&q));
+	BUG_ON(!cfg_queue_dirty(&q) || q.commits != 1 || slots(CFG_REQ_FREE) != NREQS);
+	flash_emu_power_up();
+	post(&q, 8, 4, 3);
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(cfg_queue_dirty(&q) || q.commits != 2 || q.applied != 3);
+	item_check(&stor, 0, 4, 1);
+	item_check(&stor, 4, 4, 2);
+	item_check(&stor, 8, 4, 3);
+	BUG_ON(cfg_stor_init(&stor, ITEM_SZ, sec));
+	item_check(&stor, 0, 4, 1);
+	item_check(&stor, 4, 4, 2);
+	item_check(&stor, 8, 4, 3);
+}
+
+/* The request claimed without the ticket stops the run. The request being written stops the requests
+ * having the later tickets.
+ */
+static void test_limit(void)
+{
+	struct cfg_storage stor;
+	struct cfg_queue q;
+	struct cfg_req* r = &reqs[1];
+	unsigned ticket;
+	queue_init(&q, &stor);
+	post(&q, 0, 4, 1);
+	/* The producer preempted after claiming the slot */
+	r->tag = CFG_REQ_CLAIMED;
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(q.applied || q.commits);
+	/* The producer has taken the ticket and is writing the request */
+	ticket = q.ticket;
+	q.ticket += CFG_REQ_STATE + 1;
+	r->tag = ticket | CFG_REQ_WRITING;
+	post(&q, 2, 4, 3);
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(q.applied != 1 || q.commits != 1);
+	item_check(&stor, 0, 4, 1);
+	BUG_ON(slots(CFG_REQ_READY) != 1);
+	/* The request is complete */
+	r->off = 0;
+	r->len = 4;
+	memset(r->data, 2, 4);
+	r->tag = ticket | CFG_REQ_READY;
+	BUG_ON(cfg_queue_run(&q));
+	BUG_ON(q.applied != 3 || q.commits != 2);
+	item_check(&stor, 0, 2, 2);
+	item_check(&stor, 2, 4, 3);
+	BUG_ON(slots(CFG_REQ_FREE) != NREQS);
+}
+
+int main(int argc, char* argv[])
+{
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	TEST_RUN(test_latest_wins);
+	TEST_RUN(test_ticket_order);
+	TEST_RUN(test_commit_retry);
+	TEST_RUN(test_limit);
+	printf("passed\n");
+	return 0;
+}
@@ -0,0 +1,542 @@
+/*
+ * Tests of the configuration storage on the flash emulator. The power failures are emulated by the power
+ * cut scheduled at the given modelled device time.
+ *
+ * Usage: cfg_storage_test [seed]
+ */
+
+#include "test.h"
+#include "cfg_storage.h"
+
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#define SEC_SZ 2048
+
+static struct flash_sec sec[2];
+
+struct old_item {
+	unsigned cnt;
+	uint8_t  payload[12];
+};
+
+struct new_item {
+	unsigned cnt;
+	uint8_t  payload[12];
+	unsigned flags; /* added by the new schema */
+};
+
+#define OLD_SCHEMA 1
+#define NEW_SCHEMA 2
+#define NEW_FLAGS  0x5a5a
+
+static unsigned migrate_cnt;
+
+static int migrate(struct cfg_schema const* old_schema, void const* old_item, void* new_item)
+{
+	struct old_item const* o = old_item;
+	struct new_item* n = new_item;
+	++migrate_cnt;
+	if (old_schema->item_sz != sizeof(*o)) {
+		return -1;
+	}
+	n->cnt = o->cnt;
+	memcpy(n->payload, o->payload, sizeof(n->payload));
+	n->flags = NEW_FLAGS;
+	return 0;
+}
+
+static struct cfg_schema const new_schema = {NEW_SCHEMA, sizeof(struct new_item)};
+static struct cfg_schema const old_schemas[] = {
+	{CFG_SCHEMA_NONE, sizeof(struct old_item)},
+	{OLD_SCHEMA, sizeof(struct old_item)}
+};
+static struct new_item mig_buff;
+static struct cfg_migration const mig = {old_schemas, 2, migrate, &mig_buff};
+
+/* Commit n old items to the storage of the given schema */
+static void old_items_commit(uint8_t schema, unsigned n)
+{
+	struct cfg_schema const s = {schema, sizeof(struct old_item)};
+	struct cfg_storage stor;
+	struct old_item o;
+	unsigned i;
+	BUG_ON(cfg_stor_init_schema(&stor, &s, sec, 0));
+	for (i = 1; i <= n; ++i) {
+		memset(&o, i, sizeof(o));
+		o.cnt = i;
+		BUG_ON(cfg_stor_commit(&stor, &o));
+	}
+}
+
+/* Check the item migrated from the old one committed last by old_items_commit */
+static void new_item_check(struct new_item const* n, unsigned cnt)
+{
+	unsigned i;
+	BUG_ON(!n);
+	BUG_ON(n->cnt != cnt);
+	BUG_ON(n->flags != NEW_FLAGS);
+	for (i = 0; i < sizeof(n->payload); ++i) {
+		BUG_ON(n->payload[i] != (uint8_t)cnt);
+	}
+}
+
+/* Migrate the item of the unversioned and of the previous schema storage */
+static void test_migrate(void)
+{
+	static uint8_t const schemas[] = {CFG_SCHEMA_NONE, OLD_SCHEMA};
+	struct cfg_storage stor;
+	unsigned i;
+	for (i = 0; i < sizeof(schemas); ++i) {
+		test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+		/* Fill the pool so the migrated item goes to the other one */
+		old_items_commit(schemas[i], 100);
+		migrate_cnt = 0;
+		BUG_ON(cfg_stor_init_schema(&stor, &new_schema, sec, &mig));
+		BUG_ON(migrate_cnt != 1);
+		new_item_check(cfg_stor_get(&stor), 100);
+		/* The migrated item is found on the next boot */
+		BUG_ON(cfg_stor_init_schema(&stor, &new_schema, sec, &mig));
+		BUG_ON(migrate_cnt != 1);
+		new_item_check(cfg_stor_get(&stor), 100);
+		/* The history has the migrated item only */
+		BUG_ON(cfg_stor_commit(&stor, &mig_buff));
+		BUG_ON(cfg_stor_rollback(&stor, 2) == 0);
+	}
+}
+
+/* Cut power at every point of the migration. The next boot should complete it. */
+static void test_migrate_interrupted(void)
+{
+	struct cfg_storage stor;
+	unsigned long long start, duration, cut;
+	unsigned cuts = 0;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	old_items_commit(OLD_SCHEMA, 10);
+	start = flash_emu_get_stats()->model_ns;
+	BUG_ON(cfg_stor_init_schema(&stor, &new_schema, sec, &mig));
+	duration = flash_emu_get_stats()->model_ns - start;
+	BUG_ON(!duration);
+	for (cut = 0; cut < duration; cut += duration / 400 + 1) {
+		test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+		old_items_commit(OLD_SCHEMA, 10);
+		flash_emu_cut(cut);
+		if (cfg_stor_init_schema(&stor, &new_schema, sec, &mig)) {
+			++cuts;
+		}
+		flash_emu_power_up();
+		BUG_ON(cfg_stor_init_schema(&stor, &new_schema, sec, &mig));
+		new_item_check(cfg_stor_get(&stor), 10);
+	}
+	BUG_ON(!cuts);
+}
+
+/* The items of the unknown schema or of the other size are dropped and the storage remains usable */
+static void test_schema_mismatch(void)
+{
+	struct cfg_schema const other_size = {NEW_SCHEMA, sizeof(struct new_item) + 4};
+	struct cfg_storage stor;
+	struct new_item n;
+	memset(&n, 0x33, sizeof(n));
+	/* Unknown schema without migration */
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	old_items_commit(OLD_SCHEMA, 3);
+	BUG_ON(cfg_stor_init_schema(&stor, &new_schema, sec, 0));
+	BUG_ON(cfg_stor_get(&stor));
+	BUG_ON(cfg_stor_commit(&stor, &n));
+	BUG_ON(cfg_stor_init_schema(&stor, &new_schema, sec, 0));
+	BUG_ON(!cfg_stor_get(&stor) || memcmp(cfg_stor_get(&stor), &n, sizeof(n)));
+	/* The same schema id of the other size */
+	BUG_ON(cfg_stor_init_schema(&stor, &other_size, sec, 0));
+	BUG_ON(cfg_stor_get(&stor));
+	/* The unversioned item of the other size */
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init(&stor, sizeof(n), sec));
+	BUG_ON(cfg_stor_commit(&stor, &n));
+	BUG_ON(cfg_stor_init(&stor, sizeof(n) - 4, sec));
+	BUG_ON(cfg_stor_get(&stor));
+	BUG_ON(cfg_stor_commit(&stor, &n));
+	BUG_ON(cfg_stor_init(&stor, sizeof(n) - 4, sec));
+	BUG_ON(!cfg_stor_get(&stor) || memcmp(cfg_stor_get(&stor), &n, sizeof(n) - 4));
+	/* The migration callback rejects the item so it is dropped */
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init_schema(&stor, &other_size, sec, 0));
+	BUG_ON(cfg_stor_commit(&stor, &n));
+	{
+		struct cfg_schema const s[] = {{NEW_SCHEMA, sizeof(struct new_item) + 4}};
+		struct cfg_migration const m = {s, 1, migrate, &mig_buff};
+		struct cfg_schema const next = {NEW_SCHEMA + 1, sizeof(struct new_item)};
+		migrate_cnt = 0;
+		BUG_ON(cfg_stor_init_schema(&stor, &next, sec, &m));
+		BUG_ON(migrate_cnt != 1);
+		BUG_ON(cfg_stor_get(&stor));
+	}
+}
+
+struct test_item {
+	unsigned cnt;
+	uint8_t  payload[12];
+};
+
+/* Commit the item with the given counter. Return 0 on success, -1 on flash writing error. */
+static int item_try_commit(struct cfg_storage* stor, unsigned cnt)
+{
+	struct test_item t;
+	memset(&t, cnt, sizeof(t));
+	t.cnt = cnt;
+	return cfg_stor_commit(stor, &t);
+}
+
+static void item_commit(struct cfg_storage* stor, unsigned cnt)
+{
+	BUG_ON(item_try_commit(stor, cnt));
+}
+
+static unsigned item_cnt(void const* item)
+{
+	unsigned i;
+	BUG_ON(!item);
+	for (i = 0; i < sizeof(((struct test_item const*)item)->payload); ++i) {
+		BUG_ON(((struct test_item const*)item)->payload[i] != (uint8_t)((struct test_item const*)item)->cnt);
+	}
+	return ((struct test_item const*)item)->cnt;
+}
+
+/* Return the number of records per pool */
+static unsigned pool_recs(struct cfg_storage const* stor)
+{
+	return SEC_SZ / stor->pool[0].rec_sz;
+}
+
+/* The history goes back through both pools skipping the erased items */
+static void test_history(void)
+{
+	struct cfg_storage stor;
+	struct cfg_stor_iter it;
+	unsigned i, n, recs;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	cfg_stor_iter_init(&it, &stor);
+	BUG_ON(cfg_stor_iter_next(&it));
+	recs = pool_recs(&stor);
+	/* The last items are in the second pool */
+	n = recs + recs / 2;
+	for (i = 1; i <= n; ++i) {
+		item_commit(&stor, i);
+	}
+	BUG_ON(stor.epoch != 1);
+	BUG_ON(cfg_stor_commit(&stor, 0));
+	BUG_ON(cfg_stor_get(&stor));
+	item_commit(&stor, n + 1);
+	cfg_stor_iter_init(&it, &stor);
+	BUG_ON(item_cnt(cfg_stor_iter_next(&it)) != n + 1);
+	/* The erased item is skipped */
+	for (i = n; i >= 1; --i) {
+		BUG_ON(item_cnt(cfg_stor_iter_next(&it)) != i);
+	}
+	BUG_ON(cfg_stor_iter_next(&it));
+}
+
+/* Rollback to the items of the current and of the standby pool */
+static void test_rollback(void)
+{
+	struct cfg_storage stor;
+	unsigned i = 0, first, recs, put_cnt;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	recs = pool_recs(&stor);
+	/* The last item is the first one in the second pool */
+	while (stor.epoch == 0) {
+		item_commit(&stor, ++i);
+	}
+	first = i;
+	/* The rollback to the last item does nothing */
+	put_cnt = stor.pool[1].put_cnt;
+	BUG_ON(cfg_stor_rollback(&stor, 0));
+	BUG_ON(stor.pool[1].put_cnt != put_cnt);
+	/* Rollback to the item of the standby pool while there is room */
+	BUG_ON(cfg_stor_rollback(&stor, 2));
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != first - 2);
+	/* The rollback is committed as the new item so it may be rolled back in turn */
+	BUG_ON(cfg_stor_rollback(&stor, 1));
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != first);
+	/* There is no such item */
+	BUG_ON(!cfg_stor_rollback(&stor, 2 * recs));
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != first);
+	/* Fill the current pool so the standby one would be erased on switch */
+	while (cfg_pool_has_room(&stor.pool[1])) {
+		item_commit(&stor, ++i);
+	}
+	/* The current pool has recs items so the next one is in the standby pool */
+	BUG_ON(!cfg_stor_rollback(&stor, recs));
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != i);
+	BUG_ON(stor.epoch != 1);
+	/* The first item of the current pool is still available since it is committed before the current pool is erased */
+	BUG_ON(cfg_stor_rollback(&stor, recs - 1));
+	BUG_ON(stor.epoch != 2);
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != first);
+	/* The rollback remains after the next boot */
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != first);
+}
+
+/* Update the item ranges at the item boundaries including the ones crossing them */
+static void test_update(void)
+{
+	static struct cfg_schema const schema = {OLD_SCHEMA, sizeof(struct test_item)};
+	struct cfg_storage stor;
+	struct test_item t, expect;
+	uint8_t const* item;
+	unsigned i, sz = sizeof(t), n = 0;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init_schema(&stor, &schema, sec, 0));
+	/* There is no item to update */
+	BUG_ON(!cfg_stor_update(&stor, 0, 1, &t));
+	memset(&expect, 0, sz);
+	BUG_ON(cfg_stor_commit(&stor, &expect));
+	/* The whole item, the first and the last byte, the empty range at the end */
+	memset(&t, 0x11, sz);
+	BUG_ON(cfg_stor_update(&stor, 0, sz, &t));
+	memset(&expect, 0x11, sz);
+	BUG_ON(memcmp(cfg_stor_get(&stor), &expect, sz));
+	t.cnt = 0x22222222;
+	BUG_ON(cfg_stor_update(&stor, 0, 1, &t));
+	BUG_ON(cfg_stor_update(&stor, sz - 1, 1, &t));
+	((uint8_t*)&expect)[0] = ((uint8_t*)&expect)[sz - 1] = 0x22;
+	BUG_ON(memcmp(cfg_stor_get(&stor), &expect, sz));
+	BUG_ON(cfg_stor_update(&stor, sz, 0, &t));
+	BUG_ON(memcmp(cfg_stor_get(&stor), &expect, sz));
+	/* The ranges out of the item bounds are rejected and nothing is committed */
+	item = cfg_stor_get(&stor);
+	BUG_ON(!cfg_stor_update(&stor, sz, 1, &t));
+	BUG_ON(!cfg_stor_update(&stor, sz - 1, 2, &t));
+	BUG_ON(!cfg_stor_update(&stor, sz + 1, 0, &t));
+	BUG_ON(!cfg_stor_update(&stor, 1, ~0u, &t));
+	BUG_ON(!cfg_stor_update(&stor, ~0u, 2, &t));
+	BUG_ON(cfg_stor_get(&stor) != item);
+	/* The rest of the item is copied across the pool switches */
+	for (i = 0; stor.epoch < 3; ++i, n = (n + 1) % sz) {
+		uint8_t b = (uint8_t)i;
+		BUG_ON(cfg_stor_update(&stor, n, 1, &b));
+		((uint8_t*)&expect)[n] = b;
+		BUG_ON(memcmp(cfg_stor_get(&stor), &expect, sz));
+	}
+	BUG_ON(cfg_stor_init_schema(&stor, &schema, sec, 0));
+	BUG_ON(memcmp(cfg_stor_get(&stor), &expect, sz));
+}
+
+/* The reader preempting the writer between the flash operations expects the item published last */
+static struct cfg_storage* reader_stor;
+static unsigned reader_cnt, reader_calls;
+
+static void reader_check(void)
+{
+	struct cfg_snap snap;
+	struct test_item t;
+	BUG_ON(item_cnt(cfg_stor_snap(reader_stor, &snap)) != reader_cnt);
+	BUG_ON(snap.gen != reader_stor->gen);
+	BUG_ON(cfg_stor_read(reader_stor, &t) || item_cnt(&t) != reader_cnt);
+	++reader_calls;
+}
+
+static int reader_erase(struct flash_sec const* s)
+{
+	reader_check();
+	if (flash_sec_erase(s)) {
+		return -1;
+	}
+	reader_check();
+	return 0;
+}
+
+static int reader_write(struct flash_sec const* s, unsigned off, void const* data, unsigned sz)
+{
+	reader_check();
+	if (flash_sec_write(s, off, data, sz)) {
+		return -1;
+	}
+	reader_check();
+	return 0;
+}
+
+static int reader_write_bytes(struct flash_sec const* s, unsigned off, void const* data, unsigned sz)
+{
+	reader_check();
+	if (flash_sec_write_bytes(s, off, data, sz)) {
+		return -1;
+	}
+	reader_check();
+	return 0;
+}
+
+/* The snapshot taken at every step of the commits and of the pool switches has the item published last */
+static void test_snap_preempted(void)
+{
+	struct cfg_storage stor;
+	unsigned i, gen;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	item_commit(&stor, reader_cnt = 1);
+	for (i = 0; i < 2; ++i) {
+		sec[i].erase = reader_erase;
+		sec[i].write = reader_write;
+		sec[i].write_bytes = reader_write_bytes;
+	}
+	reader_stor = &stor;
+	reader_calls = 0;
+	while (stor.epoch < 3) {
+		gen = stor.gen;
+		item_commit(&stor, reader_cnt + 1);
+		BUG_ON(stor.gen != gen + 1);
+		++reader_cnt;
+		reader_check();
+	}
+	BUG_ON(reader_calls < 4 * reader_cnt);
+}
+
+/* The writer preempting the reader copying the item. The emulated flash is protected so the first access
+ * to the item traps to the writer. It publishes twice reusing the descriptor the reader has got.
+ */
+static struct cfg_storage* writer_stor;
+static unsigned writer_cnt, writer_gen, writer_calls;
+
+static void writer_trap(int sig)
+{
+	(void)sig;
+	BUG_ON(mprotect((void*)(uintptr_t)flash_emu_sec_base(0), 2 * SEC_SZ, PROT_READ|PROT_WRITE));
+	item_commit(writer_stor, ++writer_cnt);
+	item_commit(writer_stor, ++writer_cnt);
+	BUG_ON(writer_stor->pub[writer_gen & 1].gen == writer_gen);
+	++writer_calls;
+}
+
+static void test_read_preempted(void)
+{
+	struct cfg_storage stor;
+	struct sigaction sa, old_sa;
+	struct test_item t;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32f4);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	/* The next commit switches the pools */
+	writer_cnt = 0;
+	while (cfg_pool_has_room(&stor.pool[0])) {
+		item_commit(&stor, ++writer_cnt);
+	}
+	writer_stor = &stor;
+	writer_gen = stor.gen;
+	writer_calls = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = writer_trap;
+	BUG_ON(sigaction(SIGSEGV, &sa, &old_sa));
+	BUG_ON(mprotect((void*)(uintptr_t)flash_emu_sec_base(0), 2 * SEC_SZ, PROT_NONE));
+	/* The reader retries with the item published last */
+	BUG_ON(cfg_stor_read(&stor, &t));
+	BUG_ON(sigaction(SIGSEGV, &old_sa, 0));
+	BUG_ON(writer_calls != 1 || stor.epoch != 1);
+	BUG_ON(item_cnt(&t) != writer_cnt);
+	BUG_ON(stor.gen != writer_gen + 2);
+}
+
+/* Commit the item cutting power during the marker unit writing. The pool keeps the items committed before. */
+static void test_torn_marker(void)
+{
+	struct cfg_storage stor;
+	unsigned long long start, duration;
+	unsigned i;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32l4);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	for (i = 1; i <= 40; ++i) {
+		item_commit(&stor, i);
+	}
+	BUG_ON(stor.epoch != 0);
+	/* The marker unit is the last one written */
+	start = flash_emu_get_stats()->model_ns;
+	item_commit(&stor, 41);
+	duration = flash_emu_get_stats()->model_ns - start;
+	test_flash_setup(sec, 2, SEC_SZ, &flash_emu_cost_stm32l4);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	for (i = 1; i <= 40; ++i) {
+		item_commit(&stor, i);
+	}
+	flash_emu_cut(duration - 1);
+	BUG_ON(!item_try_commit(&stor, 41));
+	flash_emu_power_up();
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != 40);
+	/* The storage is sealed past the interrupted record and keeps working */
+	BUG_ON(!cfg_pool_sealed(&stor.pool[stor.epoch & 1]));
+	item_commit(&stor, 42);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	BUG_ON(item_cnt(cfg_stor_get(&stor)) != 42);
+}
+
+#define CUT_CYCLES 300
+
+/* Cut power at the random points of the commits and of the storage initialization. The item committed last
+ * or the item being committed survives.
+ */
+static void power_cut_stress(struct flash_emu_cost const* cost)
+{
+	struct cfg_storage stor;
+	unsigned long long start, commit_ns, switch_ns;
+	unsigned cycle, cnt = 1, got, init_cuts = 0;
+	test_flash_setup(sec, 2, SEC_SZ, cost);
+	BUG_ON(cfg_stor_init(&stor, sizeof(struct test_item), sec));
+	start = flash_emu_get_stats()->model_ns;
+	item_commit(&stor, cnt);
+	commit_ns = flash_emu_get_stats()->model_ns - start;
+	/* The cuts are spread over the time of filling the pool including the erase on switch */
+	while (stor.epoch == 0) {
+		item_commit(&stor, ++cnt);
+	}
+	switch_ns = flash_emu_get_stats()->model_ns - start;
+	for (cycle = 0; cycle < CUT_CYCLES; ++cycle) {
+		flash_emu_cut(rand() % switch_ns);
+		while (!item_try_commit(&stor, cnt + 1)) {
+			++cnt;
+		}
+		do {
+			flash_emu_power_up();
+			/* The power may be cut again while sealing the storage */
+			if (rand() % 2) {
+				flash_emu_cut(rand() % (2 * commit_ns));
+			}
+		} while (cfg_stor_init(&stor, sizeof(struct test_item), sec) && ++init_cuts);
+		got = item_cnt(cfg_stor_get(&stor));
+		/* The item being committed may survive */
+		BUG_ON(got != cnt && got != cnt + 1);
+		BUG_ON(!cfg_pool_sealed(&stor.pool[stor.epoch & 1]));
+		cnt = got;
+	}
+	BUG_ON(!init_cuts);
+	BUG_ON(cnt < CUT_CYCLES);
+}
+
+static void test_power_cut_bytes(void)
+{
+	power_cut_stress(&flash_emu_cost_stm32f4);
+}
+
+static void test_power_cut_units(void)
+{
+	power_cut_stress(&flash_emu_cost_stm32l4);
+}
+
+int main(int argc, char* argv[])
+{
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	TEST_RUN(test_migrate);
+	TEST_RUN(test_migrate_interrupted);
+	TEST_RUN(test_schema_mismatch);
+	TEST_RUN(test_history);
+	TEST_RUN(test_rollback);
+	TEST_RUN(test_update);
+	TEST_RUN(test_snap_preempted);
+	TEST_RUN(test_read_preempted);
+	TEST_RUN(test_torn_marker);
+	TEST_RUN(test_power_cut_bytes);
+	TEST_RUN(test_power_cut_units);
+	printf("passed\n");
+	return 0;
+}
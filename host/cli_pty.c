@@ -0,0 +1,180 @@
+/*
+ * USB CDC stand-in running the firmware command line interface (stm32/Src/cli.c) on the pseudo terminal
+ * so the host tools (tests/cdc_bench.py, tests/cfg_image.py) may run without the board. The OUT endpoint
+ * takes up to 64 bytes packets while armed the same way as on the device. The IN transfers are written
+ * to the terminal by 64 bytes packets. Optionally the full speed bus is modelled by limiting the number
+ * of packets per 1 msec frame. The configuration storage is placed on the emulated flash.
+ *
+ * Usage: cli_pty [packets_per_frame]
+ *
+ * Build with gcc -O2 -Icommon -Ihost -Istm32/Inc -o cli_pty host/cli_pty.c stm32/Src/cli.c stm32/Src/cfg_proto.c common/cobs.c common/cfg_pool.c common/cfg_storage.c common/crc16.c host/flash.c host/flash_sec.c
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include "usbd_cdc_if.h"
+#include "cli.h"
+#include "config.h"
+#include "flash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEC_SZ 0x4000
+
+static USBD_CDC_HandleTypeDef cdc;
+static USBD_HandleTypeDef dev = {&cdc};
+USBD_HandleTypeDef* hUsbDevice_0 = &dev;
+
+static struct flash_sec   cfg_sec[2];
+static struct cfg_storage cfg_stor;
+static int                cfg_ready;
+
+static int      pty;
+static int      rx_armed = 1;
+static uint8_t* tx_data;
+static unsigned tx_left;
+
+struct cfg_storage* cfg_storage(void)
+{
+	return cfg_ready ? &cfg_stor : 0;
+}
+
+struct flash_sec const* cfg_sectors(void)
+{
+	return cfg_sec;
+}
+
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
+{
+	if (cdc.TxState) {
+		return USBD_BUSY;
+	}
+	cdc.TxState = 1;
+	tx_data = Buf;
+	tx_left = Len;
+	return USBD_OK;
+}
+
+uint8_t USBD_CDC_ReceivePacket(USBD_HandleTypeDef* pdev)
+{
+	(void)pdev;
+	rx_armed = 1;
+	return USBD_OK;
+}
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Send the next IN packet (ZLP for the zero sized transfer). Return 1 if the packet was sent. */
+static int tx_packet(void)
+{
+	int n = tx_left < USB_FS_MAX_PACKET_SIZE ? tx_left : USB_FS_MAX_PACKET_SIZE;
+	if (!cdc.TxState) {
+		return 0;
+	}
+	if (n && (n = write(pty, tx_data, n)) < 0) {
+		if (errno == EAGAIN) {
+			/* The host does not read so the endpoint NAKs */
+			return 0;
+		}
+		perror("write");
+		exit(1);
+	}
+	tx_data += n;
+	tx_left -= n;
+	if (!tx_left) {
+		/* The transfer of the multiple of packet size is not terminated by ZLP the same way as on the device */
+		cdc.TxState = 0;
+	}
+	return 1;
+}
+
+/* Receive the next OUT packet. Return 1 if the packet was received. */
+static int rx_packet(void)
+{
+	uint8_t buff[USB_FS_MAX_PACKET_SIZE];
+	uint32_t len;
+	int n;
+	if (!rx_armed || (n = read(pty, buff, sizeof(buff))) <= 0) {
+		return 0;
+	}
+	len = n;
+	rx_armed = 0;
+	cli_receive(buff, &len);
+	if (cli_rx_ready()) {
+		rx_armed = 1;
+	}
+	return 1;
+}
+
+static int open_pty(void)
+{
+	struct termios tio;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY), slave;
+	if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+		return -1;
+	}
+	/* Keep the slave open so the master does not fail while there is no client */
+	if ((slave = open(ptsname(fd), O_RDWR | O_NOCTTY)) < 0) {
+		return -1;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	printf("%s\n", ptsname(fd));
+	fflush(stdout);
+	return fd;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned per_frame = argc > 1 ? atoi(argv[1]) : 0, packets = 0;
+	unsigned long long frame = now_us() / 1000;
+	unsigned i;
+	if (flash_emu_init(2, SEC_SZ)) {
+		return 1;
+	}
+	for (i = 0; i < 2; ++i) {
+		flash_sec_init(&cfg_sec[i], i, flash_emu_sec_base(i), SEC_SZ);
+	}
+	cfg_ready = !cfg_stor_init(&cfg_stor, CFG_ITEM_SZ, cfg_sec);
+	if ((pty = open_pty()) < 0) {
+		perror("pty");
+		return 1;
+	}
+	for (;;) {
+		struct pollfd pfd = {pty, 0, 0};
+		int busy = 0;
+		if (per_frame && now_us() / 1000 != frame) {
+			frame = now_us() / 1000;
+			packets = 0;
+		}
+		if (!per_frame || packets < per_frame) {
+			if (rx_packet()) {
+				++packets;
+				busy = 1;
+			}
+			if (tx_packet()) {
+				++packets;
+				busy = 1;
+			}
+		}
+		cli_run();
+		if (!busy) {
+			pfd.events = (rx_armed ? POLLIN : 0) | (cdc.TxState ? POLLOUT : 0);
+			poll(&pfd, 1, 1);
+		}
+	}
+}
@@ -0,0 +1,310 @@
+#include "flash.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* The granule of tracking programmed units */
+#define UNIT_GRANULE 4
+
+static uint8_t*	emu_mem;
+static uint8_t*	emu_programmed; /* programmed flags per granule */
+static unsigned	emu_nsec;
+static unsigned	emu_sec_sz;
+static struct flash_emu_stats emu_stats;
+static unsigned long long emu_now_ns; /* modelled device time */
+static unsigned long long emu_cut_ns; /* scheduled power cut time, 0 if none */
+static int	emu_powered = 1;
+
+/* STM32F4 with 2.7-3.6V supply (x32 parallelism) typical timings */
+struct flash_emu_cost const flash_emu_cost_stm32f4 = {
+	.name = "stm32f4",
+	.word_sz = 4,
+	.byte_ns = 16000,
+	.word_ns = 16000,
+	.erase_ns = 100000000,
+	.erase_ns_per_kb = 7000000
+};
+
+/* MSP430G2xx with flash timing generator clocked at 333KHz (SMCLK/3 at 1MHz) */
+struct flash_emu_cost const flash_emu_cost_msp430 = {
+	.name = "msp430",
+	.word_sz = 2,
+	.byte_ns = 90000,
+	.word_ns = 90000,
+	.erase_ns = 0,
+	.erase_ns_per_kb = 29000000,
+	.block_sz = 64,
+	.block_first_ns = 75000,
+	.block_word_ns = 54000,
+	.block_end_ns = 18000
+};
+
+/* STM32L4 with 64 bit ECC protected program unit and 2KB pages */
+struct flash_emu_cost const flash_emu_cost_stm32l4 = {
+	.name = "stm32l4",
+	.word_sz = 8,
+	.byte_ns = 81690,
+	.word_ns = 81690,
+	.erase_ns = 0,
+	.erase_ns_per_kb = 11010000,
+	.prog_unit = 8
+};
+
+static struct flash_emu_cost const* emu_cost = &flash_emu_cost_stm32f4;
+
+int flash_emu_init(unsigned nsec, unsigned sec_sz)
+{
+	void* mem;
+	flash_emu_free();
+	/* The library addresses flash by unsigned so we need the memory below 4G */
+	mem = mmap(0, (size_t)nsec * sec_sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_32BIT, -1, 0);
+	if (mem == MAP_FAILED) {
+		return -1;
+	}
+	if ((uintptr_t)mem != (unsigned)(uintptr_t)mem) {
+		munmap(mem, (size_t)nsec * sec_sz);
+		return -1;
+	}
+	emu_programmed = calloc((size_t)nsec * sec_sz / UNIT_GRANULE, 1);
+	if (!emu_programmed) {
+		munmap(mem, (size_t)nsec * sec_sz);
+		return -1;
+	}
+	emu_mem = mem;
+	emu_nsec = nsec;
+	emu_sec_sz = sec_sz;
+	memset(emu_mem, 0xff, (size_t)nsec * sec_sz);
+	flash_emu_reset_stats();
+	flash_emu_power_up();
+	return 0;
+}
+
+void flash_emu_free(void)
+{
+	if (emu_mem) {
+		munmap(emu_mem, (size_t)emu_nsec * emu_sec_sz);
+		free(emu_programmed);
+		emu_mem = 0;
+		emu_programmed = 0;
+		emu_nsec = emu_sec_sz = 0;
+	}
+}
+
+void flash_emu_reset_stats(void)
+{
+	memset(&emu_stats, 0, sizeof(emu_stats));
+}
+
+void flash_emu_set_cost(struct flash_emu_cost const* cost)
+{
+	emu_cost = cost;
+}
+
+unsigned flash_emu_prog_unit(void)
+{
+	return emu_cost->prog_unit ? emu_cost->prog_unit : 1;
+}
+
+void flash_emu_cut(unsigned long long after_ns)
+{
+	emu_cut_ns = emu_now_ns + after_ns;
+}
+
+void flash_emu_power_up(void)
+{
+	emu_powered = 1;
+	emu_cut_ns = 0;
+}
+
+/* Account the operation of the given duration. Return 1 if it is interrupted by the power cut. */
+static int flash_emu_op(unsigned long long ns)
+{
+	emu_stats.model_ns += ns;
+	emu_now_ns += ns;
+	if (emu_cut_ns && emu_cut_ns <= emu_now_ns) {
+		emu_powered = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Erase the given range. The erase interrupted by the power cut sets random subset of bits and the units
+ * left not erased can't be programmed. Return 0 on success, -1 if the erase was interrupted.
+ */
+static int flash_emu_erase(unsigned off, unsigned sz)
+{
+	int torn = flash_emu_op(emu_cost->erase_ns + emu_cost->erase_ns_per_kb * sz / 1024);
+	unsigned i;
+	++emu_stats.erase_cnt;
+	if (!torn) {
+		memset(emu_mem + off, 0xff, sz);
+		memset(emu_programmed + off / UNIT_GRANULE, 0, sz / UNIT_GRANULE);
+		return 0;
+	}
+	for (i = 0; i < sz; ++i) {
+		emu_mem[off + i] |= (uint8_t)rand();
+	}
+	for (i = 0; i < sz / UNIT_GRANULE; ++i) {
+		uint32_t v;
+		memcpy(&v, emu_mem + off + i * UNIT_GRANULE, UNIT_GRANULE);
+		emu_programmed[off / UNIT_GRANULE + i] = ~v != 0;
+	}
+	return -1;
+}
+
+unsigned flash_emu_sec_base(int sec_no)
+{
+	return (unsigned)(uintptr_t)emu_mem + sec_no * emu_sec_sz;
+}
+
+unsigned flash_emu_sec_size(void)
+{
+	return emu_sec_sz;
+}
+
+unsigned flash_emu_sec_cnt(void)
+{
+	return emu_nsec;
+}
+
+struct flash_emu_stats const* flash_emu_get_stats(void)
+{
+	return &emu_stats;
+}
+
+/* Check that the address range lays within emulated flash */
+static int flash_emu_range_valid(unsigned addr, unsigned sz)
+{
+	unsigned base = flash_emu_sec_base(0);
+	return emu_mem && addr >= base && addr - base <= emu_nsec * emu_sec_sz && sz <= emu_nsec * emu_sec_sz - (addr - base);
+}
+
+int flash_erase_sec(int sec_no)
+{
+	if (!emu_mem || !emu_powered || sec_no < 0 || (unsigned)sec_no >= emu_nsec) {
+		return -1;
+	}
+	return flash_emu_erase(sec_no * emu_sec_sz, emu_sec_sz);
+}
+
+/* Check that the data written cover whole program units never programmed since erase and mark them programmed */
+static int flash_emu_units_program(unsigned addr, unsigned sz)
+{
+	unsigned unit = emu_cost->prog_unit, off = addr - flash_emu_sec_base(0), i;
+	if (off % unit || sz % unit) {
+		return -1;
+	}
+	for (i = 0; i < sz / UNIT_GRANULE; ++i) {
+		if (emu_programmed[off / UNIT_GRANULE + i]) {
+			return -1;
+		}
+	}
+	memset(emu_programmed + off / UNIT_GRANULE, 1, sz / UNIT_GRANULE);
+	return 0;
+}
+
+/* Erase the part of the sector. The cost is accounted as the erase of the sector of the given size. */
+int flash_erase_range(unsigned addr, unsigned sz)
+{
+	unsigned off = addr - flash_emu_sec_base(0);
+	if (!flash_emu_range_valid(addr, sz) || !emu_powered || off % UNIT_GRANULE || sz % UNIT_GRANULE) {
+		return -1;
+	}
+	return flash_emu_erase(off, sz);
+}
+
+/* Return the time of programming of nwords aligned words starting at the given address */
+static unsigned long long flash_emu_words_ns(unsigned addr, unsigned nwords)
+{
+	unsigned long long ns = 0;
+	if (!emu_cost->block_sz) {
+		return (unsigned long long)nwords * emu_cost->word_ns;
+	}
+	while (nwords) {
+		unsigned n = (emu_cost->block_sz - addr % emu_cost->block_sz) / emu_cost->word_sz;
+		unsigned long long word_ns, block_ns;
+		if (n > nwords) {
+			n = nwords;
+		}
+		word_ns = (unsigned long long)n * emu_cost->word_ns;
+		block_ns = emu_cost->block_first_ns + (unsigned long long)(n - 1) * emu_cost->block_word_ns + emu_cost->block_end_ns;
+		ns += block_ns < word_ns ? block_ns : word_ns;
+		addr += n * emu_cost->word_sz;
+		nwords -= n;
+	}
+	return ns;
+}
+
+/* Return the offset of the given programming operation. The head bytes are followed by nwords words and the tail bytes. */
+static unsigned flash_emu_op_offset(unsigned op, unsigned head, unsigned nwords)
+{
+	if (op <= head) {
+		return op;
+	}
+	if (op - head <= nwords) {
+		return head + (op - head) * emu_cost->word_sz;
+	}
+	return op + nwords * (emu_cost->word_sz - 1);
+}
+
+/* Program data. The unaligned head and tail are programmed by bytes, the rest by words if words is set.
+ * If the cost model has program unit the data are programmed by units.
+ */
+static int flash_program(unsigned addr, void const* data, unsigned sz, int words)
+{
+	uint8_t* ptr = (uint8_t*)(uintptr_t)addr;
+	uint8_t const* src = data;
+	unsigned head = 0, nwords = 0, nops, cut_op, done, end, i;
+	unsigned long long start, ns;
+	if (!flash_emu_range_valid(addr, sz) || !emu_powered) {
+		return -1;
+	}
+	if (emu_cost->prog_unit) {
+		if (flash_emu_units_program(addr, sz)) {
+			++emu_stats.unit_errors;
+			return -1;
+		}
+		words = 1;
+	}
+	if (words) {
+		head = (emu_cost->word_sz - addr % emu_cost->word_sz) % emu_cost->word_sz;
+		if (head > sz) {
+			head = sz;
+		}
+		nwords = (sz - head) / emu_cost->word_sz;
+	}
+	nops = sz - nwords * (emu_cost->word_sz - 1);
+	++emu_stats.write_cnt;
+	emu_stats.write_bytes += sz;
+	emu_stats.prog_ops += nops;
+	start = emu_now_ns;
+	ns = (unsigned long long)(sz - nwords * emu_cost->word_sz) * emu_cost->byte_ns + flash_emu_words_ns(addr + head, nwords);
+	if (!flash_emu_op(ns)) {
+		for (; sz; --sz, ++ptr, ++src) {
+			*ptr &= *src;
+		}
+		return 0;
+	}
+	/* The bytes / words are programmed one by one. The ones completed before the power cut are programmed,
+	 * the one in progress clears random subset of bits, the rest are left intact.
+	 */
+	cut_op = emu_cut_ns > start ? (unsigned)((emu_cut_ns - start) * nops / ns) : 0;
+	done = flash_emu_op_offset(cut_op, head, nwords);
+	end = flash_emu_op_offset(cut_op + 1, head, nwords);
+	for (i = 0; i < end && i < sz; ++i) {
+		ptr[i] &= i < done ? src[i] : src[i] | (uint8_t)rand();
+	}
+	return -1;
+}
+
+int flash_write(unsigned addr, void const* data, unsigned sz)
+{
+	return flash_program(addr, data, sz, 1);
+}
+
+int flash_write_bytes(unsigned addr, void const* data, unsigned sz)
+{
+	return flash_program(addr, data, sz, 0);
+}
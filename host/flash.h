@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * Flash emulator for the host platform. It emulates the set of equally sized NOR flash sectors
+ * placed in the low 4G of the address space so the sector base address fits the unsigned type.
+ * The erase sets all bits to 1, the write may only clear bits. If the cost model has program unit
+ * the write must cover whole units and every unit may be programmed only once between erases
+ * the same way as the flash with ECC does.
+ *
+ * The power cut may be scheduled at the given modelled device time. The erase interrupted by the power cut changes
+ * random subset of bits. The write programs bytes / words one by one so the ones completed before the cut are programmed
+ * and the one in progress is programmed partially. All operations fail till the flash is powered up.
+ */
+
+struct flash_emu_stats {
+	unsigned long erase_cnt;
+	unsigned long write_cnt;
+	unsigned long write_bytes;
+	unsigned long prog_ops;     /* the number of byte / word programming operations */
+	unsigned long unit_errors;  /* the number of writes rejected since they break program unit rules */
+	unsigned long long model_ns; /* modelled device time spent in erase and programming */
+};
+
+/* Device cost model. The flash_write programs unaligned head and tail by bytes and the rest by words
+ * the same way as the target drivers do. The flash_write_bytes programs everything by bytes.
+ */
+struct flash_emu_cost {
+	char const* name;
+	unsigned word_sz;   /* programming word size */
+	unsigned byte_ns;   /* byte programming time */
+	unsigned word_ns;   /* word programming time */
+	unsigned long erase_ns;        /* sector erase time */
+	unsigned long erase_ns_per_kb; /* sector erase time per every KB of the sector size */
+	unsigned prog_unit; /* program unit size, 0 if the flash may be programmed by bytes */
+	/* Block write mode. The run of words within the block is programmed in block mode if it is faster. */
+	unsigned block_sz;       /* block size, 0 if there is no block mode */
+	unsigned block_first_ns; /* the first word programming time */
+	unsigned block_word_ns;  /* every next word programming time */
+	unsigned block_end_ns;   /* block end sequence time */
+};
+
+/* Cost models of the supported platforms */
+extern struct flash_emu_cost const flash_emu_cost_stm32f4;
+extern struct flash_emu_cost const flash_emu_cost_msp430;
+extern struct flash_emu_cost const flash_emu_cost_stm32l4;
+
+/* Create emulated flash with nsec sectors of sec_sz bytes. The content is initially erased.
+ * Return 0 on success, -1 on memory allocation failure.
+ */
+int flash_emu_init(unsigned nsec, unsigned sec_sz);
+
+/* Release emulated flash */
+void flash_emu_free(void);
+
+/* Return sector base address */
+unsigned flash_emu_sec_base(int sec_no);
+
+/* Return sector size */
+unsigned flash_emu_sec_size(void);
+
+/* Return the number of sectors */
+unsigned flash_emu_sec_cnt(void);
+
+/* Return operation statistics */
+struct flash_emu_stats const* flash_emu_get_stats(void);
+
+/* Reset operation statistics */
+void flash_emu_reset_stats(void);
+
+/* Set device cost model. The STM32F4 model is used by default. */
+void flash_emu_set_cost(struct flash_emu_cost const* cost);
+
+/* Return the program unit size of the current cost model suitable for flash_sec */
+unsigned flash_emu_prog_unit(void);
+
+/* Schedule power cut after the given modelled device time since now */
+void flash_emu_cut(unsigned long long after_ns);
+
+/* Power up the flash after the power cut */
+void flash_emu_power_up(void);
+
+int flash_erase_sec(int sec_no);
+int flash_erase_range(unsigned addr, unsigned sz);
+int flash_write(unsigned addr, void const* data, unsigned sz);
+int flash_write_bytes(unsigned addr, void const* data, unsigned sz);
@@ -0,0 +1,184 @@
+/*
+ * Flash trace replay tool. It runs the recorded flash operations against the flash emulator
+ * and reports the write pattern statistics. The records without data are replayed with
+ * zero filled payload so they reproduce the wear and programming volume but not the content.
+ *
+ * Usage: flash_replay trace_file [sector_size [image_file]]
+ *
+ * The sector size defaults to the one recorded in the trace erase operations. The optional
+ * image file receives the final content of the emulated flash.
+ */
+
+#include "flash_trace.h"
+#include "flash.h"
+#include "crc16.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SECTORS 256
+
+struct replay_stats {
+	unsigned long ops[FLASH_TRACE_OP_MASK + 1];
+	unsigned long failed;
+	unsigned long replay_failed;
+	unsigned long hash_errors;
+	unsigned long overprogrammed;
+	unsigned long erases[MAX_SECTORS];
+	unsigned long written[MAX_SECTORS];
+};
+
+static struct replay_stats stats;
+
+static uint8_t* read_file(char const* path, unsigned* sz)
+{
+	FILE* f = fopen(path, "rb");
+	uint8_t* buff = 0;
+	long len;
+	if (!f) {
+		return 0;
+	}
+	if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) >= 0 && !fseek(f, 0, SEEK_SET)) {
+		buff = malloc(len ? len : 1);
+		if (buff && fread(buff, 1, len, f) != (size_t)len) {
+			free(buff);
+			buff = 0;
+		}
+		*sz = len;
+	}
+	fclose(f);
+	return buff;
+}
+
+static int write_file(char const* path, void const* data, unsigned sz)
+{
+	FILE* f = fopen(path, "wb");
+	int res;
+	if (!f) {
+		return -1;
+	}
+	res = fwrite(data, 1, sz, f) == sz ? 0 : -1;
+	fclose(f);
+	return res;
+}
+
+/* Count bytes which can't be programmed to the given value without erase */
+static unsigned overprogrammed(uint8_t const* flash, uint8_t const* data, unsigned sz)
+{
+	unsigned i, cnt = 0;
+	for (i = 0; i < sz; ++i) {
+		if ((flash[i] & data[i]) != data[i]) {
+			++cnt;
+		}
+	}
+	return cnt;
+}
+
+static int replay_rec(struct flash_trace_rec const* r, unsigned sec_sz)
+{
+	unsigned addr;
+	uint8_t const* data = r->data;
+	uint8_t* zeros = 0;
+	int res;
+
+	if ((r->op & FLASH_TRACE_OP_MASK) == FLASH_TRACE_ERASE) {
+		++stats.erases[r->no];
+		return flash_erase_sec(r->no);
+	}
+	if (r->off > sec_sz || r->sz > sec_sz - r->off) {
+		return -1;
+	}
+	if ((r->op & FLASH_TRACE_OP_MASK) == FLASH_TRACE_ERASE_SEG) {
+		return flash_erase_range(flash_emu_sec_base(r->no) + r->off, r->sz);
+	}
+	if (data && crc16(data, r->sz) != r->hash) {
+		++stats.hash_errors;
+	}
+	if (!data && !(data = zeros = calloc(1, r->sz ? r->sz : 1))) {
+		return -1;
+	}
+	addr = flash_emu_sec_base(r->no) + r->off;
+	stats.overprogrammed += overprogrammed((uint8_t const*)(uintptr_t)addr, data, r->sz);
+	stats.written[r->no] += r->sz;
+	res = (r->op & FLASH_TRACE_OP_MASK) == FLASH_TRACE_WRITE ?
+		flash_write(addr, data, r->sz) : flash_write_bytes(addr, data, r->sz);
+	free(zeros);
+	return res;
+}
+
+int main(int argc, char* argv[])
+{
+	struct flash_trace_rec r;
+	unsigned sz, off, n, sec_sz = 0, nsec = 0, i;
+	uint32_t ts_first = 0, ts_last = 0;
+	uint8_t* trace;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s trace_file [sector_size [image_file]]\n", argv[0]);
+		return 1;
+	}
+	if (!(trace = read_file(argv[1], &sz))) {
+		fprintf(stderr, "failed to read %s\n", argv[1]);
+		return 1;
+	}
+	if (argc > 2) {
+		sec_sz = strtoul(argv[2], 0, 0);
+	}
+	/* Find out the flash geometry */
+	for (off = 0; (n = flash_trace_decode(trace + off, sz - off, &r)); off += n) {
+		if (r.no >= nsec) {
+			nsec = r.no + 1;
+		}
+		if (argc <= 2 && (r.op & FLASH_TRACE_OP_MASK) == FLASH_TRACE_ERASE && r.sz > sec_sz) {
+			sec_sz = r.sz;
+		}
+	}
+	if (off != sz) {
+		fprintf(stderr, "trace truncated at offset %u\n", off);
+	}
+	if (!nsec || !sec_sz || nsec > MAX_SECTORS) {
+		fprintf(stderr, "invalid flash geometry: %u sectors of %u bytes\n", nsec, sec_sz);
+		return 1;
+	}
+	if (flash_emu_init(nsec, sec_sz)) {
+		fprintf(stderr, "failed to create flash emulator\n");
+		return 1;
+	}
+	for (off = 0; (n = flash_trace_decode(trace + off, sz - off, &r)); off += n) {
+		if (!off) {
+			ts_first = r.ts;
+		}
+		ts_last = r.ts;
+		++stats.ops[r.op & FLASH_TRACE_OP_MASK];
+		if (r.op & FLASH_TRACE_FAILED) {
+			++stats.failed;
+		}
+		if (replay_rec(&r, sec_sz)) {
+			++stats.replay_failed;
+		}
+	}
+
+	printf("sectors          %u x %u bytes\n", nsec, sec_sz);
+	printf("erase            %lu\n", stats.ops[FLASH_TRACE_ERASE]);
+	printf("erase segment    %lu\n", stats.ops[FLASH_TRACE_ERASE_SEG]);
+	printf("write            %lu\n", stats.ops[FLASH_TRACE_WRITE]);
+	printf("write_bytes      %lu\n", stats.ops[FLASH_TRACE_WRITE_BYTES]);
+	printf("failed on target %lu\n", stats.failed);
+	printf("failed on replay %lu\n", stats.replay_failed);
+	printf("hash errors      %lu\n", stats.hash_errors);
+	printf("overprogrammed   %lu bytes\n", stats.overprogrammed);
+	printf("time span        %lu\n", (unsigned long)(uint32_t)(ts_last - ts_first));
+	for (i = 0; i < nsec; ++i) {
+		if (stats.erases[i] || stats.written[i]) {
+			printf("sector %-3u       %lu erases, %lu bytes written\n", i, stats.erases[i], stats.written[i]);
+		}
+	}
+	if (argc > 3 && write_file(argv[3], (void const*)(uintptr_t)flash_emu_sec_base(0), nsec * sec_sz)) {
+		fprintf(stderr, "failed to write %s\n", argv[3]);
+		return 1;
+	}
+	free(trace);
+	flash_emu_free();
+	return 0;
+}
@@ -0,0 +1,25 @@
+#include "flash_sec.h"
+#include "flash.h"
+
+/* The emulated operations complete instantly so the hook is never called */
+void (*flash_progress_hook)(void);
+
+int flash_sec_erase(struct flash_sec const* sec)
+{
+	return flash_erase_sec(sec->no);
+}
+
+int flash_sec_write(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	return flash_write(sec->base + off, data, sz);
+}
+
+int flash_sec_write_bytes(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
+{
+	return flash_write_bytes(sec->base + off, data, sz);
+}
+
+int flash_sec_erase_seg(struct flash_sec const* sec, unsigned off)
+{
+	return flash_erase_range(sec->base + off, sec->seg_sz);
+}
@@ -0,0 +1,40 @@
+#include "flash_trace_file.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static void flash_trace_file_sink(struct flash_trace* t, void const* rec, unsigned sz)
+{
+	if (fwrite(rec, 1, sz, (FILE*)t->sink_ctx) != sz) {
+		++t->lost;
+	}
+}
+
+int flash_trace_file_open(struct flash_trace* t, char const* path, uint32_t (*clock)(void))
+{
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		return -1;
+	}
+	flash_trace_init(t, 0, 0, clock);
+	t->with_data = 1;
+	t->sink = flash_trace_file_sink;
+	t->sink_ctx = f;
+	return 0;
+}
+
+void flash_trace_file_close(struct flash_trace* t)
+{
+	if (t->sink_ctx) {
+		fclose((FILE*)t->sink_ctx);
+		t->sink_ctx = 0;
+		t->sink = 0;
+	}
+}
+
+uint32_t flash_trace_clock_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "flash_trace.h"
+
+/*
+ * Flash trace recording to the file on the host
+ */
+
+/* Initialize trace writing records to the file. Return 0 on success, -1 if the file can't be created. */
+int flash_trace_file_open(struct flash_trace* t, char const* path, uint32_t (*clock)(void));
+
+/* Close trace file */
+void flash_trace_file_close(struct flash_trace* t);
+
+/* Microsecond clock suitable for trace timestamps */
+uint32_t flash_trace_clock_us(void);
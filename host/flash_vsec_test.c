@@ -0,0 +1,378 @@
+/*
+ * Tests of the configuration storage on the virtual sectors on the flash emulator. The power failures are
+ * emulated by the power cut scheduled at the given modelled device time.
+ *
+ * Usage: flash_vsec_test [seed]
+ */
+
+#include "test.h"
+#include "flash_vsec.h"
+#include "cfg_storage.h"
+
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#define PHYS_SZ 0x4000
+#define SLOT_SZ 2048
+#define NVSECS  2
+
+/* The area shared by several storages */
+#define SHARED_SLOT_SZ 1024
+#define NSTORS         3
+
+static struct flash_sec phys[2];
+static struct flash_sec vsecs[NVSECS];
+static struct flash_sec shared_vsecs[2 * NSTORS];
+static struct flash_varea area;
+
+struct test_item {
+	unsigned cnt;
+	uint8_t  payload[12];
+};
+
+/* Mount the area and the storage on its virtual sectors. Return 0 on success, -1 on flash writing error. */
+static int try_mount(struct cfg_storage* stor)
+{
+	if (flash_varea_init(&area, &phys[0], &phys[1], SLOT_SZ, vsecs, NVSECS)) {
+		return -1;
+	}
+	return cfg_stor_init(stor, sizeof(struct test_item), vsecs);
+}
+
+static void mount(struct cfg_storage* stor)
+{
+	BUG_ON(try_mount(stor));
+}
+
+/* Commit the item with the given counter. Return 0 on success, -1 on flash writing error. */
+static int item_try_commit(struct cfg_storage* stor, unsigned cnt)
+{
+	struct test_item t;
+	memset(&t, cnt, sizeof(t));
+	t.cnt = cnt;
+	return cfg_stor_commit(stor, &t);
+}
+
+static void item_commit(struct cfg_storage* stor, unsigned cnt)
+{
+	BUG_ON(item_try_commit(stor, cnt));
+}
+
+static unsigned item_cnt(struct cfg_storage const* stor)
+{
+	struct test_item const* t = cfg_stor_get(stor);
+	unsigned i;
+	BUG_ON(!t);
+	for (i = 0; i < sizeof(t->payload); ++i) {
+		BUG_ON(t->payload[i] != (uint8_t)t->cnt);
+	}
+	return t->cnt;
+}
+
+/* Check that every virtual sector resides in the active physical sector */
+static int vsecs_in_active(void)
+{
+	struct flash_sec const* f = &phys[area.active];
+	unsigned i;
+	for (i = 0; i < NVSECS; ++i) {
+		if (vsecs[i].base - f->base >= f->size) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Commit till the other physical sector needs maintenance. Return the last counter committed. */
+static unsigned commit_till_dirty(struct cfg_storage* stor, unsigned cnt)
+{
+	while (!flash_varea_dirty(&area)) {
+		item_commit(stor, ++cnt);
+	}
+	return cnt;
+}
+
+/* The storage erases switch the slots and the physical sectors. Without maintenance the erase fails once
+ * the rest of the active sector is left for copying. The storage keeps the item committed last then.
+ */
+static void test_slot_switch(void)
+{
+	struct cfg_storage stor;
+	unsigned i, switches = 0, refused = 0;
+	uint8_t active;
+	test_flash_setup(phys, 2, PHYS_SZ, &flash_emu_cost_stm32f4);
+	mount(&stor);
+	BUG_ON(cfg_stor_get(&stor) || flash_varea_dirty(&area) || !vsecs_in_active());
+	active = area.active;
+	for (i = 1; i <= 3000; ++i) {
+		if (item_try_commit(&stor, i)) {
+			BUG_ON(!flash_varea_dirty(&area));
+			BUG_ON(item_cnt(&stor) != i - 1);
+			/* The erase is refused again till the maintenance */
+			BUG_ON(!item_try_commit(&stor, i));
+			BUG_ON(flash_varea_maintain(&area));
+			item_commit(&stor, i);
+			++refused;
+		}
+		if (area.active != active) {
+			active = area.active;
+			++switches;
+		}
+		if (!(i % 97)) {
+			mount(&stor);
+			BUG_ON(item_cnt(&stor) != i);
+		}
+	}
+	BUG_ON(switches < 4 || refused < switches - 1);
+	BUG_ON(flash_emu_get_stats()->erase_cnt < switches - 1);
+	mount(&stor);
+	BUG_ON(item_cnt(&stor) != i - 1);
+}
+
+/* The maintenance copies the virtual sectors to the active physical sector and erases the other one */
+static void test_maintain(void)
+{
+	struct cfg_storage stor;
+	unsigned cnt = 0, i, erase_cnt;
+	test_flash_setup(phys, 2, PHYS_SZ, &flash_emu_cost_stm32f4);
+	mount(&stor);
+	/* Nothing to do */
+	BUG_ON(flash_varea_maintain(&area));
+	BUG_ON(area.erase_cnt);
+	for (i = 0; i < 4; ++i) {
+		cnt = commit_till_dirty(&stor, cnt);
+		erase_cnt = area.erase_cnt;
+		BUG_ON(flash_varea_maintain(&area));
+		BUG_ON(flash_varea_dirty(&area) || area.erase_cnt != erase_cnt + 1);
+		BUG_ON(!vsecs_in_active());
+		BUG_ON(item_cnt(&stor) != cnt);
+		mount(&stor);
+		BUG_ON(flash_varea_dirty(&area) || !vsecs_in_active());
+		BUG_ON(item_cnt(&stor) != cnt);
+		item_commit(&stor, ++cnt);
+	}
+	/* The virtual sector erases following the maintenance never erase physically */
+	erase_cnt = area.erase_cnt;
+	while (!flash_varea_dirty(&area)) {
+		item_commit(&stor, ++cnt);
+	}
+	BUG_ON(area.erase_cnt != erase_cnt);
+}
+
+/* Run the maintenance with the power cut at the given time. Check the storage after the reboot. */
+static void maintain_cut(unsigned long long cut, unsigned* cuts)
+{
+	struct cfg_storage stor;
+	unsigned cnt;
+	test_flash_setup(phys, 2, PHYS_SZ, &flash_emu_cost_stm32f4);
+	mount(&stor);
+	cnt = commit_till_dirty(&stor, 0);
+	flash_emu_cut(cut);
+	if (!flash_varea_maintain(&area)) {
+		return;
+	}
+	++*cuts;
+	flash_emu_power_up();
+	mount(&stor);
+	BUG_ON(item_cnt(&stor) != cnt);
+	/* The maintenance interrupted is repeated */
+	if (flash_varea_dirty(&area)) {
+		BUG_ON(flash_varea_maintain(&area));
+	}
+	BUG_ON(flash_varea_dirty(&area) || !vsecs_in_active());
+	BUG_ON(item_cnt(&stor) != cnt);
+	item_commit(&stor, cnt + 1);
+	mount(&stor);
+	BUG_ON(flash_varea_dirty(&area));
+	BUG_ON(item_cnt(&stor) != cnt + 1);
+}
+
+/* Cut power at every point of the copy and at several points of the physical erase */
+static void test_maintain_interrupted(void)
+{
+	struct cfg_storage stor;
+	struct flash_emu_cost const* c = &flash_emu_cost_stm32f4;
+	unsigned long long start, duration, erase_ns = c->erase_ns + c->erase_ns_per_kb * PHYS_SZ / 1024, copy_ns, cut;
+	unsigned cuts = 0;
+	test_flash_setup(phys, 2, PHYS_SZ, c);
+	mount(&stor);
+	commit_till_dirty(&stor, 0);
+	start = flash_emu_get_stats()->model_ns;
+	BUG_ON(flash_varea_maintain(&area));
+	duration = flash_emu_get_stats()->model_ns - start;
+	BUG_ON(duration <= erase_ns);
+	copy_ns = duration - erase_ns;
+	for (cut = 0; cut < copy_ns; cut += copy_ns / 200 + 1) {
+		maintain_cut(cut, &cuts);
+	}
+	for (; cut < duration; cut += erase_ns / 8) {
+		maintain_cut(cut, &cuts);
+	}
+	BUG_ON(cuts < 200);
+}
+
+#define CUT_CYCLES 200
+
+/* Cut power at the random points of the commits and of the maintenance called every few commits */
+static void test_power_cut(void)
+{
+	struct cfg_storage stor;
+	unsigned long long start, window;
+	unsigned cycle, cnt = 0, got;
+	test_flash_setup(phys, 2, PHYS_SZ, &flash_emu_cost_stm32f4);
+	mount(&stor);
+	start = flash_emu_get_stats()->model_ns;
+	cnt = commit_till_dirty(&stor, cnt);
+	BUG_ON(flash_varea_maintain(&area));
+	window = flash_emu_get_stats()->model_ns - start;
+	for (cycle = 0; cycle < CUT_CYCLES; ++cycle) {
+		flash_emu_cut(rand() % window);
+		while (!item_try_commit(&stor, cnt + 1)) {
+			++cnt;
+			if (!(rand() % 8) && flash_varea_dirty(&area) && flash_varea_maintain(&area)) {
+				break;
+			}
+		}
+		flash_emu_power_up();
+		mount(&stor);
+		got = item_cnt(&stor);
+		/* The item being committed may survive */
+		BUG_ON(got != cnt && got != cnt + 1);
+		cnt = got;
+	}
+	BUG_ON(cnt < CUT_CYCLES);
+}
+
+/* Mount the storages sharing the area */
+static void shared_mount(struct cfg_storage* stors)
+{
+	unsigned i;
+	BUG_ON(flash_varea_init(&area, &phys[0], &phys[1], SHARED_SLOT_SZ, shared_vsecs, 2 * NSTORS));
+	for (i = 0; i < NSTORS; ++i) {
+		BUG_ON(cfg_stor_init(&stors[i], sizeof(struct test_item), &shared_vsecs[2 * i]));
+	}
+}
+
+/* Return the counter of the item copied by the lock-free read */
+static unsigned item_read_cnt(struct cfg_storage const* stor)
+{
+	struct test_item t;
+	unsigned i;
+	BUG_ON(cfg_stor_read(stor, &t));
+	for (i = 0; i < sizeof(t.payload); ++i) {
+		BUG_ON(t.payload[i] != (uint8_t)t.cnt);
+	}
+	return t.cnt;
+}
+
+static void shared_check(struct cfg_storage const* stors, unsigned const* cnt)
+{
+	unsigned i;
+	for (i = 0; i < NSTORS; ++i) {
+		BUG_ON(item_cnt(&stors[i]) != cnt[i]);
+		BUG_ON(item_read_cnt(&stors[i]) != cnt[i]);
+	}
+}
+
+/* The storages sharing the area are committed at random. The commit never moves the sectors of other
+ * storages. They are moved by the maintenance only.
+ */
+static void test_shared_area(void)
+{
+	struct cfg_storage stors[NSTORS];
+	unsigned cnt[NSTORS], bases[2 * NSTORS];
+	unsigned op, i, j, moves, refused = 0, maintained = 0, moved = 0;
+	test_flash_setup(phys, 2, PHYS_SZ, &flash_emu_cost_stm32f4);
+	shared_mount(stors);
+	for (i = 0; i < NSTORS; ++i) {
+		item_commit(&stors[i], cnt[i] = 1);
+	}
+	for (op = 0; op < 20000; ++op) {
+		i = rand() % NSTORS;
+		moves = area.moves;
+		for (j = 0; j < 2 * NSTORS; ++j) {
+			bases[j] = shared_vsecs[j].base;
+		}
+		if (item_try_commit(&stors[i], cnt[i] + 1)) {
+			/* The erase is refused while the rest of the active sector is left for the maintenance */
+			BUG_ON(!flash_varea_dirty(&area));
+			shared_check(stors, cnt);
+			BUG_ON(flash_varea_maintain(&area));
+			moved += area.moves - moves;
+			item_commit(&stors[i], cnt[i] + 1);
+			++refused;
+		} else {
+			BUG_ON(area.moves != moves);
+			for (j = 0; j < 2 * NSTORS; ++j) {
+				BUG_ON(j / 2 != i && shared_vsecs[j].base != bases[j]);
+			}
+		}
+		++cnt[i];
+		shared_check(stors, cnt);
+		if (flash_varea_dirty(&area) && !(rand() % 256)) {
+			moves = area.moves;
+			BUG_ON(flash_varea_maintain(&area));
+			moved += area.moves - moves;
+			shared_check(stors, cnt);
+			++maintained;
+		}
+		if (!(rand() % 1000)) {
+			shared_mount(stors);
+			shared_check(stors, cnt);
+		}
+	}
+	/* The area counts the moves since mount */
+	BUG_ON(!refused || !maintained || !moved);
+}
+
+/* The maintenance preempting the reader copying the item. The emulated flash is protected so the first access
+ * to the item traps to the maintenance. It moves the sector holding the item and erases the old copy.
+ */
+static unsigned maintain_calls;
+
+static void maintain_trap(int sig)
+{
+	(void)sig;
+	BUG_ON(mprotect((void*)(uintptr_t)flash_emu_sec_base(0), 2 * PHYS_SZ, PROT_READ|PROT_WRITE));
+	BUG_ON(flash_varea_maintain(&area));
+	++maintain_calls;
+}
+
+static void test_read_moved(void)
+{
+	struct cfg_storage stors[NSTORS];
+	struct sigaction sa, old_sa;
+	unsigned cnt = 0, base, moves;
+	test_flash_setup(phys, 2, PHYS_SZ, &flash_emu_cost_stm32f4);
+	shared_mount(stors);
+	item_commit(&stors[0], 1);
+	/* The sectors of the storage 0 are left in the other physical sector */
+	while (!flash_varea_dirty(&area)) {
+		++cnt;
+		item_commit(&stors[1 + cnt % 2], cnt);
+	}
+	base = shared_vsecs[0].base;
+	moves = area.moves;
+	maintain_calls = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = maintain_trap;
+	BUG_ON(sigaction(SIGSEGV, &sa, &old_sa));
+	BUG_ON(mprotect((void*)(uintptr_t)flash_emu_sec_base(0), 2 * PHYS_SZ, PROT_NONE));
+	/* The reader retries with the item moved */
+	BUG_ON(item_read_cnt(&stors[0]) != 1);
+	BUG_ON(sigaction(SIGSEGV, &old_sa, 0));
+	BUG_ON(maintain_calls != 1 || area.moves == moves || shared_vsecs[0].base == base);
+}
+
+int main(int argc, char* argv[])
+{
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	TEST_RUN(test_slot_switch);
+	TEST_RUN(test_maintain);
+	TEST_RUN(test_maintain_interrupted);
+	TEST_RUN(test_power_cut);
+	TEST_RUN(test_shared_area);
+	TEST_RUN(test_read_moved);
+	printf("passed\n");
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include "spi_nor_model.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct spi_nor_model_timing const spi_nor_timing_typ = {
+	.name = "typ",
+	.clk_khz = 42000,
+	.pp_ns = 30000,
+	.pp_byte_ns = 2500,
+	.se_ns = 45000000
+};
+
+static int spi_nor_model_xfer(void* ctx, uint8_t const* cmd, unsigned cmd_sz, void const* tx, void* rx, unsigned sz);
+
+int spi_nor_model_init(struct spi_nor_model* m, unsigned size, struct spi_nor_model_timing const* timing)
+{
+	memset(m, 0, sizeof(*m));
+	m->mem = malloc(size);
+	if (!m->mem) {
+		return -1;
+	}
+	memset(m->mem, 0xff, size);
+	m->size = size;
+	m->id = 0xef4016;
+	m->powered = 1;
+	m->timing = timing;
+	m->bus.xfer = spi_nor_model_xfer;
+	m->bus.ctx = m;
+	return 0;
+}
+
+void spi_nor_model_free(struct spi_nor_model* m)
+{
+	free(m->mem);
+	m->mem = 0;
+}
+
+void spi_nor_model_cut(struct spi_nor_model* m, unsigned long long after_ns)
+{
+	m->cut_ns = m->now_ns + after_ns;
+}
+
+void spi_nor_model_power_up(struct spi_nor_model* m)
+{
+	m->powered = 1;
+	m->status = 0;
+	m->cut_ns = 0;
+	m->busy_ns = m->now_ns;
+}
+
+/* Check if the power is cut before the given time */
+static int spi_nor_model_cut_before(struct spi_nor_model* m, unsigned long long t)
+{
+	return m->cut_ns && m->cut_ns <= t;
+}
+
+static unsigned spi_nor_model_addr(struct spi_nor_model* m, uint8_t const* cmd)
+{
+	return (((unsigned)cmd[1] << 16) | ((unsigned)cmd[2] << 8) | cmd[3]) % m->size;
+}
+
+/* Start program or erase operation completing after the given time. The operation interrupted by
+ * the power cut is applied partially.
+ */
+static void spi_nor_model_op(struct spi_nor_model* m, unsigned addr, uint8_t const* data, unsigned sz, unsigned long long op_ns)
+{
+	unsigned i, page = addr & ~(SPI_NOR_PAGE_SZ - 1);
+	int torn = spi_nor_model_cut_before(m, m->now_ns + op_ns);
+	for (i = 0; i < sz; ++i) {
+		uint8_t* ptr = data ? &m->mem[page + (addr + i) % SPI_NOR_PAGE_SZ] : &m->mem[addr + i];
+		uint8_t mask = torn ? (uint8_t)rand() : 0;
+		if (data) {
+			*ptr &= data[i] | mask;
+		} else {
+			*ptr |= ~mask;
+		}
+	}
+	m->status = SPI_NOR_SR_WIP;
+	m->busy_ns = m->now_ns + op_ns;
+	if (torn) {
+		m->powered = 0;
+	}
+}
+
+static int spi_nor_model_xfer(void* ctx, uint8_t const* cmd, unsigned cmd_sz, void const* tx, void* rx, unsigned sz)
+{
+	struct spi_nor_model* m = ctx;
+	struct spi_nor_model_timing const* t = m->timing;
+	m->now_ns += (cmd_sz + sz) * 8000000ULL / t->clk_khz;
+	if (spi_nor_model_cut_before(m, m->now_ns)) {
+		m->powered = 0;
+	}
+	if (!m->powered) {
+		return -1;
+	}
+	++m->stats.xfer_cnt;
+	if (m->status & SPI_NOR_SR_WIP) {
+		if (cmd[0] != SPI_NOR_CMD_RDSR) {
+			/* Ignored while busy */
+			return 0;
+		}
+		if (spi_nor_model_cut_before(m, m->busy_ns)) {
+			m->now_ns = m->cut_ns;
+			m->powered = 0;
+			return -1;
+		}
+		m->now_ns = m->busy_ns;
+		m->status &= ~(SPI_NOR_SR_WIP|SPI_NOR_SR_WEL);
+	}
+	switch (cmd[0]) {
+	case SPI_NOR_CMD_WREN:
+		m->status |= SPI_NOR_SR_WEL;
+		break;
+	case SPI_NOR_CMD_RDSR:
+		memset(rx, m->status, sz);
+		break;
+	case SPI_NOR_CMD_RDID: {
+		uint8_t const id[3] = {(uint8_t)(m->id >> 16), (uint8_t)(m->id >> 8), (uint8_t)m->id};
+		memcpy(rx, id, sz < sizeof(id) ? sz : sizeof(id));
+		break;
+	}
+	case SPI_NOR_CMD_READ:
+		if (cmd_sz == 5) {
+			unsigned addr = spi_nor_model_addr(m, cmd), i;
+			for (i = 0; i < sz; ++i) {
+				((uint8_t*)rx)[i] = m->mem[(addr + i) % m->size];
+			}
+			m->stats.read_bytes += sz;
+		}
+		break;
+	case SPI_NOR_CMD_PP:
+		if (cmd_sz == 4 && tx && sz && (m->status & SPI_NOR_SR_WEL)) {
+			if (sz > SPI_NOR_PAGE_SZ) {
+				/* Only the last page size bytes are programmed */
+				tx = (uint8_t const*)tx + sz - SPI_NOR_PAGE_SZ;
+				sz = SPI_NOR_PAGE_SZ;
+			}
+			++m->stats.pp_cnt;
+			m->stats.pp_bytes += sz;
+			spi_nor_model_op(m, spi_nor_model_addr(m, cmd), tx, sz, t->pp_ns + (sz - 1) * t->pp_byte_ns);
+		}
+		break;
+	case SPI_NOR_CMD_SE:
+		if (cmd_sz == 4 && (m->status & SPI_NOR_SR_WEL)) {
+			++m->stats.se_cnt;
+			spi_nor_model_op(m, spi_nor_model_addr(m, cmd) & ~(SPI_NOR_SEC_SZ - 1), 0, SPI_NOR_SEC_SZ, t->se_ns);
+		}
+		break;
+	}
+	return m->powered ? 0 : -1;
+}
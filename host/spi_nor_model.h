@@ -0,0 +1,61 @@
+#pragma once
+
+#include "spi_nor.h"
+
+/*
+ * SPI NOR flash behavioral model for the host platform. It interprets the commands used by the
+ * SPI NOR backend, enforces NOR semantics (programming may only clear bits, the page program wraps
+ * around the page boundary, program / erase require write enable and are ignored while the chip is busy)
+ * and keeps the model clock advanced by the bus transfer time and program / erase time.
+ * The status polling is not modelled cycle by cycle - the status read while busy advances the clock
+ * to the operation completion.
+ *
+ * The power cut may be scheduled at the given model time. The program / erase operation interrupted
+ * by the power cut is applied partially (random subset of bits is changed) and the chip stops
+ * responding till the model is powered up again.
+ */
+
+struct spi_nor_model_timing {
+	char const* name;
+	unsigned clk_khz;         /* bus clock */
+	unsigned long pp_ns;      /* page program time for the first byte */
+	unsigned long pp_byte_ns; /* page program time for every next byte */
+	unsigned long se_ns;      /* 4KB sector erase time */
+};
+
+/* Typical timings of 25-series serial flash chips */
+extern struct spi_nor_model_timing const spi_nor_timing_typ;
+
+struct spi_nor_model_stats {
+	unsigned long pp_cnt;
+	unsigned long pp_bytes;
+	unsigned long se_cnt;
+	unsigned long read_bytes;
+	unsigned long xfer_cnt;
+};
+
+struct spi_nor_model {
+	uint8_t*	mem;
+	unsigned	size;
+	uint32_t	id;
+	uint8_t		status;
+	uint8_t		powered;
+	unsigned long long now_ns;
+	unsigned long long busy_ns;  /* the time the current operation completes */
+	unsigned long long cut_ns;   /* scheduled power cut time, 0 if none */
+	struct spi_nor_model_timing const* timing;
+	struct spi_nor_model_stats stats;
+	struct spi_nor_bus bus;
+};
+
+/* Create the model of the erased chip of the given size. Return 0 on success, -1 on memory allocation failure. */
+int spi_nor_model_init(struct spi_nor_model* m, unsigned size, struct spi_nor_model_timing const* timing);
+
+/* Release the model */
+void spi_nor_model_free(struct spi_nor_model* m);
+
+/* Schedule power cut after the given time since now */
+void spi_nor_model_cut(struct spi_nor_model* m, unsigned long long after_ns);
+
+/* Power up the chip after the power cut */
+void spi_nor_model_power_up(struct spi_nor_model* m);
@@ -0,0 +1,93 @@
+/*
+ * Power failure test for the configuration storage on the SPI NOR backend. It runs the storage
+ * on the SPI NOR model cutting power at random time while committing the counter the same way
+ * as the STM32 tests do with watchdog resets. After every power cut it mounts the storage again and
+ * checks that the counter is either the last one committed successfully or the one being committed.
+ * Finally it prints the modelled mount and commit times.
+ *
+ * Usage: spi_nor_test [cycles [seed]]
+ */
+
+#include "cfg_storage.h"
+#include "spi_nor_model.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define SEC_SZ  (2*SPI_NOR_SEC_SZ)
+#define MAX_CUT_NS 200000000ULL
+
+struct test_item {
+	unsigned cnt;
+	uint8_t  payload[60];
+};
+
+int main(int argc, char* argv[])
+{
+	unsigned cycles = argc > 1 ? atoi(argv[1]) : 1000;
+	struct spi_nor_model model;
+	struct spi_nor nor;
+	struct spi_nor_sec nor_sec[2];
+	struct flash_sec sec[2];
+	struct cfg_storage stor;
+	struct test_item t = {0};
+	struct test_item const* last;
+	unsigned long long mount_ns = 0, commit_ns = 0, start_ns;
+	unsigned long commits = 0, cycle;
+	unsigned committed = 0, attempted = 0;
+	/* The shadow address must fit unsigned */
+	uint8_t* shadow = mmap(0, 2 * SEC_SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_32BIT, -1, 0);
+
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+	if (shadow == MAP_FAILED || spi_nor_model_init(&model, 0x100000, &spi_nor_timing_typ)) {
+		fprintf(stderr, "memory allocation failed\n");
+		return 1;
+	}
+	for (cycle = 0; cycle < cycles; ++cycle) {
+		spi_nor_model_power_up(&model);
+		start_ns = model.now_ns;
+		if (
+			spi_nor_init(&nor, &model.bus) ||
+			spi_nor_sec_init(&nor_sec[0], &nor, 0, 0, shadow, SEC_SZ) ||
+			spi_nor_sec_init(&nor_sec[1], &nor, 1, SEC_SZ, shadow + SEC_SZ, SEC_SZ)
+		) {
+			fprintf(stderr, "chip init failed\n");
+			return 1;
+		}
+		sec[0] = nor_sec[0].sec;
+		sec[1] = nor_sec[1].sec;
+		if (cfg_stor_init(&stor, sizeof(t), sec)) {
+			fprintf(stderr, "storage init failed at cycle %lu\n", cycle);
+			return 1;
+		}
+		mount_ns += model.now_ns - start_ns;
+		last = cfg_stor_get(&stor);
+		if (cycle && (!last || last->cnt < committed || last->cnt > attempted)) {
+			fprintf(stderr, "cycle %lu: got %d, expected %u..%u\n", cycle, last ? (int)last->cnt : -1, committed, attempted);
+			return 1;
+		}
+		if (last) {
+			t = *last;
+			committed = t.cnt;
+		}
+		spi_nor_model_cut(&model, rand() % MAX_CUT_NS);
+		for (;;) {
+			attempted = t.cnt;
+			start_ns = model.now_ns;
+			if (cfg_stor_commit(&stor, &t)) {
+				break;
+			}
+			commit_ns += model.now_ns - start_ns;
+			++commits;
+			committed = t.cnt++;
+			t.payload[t.cnt % sizeof(t.payload)] = (uint8_t)t.cnt;
+		}
+	}
+	printf("cycles %lu, commits %lu, value %u\n", cycle, commits, committed);
+	printf("avg mount %llu us, avg commit %llu us\n", mount_ns / cycle / 1000, commits ? commit_ns / commits / 1000 : 0);
+	printf("page programs %lu (%lu bytes), sector erases %lu, read %lu bytes\n",
+		model.stats.pp_cnt, model.stats.pp_bytes, model.stats.se_cnt, model.stats.read_bytes);
+	spi_nor_model_free(&model);
+	return 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+/*
+ * Common part of the host test programs. The conditions are checked by BUG_ON failing the test with
+ * the source location printed. The header is included by the single source file of the test program
+ * since it defines the assertion handler.
+ */
+
+#define USE_FULL_ASSERT
+
+#include "debug.h"
+#include "flash.h"
+#include "flash_sec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void assertion_failed(const char* file, unsigned line)
+{
+	fprintf(stderr, "%s:%u: test failed\n", file, line);
+	exit(1);
+}
+
+/* Create the emulated flash of n sectors with the given cost model and setup the sector descriptors */
+static inline void test_flash_setup(struct flash_sec* sec, unsigned n, unsigned sec_sz, struct flash_emu_cost const* cost)
+{
+	unsigned i;
+	flash_emu_set_cost(cost);
+	BUG_ON(flash_emu_init(n, sec_sz));
+	for (i = 0; i < n; ++i) {
+		flash_sec_init(&sec[i], i, flash_emu_sec_base(i), sec_sz);
+		sec[i].prog_unit = flash_emu_prog_unit();
+	}
+}
+
+/* Run the test printing its name */
+#define TEST_RUN(test) do { printf("%s\n", #test); test(); } while (0)
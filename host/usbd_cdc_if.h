@@ -0,0 +1,28 @@
+#pragma once
+
+/*
+ * Host stand-in of the STM32 USB CDC device interface used by stm32/Src/cli.c (see cli_pty.c)
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#define USBD_OK   0
+#define USBD_BUSY 1
+
+#define USB_FS_MAX_PACKET_SIZE 64
+
+#define __ALIGN_BEGIN
+#define __ALIGN_END __attribute__ ((aligned (4)))
+
+typedef struct {
+	volatile uint32_t TxState;
+} USBD_CDC_HandleTypeDef;
+
+typedef struct {
+	void* pClassData;
+} USBD_HandleTypeDef;
+
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+uint8_t USBD_CDC_ReceivePacket(USBD_HandleTypeDef* pdev);
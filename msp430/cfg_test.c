@@ -31,19 +31,29 @@ __no_init __root uint8_t const cfg_sec_1[FLASH_SEG_SZ] @ SEC_BASE(1);
 __no_init __root uint8_t const cfg_sec_2[FLASH_SEG_SZ] @ SEC_BASE(2);
 __no_init __root uint8_t const cfg_sec_3[FLASH_SEG_SZ] @ SEC_BASE(3);
 __no_init __root uint8_t const cfg_sec_4[FLASH_SEG_SZ] @ SEC_BASE(4);
+__no_init __root uint8_t const cfg_sec_5[FLASH_SEG_SZ] @ SEC_BASE(5);
+__no_init __root uint8_t const cfg_sec_6[FLASH_SEG_SZ] @ SEC_BASE(6);
 
 struct flash_sec const cfg_pool_sec[2] = {
 	FLASH_SEC_INITIALIZER(1, SEC_BASE(1), FLASH_SEG_SZ),
 	FLASH_SEC_INITIALIZER(2, SEC_BASE(2), FLASH_SEG_SZ)
 };
 
+// The storage sectors span 2 segments each erased lazily
 struct flash_sec const cfg_stor_sec[2] = {
-	FLASH_SEC_INITIALIZER(3, SEC_BASE(3), FLASH_SEG_SZ),
-	FLASH_SEC_INITIALIZER(4, SEC_BASE(4), FLASH_SEG_SZ)
+	FLASH_SEC_SEG_INITIALIZER(3, SEC_BASE(4), 2*FLASH_SEG_SZ, FLASH_SEG_SZ),
+	FLASH_SEC_SEG_INITIALIZER(5, SEC_BASE(6), 2*FLASH_SEG_SZ, FLASH_SEG_SZ)
+};
+
+// The hot storage for tiny items in information memory segments
+struct flash_sec const cfg_hot_sec[2] = {
+	FLASH_SEC_INITIALIZER(7, FLASH_INFO_SEG_D, FLASH_INFO_SEG_SZ),
+	FLASH_SEC_INITIALIZER(8, FLASH_INFO_SEG_C, FLASH_INFO_SEG_SZ)
 };
 
 __no_init struct cfg_pool    cfg_pool[2];
 __no_init struct cfg_storage cfg_stor;
+__no_init struct cfg_storage cfg_hot;
 
 typedef unsigned long test_cnt_t;
 
@@ -73,7 +83,7 @@ void cfg_test(void)
 	int res;
 	test_cnt_t cnt = 0;
 	unsigned tout = TOUT_DEF;
-	struct test_item const *p_last[2], *s_last;
+	struct test_item const *p_last[2], *s_last, *h_last;
 
 	res = cfg_pool_init(&cfg_pool[0], sizeof(struct test_item), &cfg_pool_sec[0]); BUG_ON(res);
 	res = cfg_pool_init(&cfg_pool[1], sizeof(struct test_item), &cfg_pool_sec[1]); BUG_ON(res);
@@ -100,12 +110,17 @@ void cfg_test(void)
 
 	res = cfg_stor_init(&cfg_stor, sizeof(struct test_item), cfg_stor_sec); BUG_ON(res);
 	s_last = cfg_stor_get(&cfg_stor);
+	res = cfg_stor_init(&cfg_hot, sizeof(struct test_item), cfg_hot_sec); BUG_ON(res);
+	h_last = cfg_stor_get(&cfg_hot);
 
 	if (s_last) {
 		int i;
 		cfg_t.cnt = s_last->cnt;
 		BUG_ON(!p_last[0] && !p_last[1]);
 		BUG_ON(cnt != cfg_t.cnt && cnt != (test_cnt_t)(cfg_t.cnt + 1));
+		// The hot storage is committed last
+		BUG_ON(!h_last && cfg_t.cnt);
+		BUG_ON(h_last && h_last->cnt != cfg_t.cnt && (test_cnt_t)(h_last->cnt + 1) != cfg_t.cnt);
 		if (cfg_t.cnt >= MAX_WRITES) {
 			test_stop();
 		}
@@ -117,22 +132,25 @@ void cfg_test(void)
 	} else {
 		// starting with empty flash
 		cfg_t.cnt = 0;
-		BUG_ON(p_last[0] || p_last[1]);
+		BUG_ON(p_last[0] || p_last[1] || h_last);
 	}
 
 	for (;;) {
 		res = cfg_pool_commit(&cfg_pool[0], &cfg_t); BUG_ON(res);
 		res = cfg_pool_commit(&cfg_pool[1], &cfg_t); BUG_ON(res);
 		res = cfg_stor_commit(&cfg_stor, &cfg_t); BUG_ON(res);
+		res = cfg_stor_commit(&cfg_hot, &cfg_t); BUG_ON(res);
 		p_last[0] = cfg_pool_get(&cfg_pool[0]);
 		p_last[1] = cfg_pool_get(&cfg_pool[1]);
 		s_last = cfg_stor_get(&cfg_stor);
+		h_last = cfg_stor_get(&cfg_hot);
 		BUG_ON(!p_last[0]);
 		BUG_ON(!p_last[1]);
 		BUG_ON(!s_last);
 		BUG_ON(p_last[0]->cnt != cfg_t.cnt);
 		BUG_ON(p_last[1]->cnt != cfg_t.cnt);
 		BUG_ON(s_last->cnt != cfg_t.cnt);
+		BUG_ON(!h_last || h_last->cnt != cfg_t.cnt);
 		++cfg_t.cnt;
 		++cfg_last_writes;
 	}
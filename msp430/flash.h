@@ -3,6 +3,18 @@
 #include "io430.h"
 
 #define FLASH_SEG_SZ 512
+#define FLASH_ROW_SZ 64 // Block write can't cross the row boundary
+
+// Information memory segments D, C, B, A. The segment A keeps calibration data and should never be erased.
+#define FLASH_INFO_BASE   0x1000
+#define FLASH_INFO_SEG_SZ 64
+#define FLASH_INFO_SEG_D  (FLASH_INFO_BASE+0*FLASH_INFO_SEG_SZ)
+#define FLASH_INFO_SEG_C  (FLASH_INFO_BASE+1*FLASH_INFO_SEG_SZ)
+#define FLASH_INFO_SEG_B  (FLASH_INFO_BASE+2*FLASH_INFO_SEG_SZ)
+
+// The block write source should be in RAM since the flash can't be read while block writing.
+// The RAM is expected to be below the information memory.
+#define FLASH_RAM_END 0x1000
 
 static inline void flash_unlock(void)
 {
@@ -32,9 +44,15 @@ static inline void flash_wait(void)
 	// while (FCTL3 & BUSY) __no_operation();
 }
 
+// Return the size of the segment at the given address
+static inline unsigned flash_seg_size(unsigned addr)
+{
+	return addr >= FLASH_INFO_BASE && addr < FLASH_INFO_BASE + 4*FLASH_INFO_SEG_SZ ? FLASH_INFO_SEG_SZ : FLASH_SEG_SZ;
+}
+
 static inline void flash_erase(unsigned base, unsigned nsegs)
 {
-	unsigned i;
+	unsigned i, seg_sz = flash_seg_size(base);
 	char *ptr = (char*)base;
 	flash_wait();
 	flash_unlock();
@@ -42,7 +60,7 @@ static inline void flash_erase(unsigned base, unsigned nsegs)
 		FCTL1 = FWKEY + ERASE;	// Set Erase bit
 		// Dummy write to erase segment
 		*ptr = 0;
-		ptr += FLASH_SEG_SZ;
+		ptr += seg_sz;
 		flash_wait();
 	}
 	flash_lock();
@@ -60,7 +78,8 @@ static inline void flash_write(unsigned addr, void const* data, unsigned sz)
 		data = (unsigned char const*)data + 1;
 		flash_wait();
 	}
-	for (; sz >= sizeof(unsigned); sz -= sizeof(unsigned), addr += sizeof(unsigned)) {
+	// The word writes require aligned source as well, the rest is written by bytes otherwise
+	for (; sz >= sizeof(unsigned) && !((unsigned)data % sizeof(unsigned)); sz -= sizeof(unsigned), addr += sizeof(unsigned)) {
 		// Write data to flash
 		*(unsigned*)addr = *(unsigned const*)data;
 		data = (unsigned const*)data + 1;
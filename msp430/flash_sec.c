@@ -1,15 +1,74 @@
 #include "flash_sec.h"
 #include "flash.h"
+#include <intrinsics.h>
 
+void (*flash_progress_hook)(void);
+
+// The multi-segment sector is erased segment by segment calling progress hook in between
 int flash_sec_erase(struct flash_sec const* sec)
 {
-	flash_erase(sec->base, 1);
+	unsigned off, seg_sz = flash_seg_size(sec->base);
+	for (off = 0; off < sec->size; off += seg_sz) {
+		flash_erase(sec->base + off, 1);
+		flash_progress();
+	}
+	return 0;
+}
+
+int flash_sec_erase_seg(struct flash_sec const* sec, unsigned off)
+{
+	flash_erase(sec->base + off, 1);
 	return 0;
 }
 
+// The block write takes 25 flash timing generator clocks for the first word, 18 clocks for every next word and
+// 6 clocks for the end sequence while the word write takes 30 clocks. So the block write is faster starting from 3 words.
+// The whole 64 byte row is programmed in 589 clocks instead of 960 (1.6 times faster).
+#define FLASH_BLK_MIN (3*sizeof(unsigned))
+
+// Program words within the single row by the block write. The routine is executed from RAM since the flash
+// is not accessible while block writing. Interrupts are disabled since the vectors are in flash.
+// Both address and data are expected to be word aligned.
+static __ramfunc void flash_write_block(unsigned addr, unsigned const* data, unsigned sz)
+{
+	__istate_t istate = __get_interrupt_state();
+	__disable_interrupt();
+	while (FCTL3 & BUSY) __no_operation();
+	flash_unlock();
+	FCTL1 = FWKEY + BLKWRT + WRT;
+	for (; sz >= sizeof(unsigned); sz -= sizeof(unsigned), addr += sizeof(unsigned)) {
+		*(unsigned*)addr = *data++;
+		// Wait till the word is programmed
+		while (!(FCTL3 & WAIT)) __no_operation();
+	}
+	FCTL1 = FWKEY;
+	while (FCTL3 & BUSY) __no_operation();
+	flash_lock();
+	__set_interrupt_state(istate);
+}
+
 int flash_sec_write(struct flash_sec const* sec, unsigned off, void const* data, unsigned sz)
 {
-	flash_write(sec->base + off, data, sz);
+	unsigned addr = sec->base + off;
+	if (!((addr | (unsigned)data) % sizeof(unsigned)) && (unsigned)data + sz <= FLASH_RAM_END) {
+		// Program aligned words by blocks split by rows
+		while (sz >= FLASH_BLK_MIN) {
+			unsigned n = FLASH_ROW_SZ - addr % FLASH_ROW_SZ;
+			if (n > sz) {
+				n = sz & ~(sizeof(unsigned) - 1);
+			}
+			if (n >= FLASH_BLK_MIN) {
+				flash_write_block(addr, data, n);
+			} else {
+				flash_write(addr, data, n);
+			}
+			flash_progress();
+			addr += n;
+			data = (unsigned char const*)data + n;
+			sz -= n;
+		}
+	}
+	flash_write(addr, data, sz);
 	return 0;
 }
 
@@ -779,6 +779,25 @@ HAL_StatusTypeDef USB_WritePacket(USB_OTG_GlobalTypeDef *USBx, uint8_t *src, uin
   if (dma == 0)
   {
     count32b =  (len + 3) / 4;
+    if (((uint32_t)src & 3) == 0)
+    {
+      /* Aligned fast path: the words are loaded by 4 so the compiler may use LDM */
+      __IO uint32_t *fifo = &USBx_DFIFO(ch_ep_num);
+      uint32_t const *p = (uint32_t const *)src;
+      for (; count32b >= 4; count32b -= 4, p += 4)
+      {
+        uint32_t w0 = p[0], w1 = p[1], w2 = p[2], w3 = p[3];
+        *fifo = w0;
+        *fifo = w1;
+        *fifo = w2;
+        *fifo = w3;
+      }
+      for (; count32b; count32b--)
+      {
+        *fifo = *p++;
+      }
+      return HAL_OK;
+    }
     for (i = 0; i < count32b; i++, src += 4)
     {
       USBx_DFIFO(ch_ep_num) = *((__packed uint32_t *)src);
@@ -805,6 +824,25 @@ void *USB_ReadPacket(USB_OTG_GlobalTypeDef *USBx, uint8_t *dest, uint16_t len)
   uint32_t i=0;
   uint32_t count32b = (len + 3) / 4;
   
+  if (((uint32_t)dest & 3) == 0)
+  {
+    /* Aligned fast path: the words are stored by 4 so the compiler may use STM */
+    __IO uint32_t *fifo = &USBx_DFIFO(0);
+    uint32_t *p = (uint32_t *)dest;
+    for (; count32b >= 4; count32b -= 4, p += 4)
+    {
+      uint32_t w0 = *fifo, w1 = *fifo, w2 = *fifo, w3 = *fifo;
+      p[0] = w0;
+      p[1] = w1;
+      p[2] = w2;
+      p[3] = w3;
+    }
+    for (; count32b; count32b--)
+    {
+      *p++ = *fifo;
+    }
+    return ((void *)p);
+  }
   for ( i = 0; i < count32b; i++, dest += 4 )
   {
     *(__packed uint32_t *)dest = USBx_DFIFO(0);
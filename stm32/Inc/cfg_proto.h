@@ -0,0 +1,56 @@
+#pragma once
+
+#include "cfg_storage.h"
+#include "cobs.h"
+
+/*
+ * Binary configuration protocol. The frames are COBS encoded and enclosed in zero delimiters so they
+ * may be pipelined. The decoded frames have the following layout (multibyte fields are little endian):
+ *
+ * request:  cmd | id | payload | crc16
+ * response: cmd | id | status | payload | crc16
+ *
+ * The id is chosen by the host and copied to the response. The status is the err_t code, the payload
+ * is present on success only. The crc16 covers the preceding bytes of the frame.
+ *
+ * The export response is followed by the raw images of both sectors sent right from the flash. The import
+ * erases both sectors, programs the image chunks as they arrive and mounts the storage once the image
+ * checksum is validated. The other storage commands fail with err_state while the import is in progress.
+ * The import is left by the abort command erasing the partial image, so the host reconnecting after the
+ * interrupted import may recover the storage. The storage is mounted again if the sectors erase fails.
+ */
+
+#define CFG_PROTO_GET     1 /* [off:16 len:16] -> the item bytes (the whole item by default) */
+#define CFG_PROTO_SET     2 /* off:16 data -> commit the item with the given range updated */
+#define CFG_PROTO_COMMIT  3 /* item -> commit the whole item */
+#define CFG_PROTO_ERASE   4 /* erase the storage */
+#define CFG_PROTO_STATS   5 /* -> item_sz:16 rec_sz:16 sec_sz:32 epoch:8 put_cnt:32[2] erase_cnt:32[2] */
+#define CFG_PROTO_HISTORY 6 /* n:16 -> the item committed n versions ago */
+#define CFG_PROTO_EXPORT  7 /* -> sz0:32 sz1:32 crc16, followed by sz0 + sz1 raw image bytes */
+#define CFG_PROTO_IMPORT  8 /* sz0:32 sz1:32 crc16 -> erase both sectors and start import */
+#define CFG_PROTO_IMPORT_DATA 9  /* off:32 data -> program the image chunk, the chunks go in order */
+#define CFG_PROTO_IMPORT_END  10 /* -> validate the image and mount the storage */
+#define CFG_PROTO_IMPORT_ABORT 11 /* -> erase the partial image and leave the import */
+
+/* The maximum size of the data transferred by the single frame */
+#define CFG_PROTO_DATA_MAX 1024
+/* The maximum size of the decoded frames */
+#define CFG_PROTO_REQ_MAX  (CFG_PROTO_DATA_MAX + 6)
+#define CFG_PROTO_RESP_MAX (CFG_PROTO_DATA_MAX + 5)
+/* The maximum size of the encoded response including delimiters */
+#define CFG_PROTO_OUT_MAX  (COBS_ENC_MAX(CFG_PROTO_RESP_MAX) + 2)
+/* The maximum number of raw data chunks following the response */
+#define CFG_PROTO_RAW_MAX  2
+
+/* Handle the decoded request frame (sz = 0 for the malformed one). The response is COBS encoded right
+ * from the flash record to the out buffer of at least CFG_PROTO_OUT_MAX bytes. The raw data chunks to be
+ * sent after the response as is are returned in the raw array (the chunks not used have zero size).
+ * They reference flash so it must not be modified till they are transmitted. The stor = 0 means there
+ * is no storage available. The flash is the sector descriptor array the storage was initialized with,
+ * it is kept by the import to mount the storage on. Return the size of the response.
+ */
+unsigned cfg_proto_handle(struct cfg_storage* stor, struct flash_sec const flash[2], uint8_t const* req, unsigned sz,
+				uint8_t* out, struct cfg_chunk raw[CFG_PROTO_RAW_MAX]);
+
+/* Return 1 if the import is in progress so the storage must not be modified, 0 otherwise */
+int cfg_proto_importing(void);
@@ -3,4 +3,10 @@
 #include <stdint.h>
 
 int8_t cli_receive(uint8_t* Buf, uint32_t *Len);
-void   cli_run(void);
\ No newline at end of file
+/* Return 1 if the OUT endpoint may be re-armed for the next packet. Otherwise cli_run re-arms it
+ * once the room is available.
+ */
+int    cli_rx_ready(void);
+void   cli_run(void);
+/* Return 1 if the storage must not be modified since the flash is being sent or imported, 0 otherwise */
+int    cli_flash_held(void);
\ No newline at end of file
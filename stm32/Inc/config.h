@@ -1,3 +1,24 @@
 #pragma once
 
+#include "cfg_storage.h"
+
+/* The size of the configuration item */
+#define CFG_ITEM_SZ 256
+
+/* Initialize configuration storage. If CFG_TEST is defined the storage power failure test is run instead. */
 void cfg_init(void);
+
+/* Return the configuration storage or 0 if it is not available */
+struct cfg_storage* cfg_storage(void);
+
+/* Return the sector descriptor array the configuration storage is initialized with */
+struct flash_sec const* cfg_sectors(void);
+
+/* Post the update of len bytes of the configuration item at the given offset. May be called from the interrupt
+ * handlers. The updates are committed by cfg_run called from the main loop. Return 0 on success, -1 if the storage
+ * is not available, the range is invalid or the queue is full.
+ */
+int cfg_post(unsigned off, unsigned len, void const* data);
+
+/* Commit the updates posted. They are deferred while the CLI holds the flash. */
+void cfg_run(void);
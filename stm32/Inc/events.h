@@ -0,0 +1,37 @@
+#pragma once
+
+#include "stm32f4xx.h"
+
+/*
+ * Event mask posted by the interrupt handlers and taken by the main loop. The main loop sleeps in WFI
+ * with the SysTick suspended while there are no events so the core is woken by the posting interrupts only.
+ */
+
+#define EV_USB_RX (1 << 0) /* the OUT packet is received */
+#define EV_USB_TX (1 << 1) /* the IN transfer is completed */
+#define EV_FLASH  (1 << 2) /* the flash operation is completed */
+#define EV_CFG    (1 << 3) /* the configuration update is posted */
+
+extern volatile uint32_t ev_pending;
+
+/* Post events. May be called from the interrupt handlers. */
+static inline void ev_post(uint32_t ev)
+{
+	uint32_t v;
+	do {
+		v = __LDREXW(&ev_pending);
+	} while (__STREXW(v | ev, &ev_pending));
+}
+
+/* Take all pending events clearing the mask */
+static inline uint32_t ev_take(void)
+{
+	uint32_t v;
+	do {
+		v = __LDREXW(&ev_pending);
+	} while (__STREXW(0, &ev_pending));
+	return v;
+}
+
+/* Sleep till some event is posted */
+void ev_wait(void);
@@ -1,6 +1,87 @@
 #pragma once
 
+#include "stm32f4xx.h"
+
+#if defined(STM32F427xx) || defined(STM32F437xx) || defined(STM32F429xx) || defined(STM32F439xx)
+/* The device may have 2 flash banks so one bank may be erased / programmed while the code is executing from the
+ * other one. The 2M devices always have 2 banks, the 1M devices have them if the DB1M option bit is set, the 512k
+ * devices have the single bank. The actual layout is detected at run time.
+ */
+#define FLASH_DUAL_BANK
+#define FLASH_BANK2_BASE (FLASH_BASE + 0x100000)
+#endif
+
+/* Flash sector descriptor */
+struct flash_sector {
+	unsigned base;
+	unsigned size;
+	unsigned bank; /* 1 or 2 */
+};
+
+struct flash_sec;
+
+/* Get the descriptor of the given sector. The sectors 12 and above are in the bank 2. Return 0 on success,
+ * -1 if there is no such sector.
+ */
+int flash_sector_info(int sec_no, struct flash_sector* s);
+
+/* Return the bank containing the code being executed */
+unsigned flash_code_bank(void);
+
+/* Return the number of the sector having the same size and bank offset as the given bank 1 sector placed in the bank
+ * not executing code so it may be erased and programmed without stalling the CPU. On single bank devices (including
+ * the dual bank capable ones configured as single bank) return the given sector number as is.
+ */
+int flash_cfg_sector(int sec_no);
+
+/* Initialize flash sector by its number. Return 0 on success, -1 if there is no such sector. */
+int flash_sec_setup(struct flash_sec* sec, int sec_no);
+
+/* The supply voltage and current figures used to estimate the erase energy. The defaults are rough
+ * datasheet values for 168MHz with peripherals clock disabled. The erase current is added to the
+ * run / sleep current while the erase is in progress.
+ */
+#ifndef FLASH_VDD_MV
+#define FLASH_VDD_MV   3300
+#endif
+#ifndef FLASH_RUN_UA
+#define FLASH_RUN_UA   40000
+#endif
+#ifndef FLASH_SLEEP_UA
+#define FLASH_SLEEP_UA 16000
+#endif
+#ifndef FLASH_ERASE_UA
+#define FLASH_ERASE_UA 10000
+#endif
+
+/* Sector erase instrumentation. The CPU sleeps in WFI while erasing. The times are in CPU cycles. */
+struct flash_erase_stats {
+	unsigned	erases;
+	unsigned	errors;         /* including timeouts */
+	unsigned	wakeups;        /* the number of wakeups while waiting for completion */
+	uint32_t	last_cycles;    /* the last erase duration */
+	uint32_t	last_awake;     /* the number of cycles the CPU was running during the last erase */
+	uint32_t	last_latency;   /* the time from the last wakeup till the erase completion is noticed */
+	uint32_t	max_latency;
+	uint32_t	last_energy_uj; /* the estimated energy of the last erase */
+	uint32_t	total_energy_uj;
+};
+
+extern struct flash_erase_stats flash_erase_stats;
+
+/* Erase sector sleeping till completion. The progress hook is called on every wakeup (at least every millisecond).
+ * Return 0 on success, -1 on error or timeout.
+ */
 int flash_erase_sec(int sec_no);
+
+/* Start erasing sector without waiting. The flash is not accessible for writing till the erase completes.
+ * Return 0 on success, -1 on error.
+ */
+int flash_erase_start(int sec_no);
+
+/* Poll the erase started by flash_erase_start. Return 1 if the erase is in progress, 0 if it is completed,
+ * -1 on error. The caller is responsible for the timeout.
+ */
+int flash_erase_poll(void);
 int flash_write(unsigned addr, void const* data, unsigned sz);
 int flash_write_bytes(unsigned addr, void const* data, unsigned sz);
-
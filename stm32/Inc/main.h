@@ -10,3 +10,6 @@ extern IWDG_HandleTypeDef hiwdg;
 void LED_On(void);
 void LED_Off(void);
 void LED_Toggle(void);
+
+/* Enable DWT cycle counter */
+void DWT_Init(void);
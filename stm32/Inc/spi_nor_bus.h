@@ -0,0 +1,14 @@
+#pragma once
+
+#include "spi_nor.h"
+
+/*
+ * SPI NOR flash bus on SPI1 (PA5 - SCK, PA6 - MISO, PA7 - MOSI, PA4 - chip select).
+ * The payload is transferred by DMA2 streams 0 (RX) and 3 (TX). The buffers must not be placed in CCM RAM
+ * since it is not accessible by DMA.
+ */
+
+extern struct spi_nor_bus const spi_nor_bus;
+
+/* Initialize SPI and DMA */
+void spi_nor_bus_init(void);
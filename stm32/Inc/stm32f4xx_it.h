@@ -40,12 +40,25 @@
 #endif 
 
 /* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
 /* Exported types ------------------------------------------------------------*/
+
+/* The OTG_FS interrupt handler time measured by DWT cycle counter */
+struct usb_irq_stats {
+  uint32_t count;
+  uint32_t cycles; /* total */
+  uint32_t max_cycles;
+};
+
+extern struct usb_irq_stats usb_irq_stats;
+
 /* Exported constants --------------------------------------------------------*/
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 
 void SysTick_Handler(void);
+void FLASH_IRQHandler(void);
 void OTG_FS_IRQHandler(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,350 @@
+#include "cfg_proto.h"
+#include "errors.h"
+#include "crc16.h"
+
+#define HDR_SZ   2 /* cmd | id */
+#define CRC_SZ   2
+#define STATS_SZ 25
+#define IMAGE_SZ 10 /* sz0:32 sz1:32 crc16 */
+
+struct cfg_proto_resp {
+	struct cobs_enc	enc;
+	crc16_t		crc;
+};
+
+/* The import in progress */
+struct cfg_import {
+	unsigned	size;
+	unsigned	off;   /* the next chunk offset */
+	crc16_t		crc;   /* the checksum of the chunks received */
+	crc16_t		expect;
+	int		active;
+	struct flash_sec const* flash; /* the sectors the storage is mounted on */
+};
+
+struct cfg_import cfg_import;
+
+static inline unsigned get16(uint8_t const* p)
+{
+	return p[0] | ((unsigned)p[1] << 8);
+}
+
+static inline uint32_t get32(uint8_t const* p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static inline uint8_t* put16(uint8_t* p, unsigned v)
+{
+	*p++ = (uint8_t)v;
+	*p++ = (uint8_t)(v >> 8);
+	return p;
+}
+
+static inline uint8_t* put32(uint8_t* p, uint32_t v)
+{
+	return put16(put16(p, v), v >> 16);
+}
+
+static void cfg_proto_put(struct cfg_proto_resp* r, void const* data, unsigned sz)
+{
+	r->crc = crc16_up_buff(r->crc, data, sz);
+	cobs_enc_put(&r->enc, data, sz);
+}
+
+static err_t cfg_proto_get(struct cfg_storage* stor, uint8_t const* data, unsigned sz, struct cfg_chunk* out)
+{
+	uint8_t const* item = cfg_stor_get(stor);
+	unsigned item_sz = cfg_stor_item_size(stor), off = 0, len = item_sz;
+	if (sz == 4) {
+		off = get16(data);
+		len = get16(data + 2);
+	} else if (sz) {
+		return err_param;
+	}
+	if (!item) {
+		return err_state;
+	}
+	if (off > item_sz || len > item_sz - off || len > CFG_PROTO_DATA_MAX) {
+		return err_param;
+	}
+	out->data = item + off;
+	out->sz = len;
+	return err_ok;
+}
+
+static err_t cfg_proto_set(struct cfg_storage* stor, uint8_t const* data, unsigned sz)
+{
+	if (sz < 2) {
+		return err_param;
+	}
+	if (!cfg_stor_get(stor)) {
+		return err_state;
+	}
+	if (cfg_stor_update(stor, get16(data), sz - 2, data + 2)) {
+		return err_malfunction;
+	}
+	return err_ok;
+}
+
+static err_t cfg_proto_commit(struct cfg_storage* stor, uint8_t const* data, unsigned sz)
+{
+	if (sz != cfg_stor_item_size(stor)) {
+		return err_param;
+	}
+	if (cfg_stor_commit(stor, data)) {
+		return err_malfunction;
+	}
+	return err_ok;
+}
+
+static err_t cfg_proto_stats(struct cfg_storage* stor, uint8_t* buff, struct cfg_chunk* out)
+{
+	uint8_t* p = buff;
+	p = put16(p, cfg_stor_item_size(stor));
+	p = put16(p, stor->pool[0].rec_sz);
+	p = put32(p, stor->pool[0].flash->size);
+	*p++ = stor->epoch;
+	p = put32(p, stor->pool[0].put_cnt);
+	p = put32(p, stor->pool[1].put_cnt);
+	p = put32(p, stor->pool[0].erase_cnt);
+	p = put32(p, stor->pool[1].erase_cnt);
+	out->data = buff;
+	out->sz = p - buff;
+	return err_ok;
+}
+
+static err_t cfg_proto_history(struct cfg_storage* stor, uint8_t const* data, unsigned sz, struct cfg_chunk* out)
+{
+	struct cfg_stor_iter it;
+	void const* item;
+	unsigned n;
+	if (sz != 2 || cfg_stor_item_size(stor) > CFG_PROTO_DATA_MAX) {
+		return err_param;
+	}
+	cfg_stor_iter_init(&it, stor);
+	for (n = get16(data); (item = cfg_stor_iter_next(&it)) && n; --n);
+	if (!item) {
+		return err_param;
+	}
+	out->data = item;
+	out->sz = cfg_stor_item_size(stor);
+	return err_ok;
+}
+
+/* Compute the checksum of both sector images */
+static crc16_t cfg_proto_image_crc(struct flash_sec const flash[2])
+{
+	crc16_t crc = CRC16_INIT;
+	unsigned i;
+	for (i = 0; i < 2; ++i) {
+		crc = crc16_up_buff(crc, (void const*)flash[i].base, flash[i].size);
+	}
+	return crc;
+}
+
+static err_t cfg_proto_export(struct flash_sec const flash[2], uint8_t* buff, struct cfg_chunk* out, struct cfg_chunk* raw)
+{
+	unsigned i;
+	uint8_t* p = buff;
+	for (i = 0; i < 2; ++i) {
+		p = put32(p, flash[i].size);
+		raw[i].data = (void const*)flash[i].base;
+		raw[i].sz = flash[i].size;
+	}
+	p = put16(p, cfg_proto_image_crc(flash));
+	out->data = buff;
+	out->sz = p - buff;
+	return err_ok;
+}
+
+/* Leave the import mode mounting the storage on the sectors as they are. Return 0 on success, -1 on flash writing error. */
+static int cfg_proto_remount(struct cfg_storage* stor)
+{
+	struct cfg_schema const schema = {stor->schema, cfg_stor_item_size(stor)};
+	cfg_import.active = 0;
+	return cfg_stor_init_schema(stor, &schema, cfg_import.flash, 0);
+}
+
+/* Leave the import mode erasing the partial or corrupt image. The storage is mounted first so the erase
+ * starts from the actual sector content.
+ */
+static err_t cfg_proto_import_abort(struct cfg_storage* stor)
+{
+	if (cfg_proto_remount(stor) || cfg_stor_erase(stor)) {
+		return err_malfunction;
+	}
+	return err_ok;
+}
+
+static err_t cfg_proto_import(struct cfg_storage* stor, struct flash_sec const flash[2], uint8_t const* data, unsigned sz)
+{
+	unsigned i;
+	if (sz != IMAGE_SZ || get32(data) != flash[0].size || get32(data + 4) != flash[1].size) {
+		return err_param;
+	}
+	/* The sectors are erased physically since the lazily erased pool has the blank first segment only */
+	cfg_import.active = 1;
+	cfg_import.flash = flash;
+	cfg_stor_unpublish(stor);
+	for (i = 0; i < 2; ++i) {
+		if (flash[i].erase(&flash[i])) {
+			/* Mount whatever is left so the storage remains usable */
+			cfg_proto_remount(stor);
+			return err_malfunction;
+		}
+	}
+	cfg_import.size = flash[0].size + flash[1].size;
+	cfg_import.off = 0;
+	cfg_import.crc = CRC16_INIT;
+	cfg_import.expect = get16(data + 8);
+	return err_ok;
+}
+
+/* Program the image chunk skipping blank program units so the pools may be appended after import.
+ * The chunk is aligned to the program unit.
+ */
+static int cfg_proto_program(unsigned off, uint8_t const* data, unsigned sz)
+{
+	unsigned i, n;
+	for (i = 0; i < 2 && sz; ++i) {
+		struct flash_sec const* f = &cfg_import.flash[i];
+		if (off >= f->size) {
+			off -= f->size;
+			continue;
+		}
+		n = f->size - off < sz ? f->size - off : sz;
+		if (flash_sec_write_sparse(f, off, data, n)) {
+			return -1;
+		}
+		data += n;
+		sz -= n;
+		off = 0;
+	}
+	return 0;
+}
+
+static err_t cfg_proto_import_data(uint8_t const* data, unsigned sz)
+{
+	unsigned off;
+	if (sz < 4) {
+		return err_param;
+	}
+	off = get32(data);
+	data += 4;
+	sz -= 4;
+	if (off != cfg_import.off || sz > cfg_import.size - off || (off + sz) % cfg_import.flash[0].prog_unit) {
+		return err_param;
+	}
+	cfg_import.crc = crc16_up_buff(cfg_import.crc, data, sz);
+	cfg_import.off += sz;
+	if (cfg_proto_program(off, data, sz)) {
+		return err_malfunction;
+	}
+	return err_ok;
+}
+
+static err_t cfg_proto_import_end(struct cfg_storage* stor)
+{
+	if (cfg_import.off != cfg_import.size || cfg_import.crc != cfg_import.expect) {
+		cfg_proto_import_abort(stor);
+		return err_param;
+	}
+	if (cfg_proto_image_crc(cfg_import.flash) != cfg_import.expect) {
+		cfg_proto_import_abort(stor);
+		return err_malfunction;
+	}
+	if (cfg_proto_remount(stor)) {
+		return err_malfunction;
+	}
+	return err_ok;
+}
+
+/* Execute the request. The response payload is returned by the out chunk. */
+static err_t cfg_proto_exec(struct cfg_storage* stor, struct flash_sec const flash[2], uint8_t cmd,
+				uint8_t const* data, unsigned sz, struct cfg_chunk* out, uint8_t* buff, struct cfg_chunk* raw)
+{
+	if (cfg_import.active) {
+		switch (cmd) {
+		case CFG_PROTO_IMPORT:
+			break;
+		case CFG_PROTO_IMPORT_DATA:
+			return cfg_proto_import_data(data, sz);
+		case CFG_PROTO_IMPORT_END:
+			return sz ? err_param : cfg_proto_import_end(stor);
+		case CFG_PROTO_IMPORT_ABORT:
+			return sz ? err_param : cfg_proto_import_abort(stor);
+		default:
+			return err_state;
+		}
+	}
+	switch (cmd) {
+	case CFG_PROTO_GET:
+		return cfg_proto_get(stor, data, sz, out);
+	case CFG_PROTO_SET:
+		return cfg_proto_set(stor, data, sz);
+	case CFG_PROTO_COMMIT:
+		return cfg_proto_commit(stor, data, sz);
+	case CFG_PROTO_ERASE:
+		return sz ? err_param : cfg_stor_erase(stor) ? err_malfunction : err_ok;
+	case CFG_PROTO_STATS:
+		return sz ? err_param : cfg_proto_stats(stor, buff, out);
+	case CFG_PROTO_HISTORY:
+		return cfg_proto_history(stor, data, sz, out);
+	case CFG_PROTO_EXPORT:
+		return sz ? err_param : cfg_proto_export(flash, buff, out, raw);
+	case CFG_PROTO_IMPORT:
+		return cfg_proto_import(stor, flash, data, sz);
+	case CFG_PROTO_IMPORT_DATA:
+	case CFG_PROTO_IMPORT_END:
+	case CFG_PROTO_IMPORT_ABORT:
+		return err_state;
+	default:
+		return err_cmd;
+	}
+}
+
+unsigned cfg_proto_handle(struct cfg_storage* stor, struct flash_sec const flash[2], uint8_t const* req, unsigned sz,
+				uint8_t* out, struct cfg_chunk raw[CFG_PROTO_RAW_MAX])
+{
+	struct cfg_proto_resp r;
+	struct cfg_chunk payload = {0, 0};
+	uint8_t hdr[HDR_SZ + 1] = {0, 0, err_proto};
+	uint8_t buff[STATS_SZ], crc[CRC_SZ];
+	unsigned out_sz, i;
+	for (i = 0; i < CFG_PROTO_RAW_MAX; ++i) {
+		raw[i].sz = 0;
+	}
+	if (sz >= HDR_SZ + CRC_SZ) {
+		hdr[0] = req[0];
+		hdr[1] = req[1];
+		if (crc16(req, sz - CRC_SZ) != get16(req + sz - CRC_SZ)) {
+			hdr[2] = err_proto;
+		} else if (!stor) {
+			hdr[2] = err_state;
+		} else {
+			hdr[2] = cfg_proto_exec(stor, flash, req[0], req + HDR_SZ, sz - HDR_SZ - CRC_SZ, &payload, buff, raw);
+		}
+	}
+	if (hdr[2] != err_ok) {
+		payload.sz = 0;
+		for (i = 0; i < CFG_PROTO_RAW_MAX; ++i) {
+			raw[i].sz = 0;
+		}
+	}
+	out[0] = 0;
+	cobs_enc_begin(&r.enc, out + 1);
+	r.crc = CRC16_INIT;
+	cfg_proto_put(&r, hdr, sizeof(hdr));
+	cfg_proto_put(&r, payload.data, payload.sz);
+	put16(crc, r.crc);
+	cobs_enc_put(&r.enc, crc, CRC_SZ);
+	out_sz = cobs_enc_end(&r.enc) + 1;
+	out[out_sz++] = 0;
+	return out_sz;
+}
+
+int cfg_proto_importing(void)
+{
+	return cfg_import.active;
+}
@@ -1,6 +1,7 @@
 #include "cfg_test.h"
 #include "cfg_storage.h"
 #include "flash_sec.h"
+#include "flash.h"
 #include "debug.h"
 #include "main.h"
 
@@ -10,17 +11,40 @@
 #define SEC1_BASE (FLASH_BASE+1*SECTOR_SZ)
 #define SEC2_BASE (FLASH_BASE+2*SECTOR_SZ)
 #define SEC3_BASE (FLASH_BASE+3*SECTOR_SZ)
-#define TEST_POOL_SZ SECTOR_SZ
-#define TEST_STOR_SZ SECTOR_SZ
 
 __no_init __root uint8_t const cfg_sec_1[SECTOR_SZ] @ SEC1_BASE;
 __no_init __root uint8_t const cfg_sec_2[SECTOR_SZ] @ SEC2_BASE;
 __no_init __root uint8_t const cfg_sec_3[SECTOR_SZ] @ SEC3_BASE;
 
+#ifdef FLASH_DUAL_BANK
+/* The test sectors are placed in the bank 2 while the code is executing from bank 1 */
+#define SEC13_BASE (FLASH_BANK2_BASE+1*SECTOR_SZ)
+#define SEC14_BASE (FLASH_BANK2_BASE+2*SECTOR_SZ)
+#define SEC15_BASE (FLASH_BANK2_BASE+3*SECTOR_SZ)
+
+__no_init __root uint8_t const cfg_sec_13[SECTOR_SZ] @ SEC13_BASE;
+__no_init __root uint8_t const cfg_sec_14[SECTOR_SZ] @ SEC14_BASE;
+__no_init __root uint8_t const cfg_sec_15[SECTOR_SZ] @ SEC15_BASE;
+#endif
+
 struct test_item {
 	unsigned cnt;
 };
 
+/* The test sectors are reserved at the fixed addresses of the default dual bank layout. The sectors erased are
+ * located by flash_sector_info which follows the actual layout so the test refuses to run on the other one.
+ */
+static void cfg_test_check_layout(void)
+{
+#ifdef FLASH_DUAL_BANK
+	/* The 1M device in dual bank mode has the bank 2 at the other address */
+	BUG_ON(FLASH->OPTCR & FLASH_OPTCR_DB1M);
+	/* The banks are swapped while booting from bank 2 */
+	__SYSCFG_CLK_ENABLE();
+	BUG_ON(SYSCFG->MEMRMP & SYSCFG_MEMRMP_UFB_MODE);
+#endif
+}
+
 #define TOUT_PRIME 3571
 #define TOUT_MIN 32
 
@@ -29,13 +53,14 @@ void cfg_test_pool(void)
 	int res;
 	unsigned tout;
 	struct test_item t = {0};
-	struct flash_sec cfg_sec[2] = {
-		FLASH_SEC_INITIALIZER(2, SEC2_BASE, TEST_POOL_SZ),
-		FLASH_SEC_INITIALIZER(3, SEC3_BASE, TEST_POOL_SZ)
-	};
+	struct flash_sec cfg_sec[2];
 	struct cfg_pool  cfg_pool[2];
 	struct test_item const* t_last[2];
 
+	cfg_test_check_layout();
+
+	res = flash_sec_setup(&cfg_sec[0], flash_cfg_sector(2)); BUG_ON(res);
+	res = flash_sec_setup(&cfg_sec[1], flash_cfg_sector(3)); BUG_ON(res);
 	res = cfg_pool_init(&cfg_pool[0], sizeof(struct test_item), &cfg_sec[0]); BUG_ON(res);
 	res = cfg_pool_init(&cfg_pool[1], sizeof(struct test_item), &cfg_sec[1]); BUG_ON(res);
 
@@ -84,15 +109,17 @@ void cfg_test_storage(void)
 	int res;
 	unsigned tout;
 	struct test_item t = {0};
-	struct flash_sec   cfg_sec1 = FLASH_SEC_INITIALIZER(1, SEC1_BASE, TEST_POOL_SZ);
-	struct flash_sec   cfg_sec[2] = {
-		FLASH_SEC_INITIALIZER(2, SEC2_BASE, TEST_STOR_SZ),
-		FLASH_SEC_INITIALIZER(3, SEC3_BASE, TEST_STOR_SZ)
-	};
+	struct flash_sec   cfg_sec1;
+	struct flash_sec   cfg_sec[2];
 	struct cfg_pool    cfg_pool;
 	struct cfg_storage cfg_stor;
 	struct test_item const *p_last, *s_last;
 
+	cfg_test_check_layout();
+
+	res = flash_sec_setup(&cfg_sec1, flash_cfg_sector(1));      BUG_ON(res);
+	res = flash_sec_setup(&cfg_sec[0], flash_cfg_sector(2));    BUG_ON(res);
+	res = flash_sec_setup(&cfg_sec[1], flash_cfg_sector(3));    BUG_ON(res);
 	res = cfg_pool_init(&cfg_pool, sizeof(struct test_item), &cfg_sec1); BUG_ON(res);
 	res = cfg_stor_init(&cfg_stor, sizeof(struct test_item), cfg_sec);   BUG_ON(res);
 
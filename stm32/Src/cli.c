@@ -1,19 +1,89 @@
 #include "cli.h"
 #include "usbd_cdc_if.h"
 #include "errors.h"
+#include "config.h"
+#include "cfg_proto.h"
 
-#define RX_BUFF_SZ 1024
-#define TX_BUFF_SZ 1024
+/* The receive ring buffer may hold several commands so the host may pipeline them.
+ * The OUT endpoint is left NAKing while there is no room for the full packet.
+ * The text commands are terminated by '\r'. The command starting with zero byte is the binary
+ * protocol frame terminated by the next zero byte (see cfg_proto.h).
+ */
+#define RX_RING_SZ 2048 /* power of 2 */
+
+/* The responses are queued as buffer descriptors referencing the data in place (the receive ring,
+ * flash or static memory). The buffers adjacent in memory are chained into the single multi-packet
+ * IN transfer. The short buffers are coalesced into the staging buffer.
+ */
+#define TX_QUEUE_SZ  16 /* power of 2 */
+#define TX_SMALL_SZ  8  /* the room for short reply in the descriptor itself */
+#define TX_STAGE_SZ  256
+#define TX_XFER_MAX  0x4000
+#define TX_ARENA_SZ  4096 /* the room for binary responses */
+#define CMD_TX_DESCS (1 + CFG_PROTO_RAW_MAX) /* the maximum number of descriptors queued per command */
+
+struct cli_tx_desc {
+	uint8_t const*	data;
+	unsigned	sz;
+	unsigned	release; /* the ring position released after the buffer is transmitted */
+	unsigned	arena;   /* the arena position released after the buffer is transmitted */
+	uint8_t		small[TX_SMALL_SZ];
+};
 
 extern USBD_HandleTypeDef *hUsbDevice_0;
 
-uint8_t  rx_buff[RX_BUFF_SZ];
-unsigned rx_sz;
-int      rx_cmd_sz;
-err_t    rx_err;
+/* The ring is filled by the USB interrupt handler and drained by cli_run.
+ * The ring data are released after the responses referencing them are transmitted.
+ * The buffers sent by the USB driver are word aligned so they are copied to FIFO by the fast path.
+ */
+#if defined ( __ICCARM__ )
+  #pragma data_alignment=4
+#endif
+__ALIGN_BEGIN uint8_t rx_ring[RX_RING_SZ] __ALIGN_END;
+volatile unsigned rx_head;
+volatile unsigned rx_tail;
+volatile int      rx_paused; /* the OUT endpoint is not armed */
+volatile int      rx_lost;   /* the data were lost due to ring overflow */
+
+/* The command being received */
+unsigned cmd_start;
+unsigned cmd_scan; /* the position the end of command search stopped at */
+int      cmd_lost;
+int      cmd_bin;  /* the binary frame is being received */
+uint8_t  cmd_frame[CFG_PROTO_REQ_MAX];
+
+struct cli_tx_desc tx_queue[TX_QUEUE_SZ];
+unsigned tx_head;     /* the next free descriptor */
+unsigned tx_tail;     /* the first descriptor not transmitted yet */
+unsigned tx_off;      /* the number of bytes of the tail descriptor transmitted already */
+unsigned tx_next;     /* the tail position after the transfer in progress */
+unsigned tx_next_off;
+unsigned tx_sz;       /* the size of the transfer in progress, 0 if none */
+unsigned tx_release;  /* the ring position released with the descriptors being queued */
+unsigned tx_hold;     /* the commands are not handled till this position since the flash is being sent */
+int      tx_zlp;      /* the transfer ended at the packet boundary */
+#if defined ( __ICCARM__ )
+  #pragma data_alignment=4
+#endif
+__ALIGN_BEGIN uint8_t tx_stage[TX_STAGE_SZ] __ALIGN_END;
+
+/* The encoded binary responses are allocated contiguously from the arena so they are chained as well */
+#if defined ( __ICCARM__ )
+  #pragma data_alignment=4
+#endif
+__ALIGN_BEGIN uint8_t tx_arena[TX_ARENA_SZ] __ALIGN_END;
+unsigned tx_arena_head;
+unsigned tx_arena_tail;
 
-uint8_t  tx_buff[TX_BUFF_SZ];
-unsigned tx_sz;
+static inline unsigned cli_rx_room(void)
+{
+	return RX_RING_SZ - (rx_head - rx_tail);
+}
+
+static inline unsigned cli_tx_room(void)
+{
+	return TX_QUEUE_SZ - (tx_head - tx_tail);
+}
 
 static inline int cli_tx_busy(void)
 {
@@ -24,73 +94,252 @@ static inline int cli_tx_busy(void)
 		return 1;
 }
 
-static err_t cli_reply(void)
+/* Queue the buffer for transmission. The buffer must be kept intact till transmitted. */
+static err_t cli_tx_queue(void const* data, unsigned sz)
+{
+	struct cli_tx_desc* d;
+	if (!cli_tx_room()) {
+		return err_internal;
+	}
+	d = &tx_queue[tx_head % TX_QUEUE_SZ];
+	d->data = data;
+	d->sz = sz;
+	d->release = tx_release;
+	d->arena = tx_arena_head;
+	++tx_head;
+	return err_ok;
+}
+
+/* Return the pointer to the contiguous room of the given size in the arena or 0 if there is no room */
+static uint8_t* cli_tx_reserve(unsigned sz)
+{
+	unsigned pos = tx_arena_head % TX_ARENA_SZ, pad = 0;
+	if (pos + sz > TX_ARENA_SZ) {
+		/* Skip the arena end */
+		pad = TX_ARENA_SZ - pos;
+	}
+	if (pad + sz > TX_ARENA_SZ - (tx_arena_head - tx_arena_tail)) {
+		return 0;
+	}
+	tx_arena_head += pad;
+	return &tx_arena[tx_arena_head % TX_ARENA_SZ];
+}
+
+/* Queue the buffer of the given size written to the room reserved by cli_tx_reserve */
+static err_t cli_tx_queue_arena(unsigned sz)
+{
+	uint8_t* data = &tx_arena[tx_arena_head % TX_ARENA_SZ];
+	tx_arena_head += sz;
+	return cli_tx_queue(data, sz);
+}
+
+/* Start the next IN transfer */
+static void cli_tx_start(void)
 {
-	if (USBD_OK == CDC_Transmit_FS(tx_buff, tx_sz)) {
-		return err_ok;
+	unsigned pos = tx_tail, off = tx_off, sz = 0, n;
+	struct cli_tx_desc const* d = &tx_queue[pos % TX_QUEUE_SZ];
+	uint8_t const* data = d->data + off;
+	if (d->sz - off < USB_FS_MAX_PACKET_SIZE) {
+		/* Coalesce short buffers */
+		for (; pos != tx_head && sz < TX_STAGE_SZ; ++pos, off = 0) {
+			d = &tx_queue[pos % TX_QUEUE_SZ];
+			if ((n = d->sz - off) > TX_STAGE_SZ - sz) {
+				n = TX_STAGE_SZ - sz;
+			}
+			memcpy(tx_stage + sz, d->data + off, n);
+			sz += n;
+			if ((off += n) < d->sz) {
+				break;
+			}
+		}
+		data = tx_stage;
 	} else {
+		/* Chain adjacent buffers */
+		for (; pos != tx_head && sz < TX_XFER_MAX; ++pos, off = 0) {
+			d = &tx_queue[pos % TX_QUEUE_SZ];
+			if (sz && d->data != data + sz) {
+				break;
+			}
+			if ((n = d->sz - off) > TX_XFER_MAX - sz) {
+				n = TX_XFER_MAX - sz;
+			}
+			sz += n;
+			if ((off += n) < d->sz) {
+				break;
+			}
+		}
+	}
+	if (USBD_OK == CDC_Transmit_FS((uint8_t*)data, sz)) {
+		tx_next = pos;
+		tx_next_off = off;
+		tx_sz = sz;
+	}
+}
+
+/* Complete the transfer in progress and start the next one */
+static void cli_tx_run(void)
+{
+	if (cli_tx_busy()) {
+		return;
+	}
+	if (tx_sz) {
+		for (; tx_tail != tx_next; ++tx_tail) {
+			rx_tail = tx_queue[tx_tail % TX_QUEUE_SZ].release;
+			tx_arena_tail = tx_queue[tx_tail % TX_QUEUE_SZ].arena;
+		}
+		tx_off = tx_next_off;
+		tx_zlp = !(tx_sz % USB_FS_MAX_PACKET_SIZE);
 		tx_sz = 0;
+	}
+	if (tx_tail != tx_head) {
+		/* The next transfer continues the stream so ZLP is not needed */
+		cli_tx_start();
+	} else if (tx_zlp) {
+		tx_zlp = 0;
+		CDC_Transmit_FS(tx_stage, 0); // ZLP
+	}
+}
+
+static err_t cli_handle_input(unsigned start, unsigned sz)
+{
+	/* The echo references the command in the ring. It may wrap around the ring end. */
+	unsigned pos = start % RX_RING_SZ, n = RX_RING_SZ - pos;
+	if (n >= sz) {
+		return cli_tx_queue(&rx_ring[pos], sz);
+	}
+	if (cli_tx_queue(&rx_ring[pos], n)) {
 		return err_internal;
 	}
+	return cli_tx_queue(rx_ring, sz - n);
 }
 
-static err_t cli_handle_input(unsigned sz)
+/* Decode the binary frame from the ring and queue the response */
+static void cli_handle_frame(unsigned start, unsigned sz, int lost)
 {
-	memcpy(tx_buff, rx_buff, tx_sz = sz);
-	return cli_reply();
+	struct cobs_dec d;
+	struct cfg_chunk raw[CFG_PROTO_RAW_MAX];
+	uint8_t* out = cli_tx_reserve(CFG_PROTO_OUT_MAX);
+	int len, i;
+	cobs_dec_begin(&d, cmd_frame, sizeof(cmd_frame));
+	for (; sz; --sz, ++start) {
+		cobs_dec_put(&d, rx_ring[start % RX_RING_SZ]);
+	}
+	if ((len = cobs_dec_end(&d)) < 0 || lost) {
+		len = 0;
+	}
+	cli_tx_queue_arena(cfg_proto_handle(cfg_storage(), cfg_sectors(), cmd_frame, len, out, raw));
+	for (i = 0; i < CFG_PROTO_RAW_MAX; ++i) {
+		if (raw[i].sz) {
+			/* The raw flash data are sent in place */
+			cli_tx_queue(raw[i].data, raw[i].sz);
+			tx_hold = tx_head;
+		}
+	}
 }
 
 static void cli_respond_err(err_t res)
 {
-	tx_sz = snprintf((char*)tx_buff, TX_BUFF_SZ, "e%d\r", res);
-	cli_reply();
+	uint8_t* buff = tx_queue[tx_head % TX_QUEUE_SZ].small;
+	cli_tx_queue(buff, snprintf((char*)buff, TX_SMALL_SZ, "e%d\r", res));
 }
 
 int8_t cli_receive(uint8_t* Buf, uint32_t *Len)
 {
-	unsigned len = *Len;
-	if (!rx_err) {
-		if (rx_cmd_sz || rx_sz + len > RX_BUFF_SZ) {
-			rx_err = err_proto;
-		} else {
-			memcpy(rx_buff + rx_sz, Buf, len);
-			rx_sz += len;
-		}
+	unsigned len = *Len, head = rx_head, i;
+	if (len > cli_rx_room()) {
+		/* Should not happen since the endpoint is not armed without room for the full packet */
+		rx_lost = 1;
+		return USBD_OK;
 	}
-	if (Buf[len-1] == '\r') {
-		rx_cmd_sz = !rx_err ? rx_sz : -1;
-		rx_sz = 0;
+	for (i = 0; i < len; ++i, ++head) {
+		rx_ring[head % RX_RING_SZ] = Buf[i];
 	}
+	rx_head = head;
 	return USBD_OK;
 }
 
-void cli_run(void)
+int cli_rx_ready(void)
 {
-	err_t err;
-	unsigned sz;
-	if (cli_tx_busy()) {
-		return;
+	if (cli_rx_room() >= USB_FS_MAX_PACKET_SIZE) {
+		return 1;
 	}
-	if (tx_sz)
-	{
-		if (!(tx_sz % USB_FS_MAX_PACKET_SIZE)) {
-			CDC_Transmit_FS(tx_buff, 0); // ZLP
+	rx_paused = 1;
+	return 0;
+}
+
+/* Re-arm the OUT endpoint paused by cli_rx_ready if there is room for the packet already */
+static void cli_rx_resume(void)
+{
+	if (rx_paused && cli_rx_room() >= USB_FS_MAX_PACKET_SIZE) {
+		rx_paused = 0;
+		USBD_CDC_ReceivePacket(hUsbDevice_0);
+	}
+}
+
+/* Look for the end of the command being received. The command not fitting the ring is dropped.
+ * Return 1 if the command is complete, 0 otherwise.
+ */
+static int cli_rx_cmd(void)
+{
+	unsigned head = rx_head;
+	if (rx_lost) {
+		rx_lost = 0;
+		cmd_lost = 1;
+	}
+	while (cmd_scan != head) {
+		uint8_t c = rx_ring[cmd_scan++ % RX_RING_SZ];
+		if (!cmd_bin && !c && cmd_scan - cmd_start == 1) {
+			cmd_bin = 1;
+			continue;
 		}
-		tx_sz = 0;
-		return;
+		if (c == (cmd_bin ? 0 : '\r')) {
+			return 1;
+		}
+	}
+	if (cmd_scan - cmd_start > RX_RING_SZ - USB_FS_MAX_PACKET_SIZE && rx_tail == cmd_start) {
+		/* All responses are transmitted but the ring is still too full to receive the next packet */
+		cmd_lost = 1;
+		cmd_start = rx_tail = cmd_scan;
 	}
-	if ((sz = rx_cmd_sz)) 
-	{
-		rx_cmd_sz = 0;
-		if (!rx_err) {
-			err = cli_handle_input(sz);
+	return 0;
+}
+
+void cli_run(void)
+{
+	err_t err;
+	cli_tx_run();
+	while (
+		(int)(tx_tail - tx_hold) >= 0 && cli_tx_room() >= CMD_TX_DESCS &&
+		cli_tx_reserve(CFG_PROTO_OUT_MAX) && cli_rx_cmd()
+	) {
+		unsigned start = cmd_start;
+		cmd_start = tx_release = cmd_scan;
+		if (cmd_bin) {
+			/* The empty frame is the delimiter padding */
+			if (cmd_scan - start > 2) {
+				cli_handle_frame(start + 1, cmd_scan - start - 2, cmd_lost);
+			}
+			err = err_ok;
+			cmd_bin = cmd_lost = 0;
+		} else if (!cmd_lost) {
+			err = cli_handle_input(start, cmd_scan - start);
 		} else {
-			err = rx_err;
-			rx_err = err_ok;
+			err = err_proto;
+			cmd_lost = 0;
 		}
 		if (err) {
 			cli_respond_err(err);
 		}
+		if (tx_tail == tx_head) {
+			/* Nothing references the ring */
+			rx_tail = tx_release;
+		}
 	}
+	cli_tx_run();
+	cli_rx_resume();
 }
 
+int cli_flash_held(void)
+{
+	return (int)(tx_tail - tx_hold) < 0 || cfg_proto_importing();
+}
@@ -1,7 +1,56 @@
 #include "config.h"
 #include "cfg_test.h"
+#include "cfg_queue.h"
+#include "events.h"
+#include "flash.h"
+#include "cli.h"
+
+/* The number of update requests that may be pending */
+#define CFG_REQS 8
+
+struct flash_sec   cfg_sec[2];
+struct cfg_storage cfg_stor;
+int                cfg_ready;
+struct cfg_queue   cfg_queue;
+struct cfg_req     cfg_reqs[CFG_REQS];
+uint8_t            cfg_buff[CFG_ITEM_SZ];
 
 void cfg_init(void)
 {
+#ifdef CFG_TEST
 	cfg_test_storage();
+#else
+	cfg_ready = (
+		!flash_sec_setup(&cfg_sec[0], flash_cfg_sector(2)) &&
+		!flash_sec_setup(&cfg_sec[1], flash_cfg_sector(3)) &&
+		!cfg_stor_init(&cfg_stor, CFG_ITEM_SZ, cfg_sec)
+	);
+	cfg_queue_init(&cfg_queue, &cfg_stor, cfg_reqs, CFG_REQS, cfg_buff);
+#endif
+}
+
+struct cfg_storage* cfg_storage(void)
+{
+	return cfg_ready ? &cfg_stor : 0;
+}
+
+struct flash_sec const* cfg_sectors(void)
+{
+	return cfg_sec;
+}
+
+int cfg_post(unsigned off, unsigned len, void const* data)
+{
+	if (!cfg_ready || cfg_queue_post(&cfg_queue, off, len, data)) {
+		return -1;
+	}
+	ev_post(EV_CFG);
+	return 0;
+}
+
+void cfg_run(void)
+{
+	if (cfg_ready && !cli_flash_held()) {
+		cfg_queue_run(&cfg_queue);
+	}
 }
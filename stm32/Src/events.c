@@ -0,0 +1,19 @@
+#include "events.h"
+#include "stm32f4xx_hal.h"
+
+volatile uint32_t ev_pending;
+
+/* The interrupts are masked while checking the mask so the event can't slip in between the check and WFI.
+ * The WFI wakes up on pending interrupt even if it is masked. The interrupt handler runs right after unmasking.
+ * The SysTick is suspended while sleeping so it does not wake the core every millisecond.
+ */
+void ev_wait(void)
+{
+	__disable_irq();
+	if (!ev_pending) {
+		HAL_SuspendTick();
+		__WFI();
+		HAL_ResumeTick();
+	}
+	__enable_irq();
+}
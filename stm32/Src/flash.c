@@ -1,10 +1,217 @@
 #include "flash.h"
+#include "flash_sec.h"
+#include "main.h"
+#include "events.h"
 
 #include <stdint.h>
 #include "stm32f4xx.h"
+#include "stm32f4xx_hal.h"
 #include <stm32f4xx_hal_flash_ex.h>
 
-int flash_erase_sec(int sec_no)
+#define SECTORS_PER_BANK 12
+
+/* Get the descriptor of the sector with the given number within the bank */
+static int flash_bank_sector(int sec_no, int nsectors, struct flash_sector* s)
+{
+	if (sec_no < 0 || sec_no >= nsectors) {
+		return -1;
+	}
+	if (sec_no < 4) {
+		/* 4 x 16k */
+		s->base = sec_no * 0x4000;
+		s->size = 0x4000;
+	} else if (sec_no == 4) {
+		/* 64k */
+		s->base = 0x10000;
+		s->size = 0x10000;
+	} else {
+		/* 128k */
+		s->base = (sec_no - 4) * 0x20000;
+		s->size = 0x20000;
+	}
+	return 0;
+}
+
+#ifdef FLASH_DUAL_BANK
+/* The flash size in KB from the device electronic signature */
+#define FLASH_SIZE_KB (*(uint16_t const volatile*)0x1FFF7A22)
+
+/* Return the number of sectors of the bank of the given size in KB (at least 128k) */
+static int flash_bank_nsectors(unsigned kb)
+{
+	/* 4 x 16k, 64k, then 128k sectors */
+	int n = 5 + (kb - 128) / 128;
+	return n < SECTORS_PER_BANK ? n : SECTORS_PER_BANK;
+}
+
+/* Get the bank 2 base address and the number of sectors per bank. Return 0 if the device has the single bank. */
+static int flash_bank2(unsigned* base, int* nsectors)
+{
+	unsigned kb = FLASH_SIZE_KB;
+	if (kb >= 2048) {
+		*base = FLASH_BANK2_BASE;
+		*nsectors = SECTORS_PER_BANK;
+		return 1;
+	}
+	if (kb == 1024 && (FLASH->OPTCR & FLASH_OPTCR_DB1M)) {
+		/* 1M device in dual bank mode has 8 sectors per bank */
+		*base = FLASH_BASE + 0x80000;
+		*nsectors = flash_bank_nsectors(kb / 2);
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+int flash_sector_info(int sec_no, struct flash_sector* s)
+{
+#ifdef FLASH_DUAL_BANK
+	unsigned bank2_base, bank = 1;
+	int bank_sectors;
+	if (!flash_bank2(&bank2_base, &bank_sectors)) {
+		/* There is no bank 2 so the sectors 12 and above are rejected */
+		if (flash_bank_sector(sec_no, flash_bank_nsectors(FLASH_SIZE_KB), s)) {
+			return -1;
+		}
+		s->base += FLASH_BASE;
+		s->bank = 1;
+		return 0;
+	}
+	if (sec_no >= SECTORS_PER_BANK) {
+		sec_no -= SECTORS_PER_BANK;
+		bank = 2;
+	}
+	if (flash_bank_sector(sec_no, bank_sectors, s)) {
+		return -1;
+	}
+	/* The banks are swapped in the address space while booting from bank 2 */
+	__SYSCFG_CLK_ENABLE();
+	if (SYSCFG->MEMRMP & SYSCFG_MEMRMP_UFB_MODE) {
+		s->base += bank == 1 ? bank2_base : FLASH_BASE;
+	} else {
+		s->base += bank == 1 ? FLASH_BASE : bank2_base;
+	}
+	s->bank = bank;
+	return 0;
+#else
+	if (flash_bank_sector(sec_no, FLASH_SECTOR_TOTAL, s)) {
+		return -1;
+	}
+	s->base += FLASH_BASE;
+	s->bank = 1;
+	return 0;
+#endif
+}
+
+unsigned flash_code_bank(void)
+{
+#ifdef FLASH_DUAL_BANK
+	struct flash_sector s;
+	unsigned addr = (unsigned)flash_code_bank;
+	int i;
+	for (i = 0; i < FLASH_SECTOR_TOTAL; ++i) {
+		if (!flash_sector_info(i, &s) && addr - s.base < s.size) {
+			return s.bank;
+		}
+	}
+#endif
+	return 1;
+}
+
+int flash_cfg_sector(int sec_no)
+{
+#ifdef FLASH_DUAL_BANK
+	unsigned bank2_base;
+	int bank_sectors;
+	if (flash_bank2(&bank2_base, &bank_sectors) && flash_code_bank() == 1) {
+		return sec_no + SECTORS_PER_BANK;
+	}
+#endif
+	return sec_no;
+}
+
+/* The progress hook is called while writing every WRITE_STEP_SZ bytes (about 4 msec) */
+#define WRITE_STEP_SZ 1024
+
+void (*flash_progress_hook)(void);
+
+/* Sector erase timeout. The 128k sector erase takes up to 4s at x8 parallelism. */
+#define ERASE_TOUT_MS 5000
+
+struct flash_erase_stats flash_erase_stats;
+
+/* Erase status: 1 - in progress, 0 - completed, -1 - failed */
+static volatile int flash_erase_status;
+
+/* Called by HAL_FLASH_IRQHandler after every sector erased */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+	/* The last sector is reported as 0xffffffff */
+	if (ReturnValue == 0xffffffff && flash_erase_status > 0) {
+		flash_erase_status = 0;
+		ev_post(EV_FLASH);
+	}
+}
+
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+	flash_erase_status = -1;
+	ev_post(EV_FLASH);
+}
+
+/* Estimate energy in uJ spent during the given number of cycles at the given supply current */
+static uint32_t flash_energy_uj(uint32_t cycles, uint32_t ua)
+{
+	return (uint32_t)((uint64_t)FLASH_VDD_MV * ua * cycles / 1000 / SystemCoreClock);
+}
+
+/* Sleep till the erase completes. The interrupts are masked while checking the status so the
+ * completion interrupt can't slip in between the check and WFI. The WFI wakes up on pending interrupt
+ * even if it is masked. The interrupt handler runs right after unmasking. The SysTick wakes the CPU
+ * every millisecond so the timeout is checked regularly.
+ */
+static int flash_erase_wait(void)
+{
+	struct flash_erase_stats* st = &flash_erase_stats;
+	uint32_t start_ms = HAL_GetTick(), start = DWT->CYCCNT, woken = start, awake = 0, cycles;
+	int res;
+	for (;;) {
+		__disable_irq();
+		if (flash_erase_status <= 0) {
+			res = flash_erase_status;
+			break;
+		}
+		if (HAL_GetTick() - start_ms > ERASE_TOUT_MS) {
+			/* The controller is still busy so the next erase fails as well */
+			res = -1;
+			break;
+		}
+		awake += DWT->CYCCNT - woken;
+		__WFI();
+		woken = DWT->CYCCNT;
+		__enable_irq();
+		++st->wakeups;
+		flash_progress();
+	}
+	cycles = DWT->CYCCNT;
+	__enable_irq();
+	st->last_latency = cycles - woken;
+	awake += st->last_latency;
+	cycles -= start;
+	if (st->max_latency < st->last_latency) {
+		st->max_latency = st->last_latency;
+	}
+	st->last_cycles = cycles;
+	st->last_awake = awake;
+	st->last_energy_uj =
+		flash_energy_uj(awake, FLASH_RUN_UA) +
+		flash_energy_uj(cycles - awake, FLASH_SLEEP_UA) +
+		flash_energy_uj(cycles, FLASH_ERASE_UA);
+	st->total_energy_uj += st->last_energy_uj;
+	return res;
+}
+
+int flash_erase_start(int sec_no)
 {
 	FLASH_EraseInitTypeDef er = {
 		.TypeErase = FLASH_TYPEERASE_SECTORS,
@@ -12,11 +219,40 @@ int flash_erase_sec(int sec_no)
 		.NbSectors = 1,
 		.VoltageRange = FLASH_VOLTAGE_RANGE_3
 	};
-	uint32_t fault_sec = 0;
+	DWT_Init();
+	HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(FLASH_IRQn);
+	flash_erase_status = 1;
 	HAL_FLASH_Unlock();
-	HAL_StatusTypeDef res = HAL_FLASHEx_Erase(&er, &fault_sec);
-	HAL_FLASH_Lock();
-	return res == HAL_OK ? 0 : -1;
+	if (HAL_FLASHEx_Erase_IT(&er) != HAL_OK) {
+		HAL_FLASH_Lock();
+		flash_erase_status = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int flash_erase_poll(void)
+{
+	int res = flash_erase_status;
+	if (res <= 0) {
+		HAL_FLASH_Lock();
+	}
+	return res;
+}
+
+int flash_erase_sec(int sec_no)
+{
+	int res = -1;
+	if (!flash_erase_start(sec_no)) {
+		res = flash_erase_wait();
+		HAL_FLASH_Lock();
+	}
+	++flash_erase_stats.erases;
+	if (res) {
+		++flash_erase_stats.errors;
+	}
+	return res;
 }
 
 int flash_write(unsigned addr, void const* data, unsigned sz)
@@ -34,6 +270,9 @@ int flash_write(unsigned addr, void const* data, unsigned sz)
 		data = (uint32_t const*)data + 1;
 		if (res != HAL_OK)
 			goto done;
+		if (!(addr % WRITE_STEP_SZ)) {
+			flash_progress();
+		}
 	}
 	for (; sz >= 1; sz -= 1, addr += 1) {
 		res = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, addr, *(uint8_t const*)data);
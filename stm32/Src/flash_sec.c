@@ -16,3 +16,12 @@ int flash_sec_write_bytes(struct flash_sec const* sec, unsigned off, void const*
 	return flash_write_bytes(sec->base + off, data, sz);
 }
 
+int flash_sec_setup(struct flash_sec* sec, int sec_no)
+{
+	struct flash_sector s;
+	if (flash_sector_info(sec_no, &s)) {
+		return -1;
+	}
+	flash_sec_init(sec, sec_no, s.base, s.size);
+	return 0;
+}
@@ -39,6 +39,7 @@
 #include "main.h"
 #include "cli.h"
 #include "config.h"
+#include "events.h"
 /* USER CODE END Includes */
 
 /* Private variables ---------------------------------------------------------*/
@@ -65,7 +66,7 @@ int main(void)
 {
 
   /* USER CODE BEGIN 1 */
-
+  uint32_t ev;
   /* USER CODE END 1 */
 
   /* MCU Configuration----------------------------------------------------------*/
@@ -82,6 +83,7 @@ int main(void)
   MX_USB_DEVICE_Init();
 
   /* USER CODE BEGIN 2 */
+	DWT_Init();
 	cfg_init();
   /* USER CODE END 2 */
 
@@ -92,7 +94,16 @@ int main(void)
   /* USER CODE END WHILE */
 
   /* USER CODE BEGIN 3 */
-    cli_run();
+    /* The CLI makes progress on USB events only. The events posted while it runs wake ev_wait immediately. */
+    ev = ev_take();
+    if (ev & (EV_USB_RX | EV_USB_TX)) {
+      cli_run();
+    }
+    /* The configuration updates deferred while the CLI holds the flash are retried on the USB events */
+    if (ev) {
+      cfg_run();
+    }
+    ev_wait();
 
   }
   /* USER CODE END 3 */
@@ -190,6 +201,15 @@ void LED_Toggle(void)
   HAL_GPIO_TogglePin(LED_PORT, LED_PIN);
 }
 
+void DWT_Init(void)
+{
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+}
+
 #ifdef USE_FULL_ASSERT
 void assertion_failed(const char* file, unsigned line)
 {
@@ -0,0 +1,126 @@
+#include "spi_nor_bus.h"
+#include "stm32f4xx_hal.h"
+
+#define NOR_SPI      SPI1
+#define NOR_CS_PORT  GPIOA
+#define NOR_CS_PIN   GPIO_PIN_4
+#define NOR_DMA_RX   DMA2_Stream0
+#define NOR_DMA_TX   DMA2_Stream3
+#define NOR_DMA_CH   DMA_CHANNEL_3
+
+/* Stream 0 and 3 interrupt flags */
+#define DMA_RX_FLAGS (DMA_LIFCR_CTCIF0|DMA_LIFCR_CHTIF0|DMA_LIFCR_CTEIF0|DMA_LIFCR_CDMEIF0|DMA_LIFCR_CFEIF0)
+#define DMA_TX_FLAGS (DMA_LIFCR_CTCIF3|DMA_LIFCR_CHTIF3|DMA_LIFCR_CTEIF3|DMA_LIFCR_CDMEIF3|DMA_LIFCR_CFEIF3)
+
+/* The short transfers are faster without DMA */
+#define DMA_MIN_SZ 16
+/* The DMA transfer size limit */
+#define DMA_MAX_SZ 0x8000
+
+static int spi_nor_xfer(void* ctx, uint8_t const* cmd, unsigned cmd_sz, void const* tx, void* rx, unsigned sz);
+
+struct spi_nor_bus const spi_nor_bus = {spi_nor_xfer, 0};
+
+void spi_nor_bus_init(void)
+{
+	GPIO_InitTypeDef gpio;
+
+	__GPIOA_CLK_ENABLE();
+	__SPI1_CLK_ENABLE();
+	__DMA2_CLK_ENABLE();
+
+	HAL_GPIO_WritePin(NOR_CS_PORT, NOR_CS_PIN, GPIO_PIN_SET);
+	gpio.Pin = NOR_CS_PIN;
+	gpio.Mode = GPIO_MODE_OUTPUT_PP;
+	gpio.Pull = GPIO_NOPULL;
+	gpio.Speed = GPIO_SPEED_FAST;
+	HAL_GPIO_Init(NOR_CS_PORT, &gpio);
+
+	gpio.Pin = GPIO_PIN_5|GPIO_PIN_6|GPIO_PIN_7;
+	gpio.Mode = GPIO_MODE_AF_PP;
+	gpio.Alternate = GPIO_AF5_SPI1;
+	HAL_GPIO_Init(GPIOA, &gpio);
+
+	/* Master, mode 0, software chip select, PCLK2 / 2 */
+	NOR_SPI->CR1 = SPI_CR1_MSTR|SPI_CR1_SSM|SPI_CR1_SSI;
+	NOR_SPI->CR2 = 0;
+	NOR_SPI->CR1 |= SPI_CR1_SPE;
+}
+
+/* Transfer byte without DMA */
+static uint8_t spi_xfer_byte(uint8_t b)
+{
+	while (!(NOR_SPI->SR & SPI_SR_TXE));
+	*(__IO uint8_t*)&NOR_SPI->DR = b;
+	while (!(NOR_SPI->SR & SPI_SR_RXNE));
+	return *(__IO uint8_t*)&NOR_SPI->DR;
+}
+
+static void spi_dma_setup(DMA_Stream_TypeDef* s, uint32_t dir, void const* mem, int minc, unsigned sz)
+{
+	s->CR = 0;
+	while (s->CR & DMA_SxCR_EN);
+	s->PAR = (uint32_t)&NOR_SPI->DR;
+	s->M0AR = (uint32_t)mem;
+	s->NDTR = sz;
+	s->FCR = 0;
+	s->CR = NOR_DMA_CH | dir | (minc ? DMA_SxCR_MINC : 0) | DMA_SxCR_EN;
+}
+
+/* Transfer the payload by DMA. The other direction uses dummy byte. */
+static int spi_xfer_dma(void const* tx, void* rx, unsigned sz)
+{
+	static uint8_t const tx_dummy = 0xff;
+	static uint8_t rx_dummy;
+	int res = 0;
+	DMA2->LIFCR = DMA_RX_FLAGS|DMA_TX_FLAGS;
+	spi_dma_setup(NOR_DMA_RX, DMA_PERIPH_TO_MEMORY, rx ? rx : &rx_dummy, rx != 0, sz);
+	spi_dma_setup(NOR_DMA_TX, DMA_MEMORY_TO_PERIPH, tx ? tx : &tx_dummy, tx != 0, sz);
+	NOR_SPI->CR2 = SPI_CR2_RXDMAEN|SPI_CR2_TXDMAEN;
+	/* The RX completes last */
+	while (!(DMA2->LISR & (DMA_LISR_TCIF0|DMA_LISR_TEIF0)));
+	if (DMA2->LISR & (DMA_LISR_TEIF0|DMA_LISR_TEIF3)) {
+		res = -1;
+	}
+	NOR_SPI->CR2 = 0;
+	NOR_DMA_RX->CR = 0;
+	NOR_DMA_TX->CR = 0;
+	DMA2->LIFCR = DMA_RX_FLAGS|DMA_TX_FLAGS;
+	return res;
+}
+
+static int spi_nor_xfer(void* ctx, uint8_t const* cmd, unsigned cmd_sz, void const* tx, void* rx, unsigned sz)
+{
+	uint8_t const* src = tx;
+	uint8_t* dst = rx;
+	int res = 0;
+	HAL_GPIO_WritePin(NOR_CS_PORT, NOR_CS_PIN, GPIO_PIN_RESET);
+	for (; cmd_sz; --cmd_sz) {
+		spi_xfer_byte(*cmd++);
+	}
+	while (sz && !res) {
+		unsigned n = sz < DMA_MAX_SZ ? sz : DMA_MAX_SZ;
+		if (n < DMA_MIN_SZ) {
+			unsigned i;
+			for (i = 0; i < n; ++i) {
+				uint8_t b = spi_xfer_byte(src ? src[i] : 0xff);
+				if (dst) {
+					dst[i] = b;
+				}
+			}
+		} else {
+			res = spi_xfer_dma(src, dst, n);
+		}
+		if (src) {
+			src += n;
+		}
+		if (dst) {
+			dst += n;
+		}
+		sz -= n;
+	}
+	/* Wait the last byte is shifted out before releasing chip select */
+	while (NOR_SPI->SR & SPI_SR_BSY);
+	HAL_GPIO_WritePin(NOR_CS_PORT, NOR_CS_PIN, GPIO_PIN_SET);
+	return res;
+}
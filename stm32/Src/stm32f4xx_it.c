@@ -37,6 +37,8 @@
 
 /* USER CODE BEGIN 0 */
 
+struct usb_irq_stats usb_irq_stats;
+
 /* USER CODE END 0 */
 
 /* External variables --------------------------------------------------------*/
@@ -68,17 +70,36 @@ void SysTick_Handler(void)
 /* please refer to the startup file (startup_stm32f4xx.s).                    */
 /******************************************************************************/
 
+/**
+* @brief This function handles Flash global interrupt.
+*/
+void FLASH_IRQHandler(void)
+{
+  /* USER CODE BEGIN FLASH_IRQn 0 */
+
+  /* USER CODE END FLASH_IRQn 0 */
+  HAL_FLASH_IRQHandler();
+  /* USER CODE BEGIN FLASH_IRQn 1 */
+
+  /* USER CODE END FLASH_IRQn 1 */
+}
+
 /**
 * @brief This function handles USB On The Go FS global interrupt.
 */
 void OTG_FS_IRQHandler(void)
 {
   /* USER CODE BEGIN OTG_FS_IRQn 0 */
-
+  uint32_t cycles = DWT->CYCCNT;
   /* USER CODE END OTG_FS_IRQn 0 */
   HAL_PCD_IRQHandler(&hpcd_USB_OTG_FS);
   /* USER CODE BEGIN OTG_FS_IRQn 1 */
-
+  cycles = DWT->CYCCNT - cycles;
+  ++usb_irq_stats.count;
+  usb_irq_stats.cycles += cycles;
+  if (usb_irq_stats.max_cycles < cycles) {
+    usb_irq_stats.max_cycles = cycles;
+  }
   /* USER CODE END OTG_FS_IRQn 1 */
 }
 
@@ -47,6 +47,7 @@
   */ 
   /* USER CODE BEGIN 0 */ 
 #include "cli.h"
+#include "events.h"
   /* USER CODE END 0 */ 
 /**
   * @}
@@ -99,11 +100,18 @@ LINE_CODING linecoding =
   */
 /* Create buffer for reception and transmission           */
 /* It's up to user to redefine and/or remove those define */
+/* The buffers are word aligned so the packets are copied to / from FIFO by the fast path */
 /* Received Data over USB are stored in this buffer       */
-uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
+#if defined ( __ICCARM__ ) /*!< IAR Compiler */
+  #pragma data_alignment=4   
+#endif
+__ALIGN_BEGIN uint8_t UserRxBufferFS[APP_RX_DATA_SIZE] __ALIGN_END;
 
 /* Send Data over USB CDC are stored in this buffer       */
-uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
+#if defined ( __ICCARM__ ) /*!< IAR Compiler */
+  #pragma data_alignment=4   
+#endif
+__ALIGN_BEGIN uint8_t UserTxBufferFS[APP_TX_DATA_SIZE] __ALIGN_END;
 
 /* USB handler declaration */
 /* Handle for USB Full Speed IP */
@@ -262,7 +270,10 @@ static int8_t CDC_Receive_FS (uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
   int8_t res = cli_receive(Buf, Len);
-  USBD_CDC_ReceivePacket(hUsbDevice_0);
+  ev_post(EV_USB_RX);
+  if (cli_rx_ready()) {
+    USBD_CDC_ReceivePacket(hUsbDevice_0);
+  }
   return res;
   /* USER CODE END 6 */ 
 }
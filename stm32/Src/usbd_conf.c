@@ -36,6 +36,7 @@
 #include "stm32f4xx_hal.h"
 #include "usbd_def.h"
 #include "usbd_core.h"
+#include "events.h"
 
 PCD_HandleTypeDef hpcd_USB_OTG_FS;
 
@@ -142,6 +143,9 @@ void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
   USBD_LL_DataInStage(hpcd->pData, epnum, hpcd->IN_ep[epnum].xfer_buff);
+  if (epnum) {
+    ev_post(EV_USB_TX);
+  }
 }
 
 /**
@@ -0,0 +1,98 @@
+"""
+USB CDC throughput and latency benchmark against the firmware CLI (stm32/Src/cli.c)
+
+Usage: cdc_bench.py port [count [window]]
+
+The echo commands of every size are pipelined keeping up to window commands in flight. The sizes include
+the terminating '\\r' and cover the exact multiples of the 64 bytes packet. For every size it prints the
+throughput, the round trip latency percentiles and the error count. The port may be the pseudo terminal
+of host/cli_pty so the benchmark runs without the board.
+"""
+
+import os
+import random
+import sys
+import threading
+import time
+
+SIZES = (1, 2, 8, 16, 32, 63, 64, 65, 127, 128, 129, 192, 256, 512, 640, 1023, 1024)
+TIMEOUT = 5
+
+class PosixPort:
+	"""Minimal raw serial port for the systems without pyserial"""
+	def __init__(self, name, timeout):
+		import termios, tty
+		self.fd, self.timeout = os.open(name, os.O_RDWR | os.O_NOCTTY), timeout
+		tty.setraw(self.fd, termios.TCSANOW)
+
+	def write(self, data):
+		while data:
+			data = data[os.write(self.fd, data):]
+
+	def read(self, sz):
+		import select
+		buff = b''
+		while len(buff) < sz:
+			if not select.select([self.fd], [], [], self.timeout)[0]:
+				break
+			buff += os.read(self.fd, sz - len(buff))
+		return buff
+
+def open_port(name):
+	try:
+		import serial
+		return serial.Serial(name, timeout = TIMEOUT)
+	except ImportError:
+		return PosixPort(name, TIMEOUT)
+
+def random_cmd(sz):
+	return bytes(random.randrange(ord('A'), ord('Z') + 1) for i in range(sz - 1)) + b'\r'
+
+def percentile(v, p):
+	return v[min(len(v) - 1, int(len(v) * p / 100))]
+
+def bench(com, sz, count, window):
+	cmds = [random_cmd(sz) for i in range(count)]
+	sent, slots, errors = [], threading.Semaphore(window), 0
+	def writer():
+		for c in cmds:
+			slots.acquire()
+			sent.append(time.time())
+			com.write(c)
+	t = threading.Thread(target = writer)
+	start = time.time()
+	t.start()
+	rtt = []
+	for i, c in enumerate(cmds):
+		r = com.read(sz)
+		rtt.append(time.time() - sent[i])
+		slots.release()
+		if r != c:
+			errors += 1
+			if len(r) < sz:
+				# Timed out so the rest of responses are lost as well
+				errors += count - i - 1
+				slots.release(count)
+				break
+	elapsed = time.time() - start
+	t.join()
+	rtt.sort()
+	return sz * len(rtt) / elapsed, rtt, errors
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print(__doc__)
+		sys.exit(1)
+	count = int(sys.argv[2]) if len(sys.argv) > 2 else 1000
+	window = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+	com = open_port(sys.argv[1])
+	total_errors = 0
+	print('%6s %10s %9s %9s %9s %9s %7s' % ('size', 'KB/s', 'p50 ms', 'p90 ms', 'p99 ms', 'max ms', 'errors'))
+	for sz in SIZES:
+		rate, rtt, errors = bench(com, sz, count, window)
+		total_errors += errors
+		print('%6u %10.1f %9.3f %9.3f %9.3f %9.3f %7u' % (
+			sz, rate / 1e3, percentile(rtt, 50) * 1e3, percentile(rtt, 90) * 1e3,
+			percentile(rtt, 99) * 1e3, rtt[-1] * 1e3, errors
+		))
+	sys.exit(1 if total_errors else 0)
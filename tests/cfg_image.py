@@ -0,0 +1,35 @@
+"""
+Export / import of the raw configuration storage images with transfer rate measurement
+
+Usage: cfg_image.py port export|import file [repeat]
+"""
+
+import sys
+import time
+from cfg_proto import Client
+from cdc_bench import open_port
+
+def rate(sz, t):
+	return '%u bytes in %.3f sec, %.3f MB/s' % (sz, t, sz / t / 1e6)
+
+if __name__ == '__main__':
+	port, cmd, fname = sys.argv[1:4]
+	repeat = int(sys.argv[4]) if len(sys.argv) > 4 else 1
+	cli = Client(open_port(port))
+	if cmd == 'export':
+		for i in range(repeat):
+			t = time.time()
+			img0, img1 = cli.export_image()
+			print(rate(len(img0) + len(img1), time.time() - t))
+		with open(fname, 'wb') as f:
+			f.write(img0 + img1)
+	elif cmd == 'import':
+		with open(fname, 'rb') as f:
+			img = f.read()
+		sec_sz = cli.stats()['sec_sz']
+		for i in range(repeat):
+			t = time.time()
+			cli.import_image(img[:sec_sz], img[sec_sz:])
+			print(rate(len(img), time.time() - t))
+	else:
+		print(__doc__)
@@ -0,0 +1,134 @@
+"""
+Binary configuration protocol client (see stm32/Inc/cfg_proto.h)
+"""
+
+import struct
+
+GET, SET, COMMIT, ERASE, STATS, HISTORY, EXPORT, IMPORT, IMPORT_DATA, IMPORT_END, IMPORT_ABORT = range(1, 12)
+
+DATA_MAX = 1024
+
+class ProtoError(Exception):
+	def __init__(self, cmd, status):
+		Exception.__init__(self, 'command %d failed with status %d' % (cmd, status))
+		self.cmd, self.status = cmd, status
+
+def crc16(data, crc = 0xffff):
+	for b in bytearray(data):
+		b ^= crc & 0xff
+		b = (b ^ (b << 4)) & 0xff
+		crc = ((b << 8) | (crc >> 8)) ^ (b >> 4) ^ (b << 3)
+		crc &= 0xffff
+	return crc
+
+def cobs_encode(data):
+	out, block = bytearray(), bytearray()
+	for b in bytearray(data):
+		if b:
+			block.append(b)
+			if len(block) < 254:
+				continue
+		out.append(len(block) + 1)
+		out += block
+		block = bytearray()
+	out.append(len(block) + 1)
+	out += block
+	return out
+
+def cobs_decode(data):
+	out, data, i = bytearray(), bytearray(data), 0
+	while i < len(data):
+		code = data[i]
+		if not code or i + code > len(data):
+			raise ValueError('malformed frame')
+		out += data[i + 1 : i + code]
+		i += code
+		if code < 0xff and i < len(data):
+			out.append(0)
+	return out
+
+class Client:
+	def __init__(self, com):
+		self.com, self.id = com, 0
+
+	def send(self, cmd, payload = b''):
+		"""Send the request without waiting for the response. Return the request id."""
+		self.id = (self.id + 1) & 0xff
+		frame = bytearray([cmd, self.id]) + bytearray(payload)
+		frame += struct.pack('<H', crc16(frame))
+		self.com.write(bytes(bytearray([0]) + cobs_encode(frame) + bytearray([0])))
+		return self.id
+
+	def recv_frame(self):
+		buff = bytearray()
+		while True:
+			b = bytearray(self.com.read(1))
+			if not b:
+				raise IOError('timeout')
+			if b[0]:
+				buff += b
+			elif buff:
+				return cobs_decode(buff)
+
+	def recv(self, cmd, rid):
+		"""Receive the response to the request sent. Return the payload."""
+		frame = self.recv_frame()
+		if len(frame) < 5 or crc16(frame[:-2]) != struct.unpack('<H', bytes(frame[-2:]))[0]:
+			raise ValueError('bad response')
+		if frame[0] != cmd or frame[1] != rid:
+			raise ValueError('unexpected response')
+		if frame[2]:
+			raise ProtoError(cmd, frame[2])
+		return bytes(frame[3:-2])
+
+	def call(self, cmd, payload = b''):
+		return self.recv(cmd, self.send(cmd, payload))
+
+	def get(self, off = None, sz = None):
+		return self.call(GET, b'' if off is None else struct.pack('<HH', off, sz))
+
+	def set(self, off, data):
+		self.call(SET, struct.pack('<H', off) + data)
+
+	def commit(self, item):
+		self.call(COMMIT, item)
+
+	def erase(self):
+		self.call(ERASE)
+
+	def stats(self):
+		keys = ('item_sz', 'rec_sz', 'sec_sz', 'epoch', 'put_cnt0', 'put_cnt1', 'erase_cnt0', 'erase_cnt1')
+		return dict(zip(keys, struct.unpack('<HHIBIIII', self.call(STATS))))
+
+	def history(self, n):
+		return self.call(HISTORY, struct.pack('<H', n))
+
+	def export_image(self):
+		"""Read the raw images of both sectors"""
+		sz0, sz1, crc = struct.unpack('<IIH', self.call(EXPORT))
+		img = bytearray()
+		while len(img) < sz0 + sz1:
+			b = self.com.read(sz0 + sz1 - len(img))
+			if not b:
+				raise IOError('timeout')
+			img += bytearray(b)
+		if crc16(img) != crc:
+			raise ValueError('image checksum mismatch')
+		return bytes(img[:sz0]), bytes(img[sz0:])
+
+	def import_image(self, img0, img1, chunk = DATA_MAX - 4, window = 8):
+		"""Program the raw images of both sectors. Up to window chunks are sent without waiting for responses."""
+		img = bytearray(img0) + bytearray(img1)
+		self.call(IMPORT, struct.pack('<IIH', len(img0), len(img1), crc16(img)))
+		pending = []
+		for off in range(0, len(img), chunk):
+			pending.append(self.send(IMPORT_DATA, struct.pack('<I', off) + img[off : off + chunk]))
+			if len(pending) >= window:
+				self.recv(IMPORT_DATA, pending.pop(0))
+		for rid in pending:
+			self.recv(IMPORT_DATA, rid)
+		self.call(IMPORT_END)
+
+	def import_abort(self):
+		"""Leave the interrupted import erasing the partial image"""
+		self.call(IMPORT_ABORT)